@@ -0,0 +1,315 @@
+/*
+异步文件接口：aio_open/aio_read/aio_write/aio_close提交请求后立即返回，
+请求完成后，提交请求的线程调用aio_poll时执行其回调，回调的参数与对应sys_*的返回值相同，
+因此一个线程就可以同时发出大量请求，不会因为某一次读盘而停下
+读写使用请求中给出的位置，不改变文件描述符的读写位置(类似pread/pwrite)，
+同一个文件上同时进行的请求之间没有先后顺序
+请求完成前buf要一直有效，提交请求的线程退出时会等待它的请求全部完成，
+但不再执行回调
+读请求先在提交线程中以不等待磁盘的方式尝试(见bread_nowait_begin)，数据都在缓冲区中时
+直接完成，否则与其他请求一样交给I/O线程，由I/O线程执行会等待磁盘的部分
+*/
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "fs.h"
+#include "sys.h"
+
+/*执行请求的I/O线程数，它们大部分时间在等待磁盘，可以多于CPU数*/
+#define AIO_THREADS 8
+
+enum aio_op { AIO_OPEN, AIO_READ, AIO_WRITE, AIO_CLOSE };
+
+struct aio_ctx;
+
+struct aio_req {
+  int op;
+  struct aio_ctx* ctx;      // 提交请求的线程
+  struct session* session;  // 提交请求的会话，打开的文件放入它的文件描述符表
+  struct m_inode* inode;    // 请求持有它的一个引用
+  struct file* filp;        // 读写时为文件的副本，关闭时为被关闭的文件
+  std::string path;
+  int flag, mode;
+  char* buf;
+  int count;
+  int res;
+  aio_callback cb;
+};
+
+/*
+每个提交请求的线程一个，记录已完成而还未执行回调的请求
+队列锁不在lock.h的层次中：持有它时不会再获取文件系统的锁
+请求中记录的是提交线程的aio_ctx，线程退出时析构要等它的请求全部完成
+*/
+struct aio_ctx {
+  std::mutex lock;
+  std::condition_variable cv;
+  std::vector<struct aio_req*> done;
+  int inflight;  // 已提交而还未执行回调的请求数
+  ~aio_ctx();
+};
+static thread_local struct aio_ctx ctx;
+
+/*
+I/O线程的请求队列
+I/O线程一直等待请求，不会退出，因此队列不能在进程退出时析构
+(析构还有线程在等待的条件变量会一直阻塞)
+*/
+struct aio_queue {
+  std::mutex lock;
+  std::condition_variable cv;
+  std::deque<struct aio_req*> reqs;
+  int started;
+};
+static struct aio_queue& queue = *new aio_queue();
+
+static void complete(struct aio_req* req) {
+  struct aio_ctx* c = req->ctx;
+  std::lock_guard<std::mutex> g(c->lock);
+  c->done.push_back(req);
+  c->cv.notify_one();
+}
+
+static int do_read(struct aio_req* req) {
+  struct m_inode* inode = req->inode;
+  int count = req->count;
+
+  if (!(S_ISDIR(inode->i_mode) || S_ISREG(inode->i_mode))) return -EINVAL;
+  if (count + req->filp->f_pos > inode->i_size)
+    count = inode->i_size - req->filp->f_pos;
+  if (count <= 0) return 0;
+  return file_read(inode, req->filp, req->buf, count);
+}
+
+/*在I/O线程中执行请求*/
+static void run(struct aio_req* req) {
+  switch (req->op) {
+    case AIO_OPEN: {
+      // 相对路径从提交请求时的工作目录开始查找
+      struct session s;
+      s.pwd = req->inode;
+      current = &s;
+      req->res = open_file(req->path.c_str(), req->flag, req->mode, req->inode);
+      if (req->res < 0) req->inode = NULL;
+      current = NULL;
+      iput(s.pwd);
+      break;
+    }
+    case AIO_READ:
+      lock_inode_shared(req->inode);
+      req->res = do_read(req);
+      unlock_inode_shared(req->inode);
+      break;
+    case AIO_WRITE:
+      if (!S_ISREG(req->inode->i_mode)) {
+        req->res = -EINVAL;
+        break;
+      }
+      lock_inode(req->inode);
+      req->res = file_write(req->inode, req->filp, req->buf, req->count);
+      unlock_inode(req->inode);
+      break;
+    case AIO_CLOSE:
+      // 最后一个引用可能需要写回inode，在I/O线程中释放
+      iput(req->inode);
+      req->inode = NULL;
+      delete req->filp;
+      req->filp = NULL;
+      req->res = 0;
+      break;
+  }
+  complete(req);
+}
+
+static void io_thread() {
+  struct aio_req* req;
+  for (;;) {
+    {
+      std::unique_lock<std::mutex> g(queue.lock);
+      queue.cv.wait(g, [] { return !queue.reqs.empty(); });
+      req = queue.reqs.front();
+      queue.reqs.pop_front();
+    }
+    run(req);
+  }
+}
+
+static void submit(struct aio_req* req) {
+  std::lock_guard<std::mutex> g(queue.lock);
+  if (!queue.started) {
+    for (int i = 0; i < AIO_THREADS; i++) std::thread(io_thread).detach();
+    queue.started = 1;
+  }
+  queue.reqs.push_back(req);
+  queue.cv.notify_one();
+}
+
+static struct aio_req* new_req(int op, aio_callback cb) {
+  struct aio_req* req = new aio_req();
+  req->op = op;
+  req->ctx = &ctx;
+  req->session = current;
+  req->cb = std::move(cb);
+  ctx.inflight++;
+  return req;
+}
+
+/*读写请求带上文件的副本，其中的f_pos为请求的位置*/
+static struct aio_req* new_rw_req(int op, unsigned int fd, char* buf, int count,
+                                  off_t pos, aio_callback& cb) {
+  struct file* f = get_file(fd);
+  struct aio_req* req;
+
+  if (!f) return NULL;
+  req = new_req(op, std::move(cb));
+  req->filp = new file(*f);
+  req->filp->f_pos = pos;
+  req->inode = igrab(f->f_inode);
+  req->buf = buf;
+  req->count = count;
+  return req;
+}
+
+/*
+ * @brief 异步打开文件，完成时回调的参数为文件描述符或错误码
+ * @return 提交成功返回0，否则返回错误码(不会回调)
+ */
+int aio_open(const std::string& filename, int flag, int mode, aio_callback cb) {
+  struct aio_req* req;
+
+  if (!current->pwd) return -ENOENT;
+  req = new_req(AIO_OPEN, std::move(cb));
+  req->path = filename;
+  req->flag = flag;
+  req->mode = mode;
+  req->inode = igrab(current->pwd);
+  submit(req);
+  return 0;
+}
+
+/*
+ * @brief 异步读取，从pos开始读取count字节到buf中，buf至少需要count+1字节
+ * @return 提交成功返回0，fd无效返回错误码(不会回调)
+ */
+int aio_read(unsigned int fd, char* buf, int count, off_t pos,
+             aio_callback cb) {
+  struct aio_req* req;
+  int missed;
+
+  if (count < 0 || !(req = new_rw_req(AIO_READ, fd, buf, count, pos, cb)))
+    return -EINVAL;
+  // 能立即拿到读锁时先只用缓冲区中的block尝试，成功则不必交给I/O线程
+  if (trylock_inode_shared(req->inode)) {
+    bread_nowait_begin();
+    req->res = do_read(req);
+    missed = bread_nowait_end();
+    unlock_inode_shared(req->inode);
+    if (!missed) {
+      complete(req);
+      return 0;
+    }
+    req->filp->f_pos = pos;
+  }
+  submit(req);
+  return 0;
+}
+
+/*
+ * @brief 异步写入，把buf中的count字节写到pos处(O_APPEND时写到文件末尾)
+ * @return 提交成功返回0，fd无效返回错误码(不会回调)
+ */
+int aio_write(unsigned int fd, char* buf, int count, off_t pos,
+              aio_callback cb) {
+  struct aio_req* req;
+
+  if (count < 0 || !(req = new_rw_req(AIO_WRITE, fd, buf, count, pos, cb)))
+    return -EINVAL;
+  submit(req);
+  return 0;
+}
+
+/*
+ * @brief 异步关闭文件，文件描述符立即可以重新使用
+ * @return 提交成功返回0，fd无效返回错误码(不会回调)
+ */
+int aio_close(unsigned int fd, aio_callback cb) {
+  struct file* f = get_file(fd);
+  struct aio_req* req;
+
+  if (!f) return -EINVAL;
+  req = new_req(AIO_CLOSE, std::move(cb));
+  if (--f->f_count) {
+    complete(req);
+    return 0;
+  }
+  current->filp[fd] = NULL;
+  req->filp = f;
+  req->inode = f->f_inode;
+  submit(req);
+  return 0;
+}
+
+/*
+ * @brief 执行已完成请求的回调，回调中可以继续提交请求
+ * @param min 至少等待完成的请求数(不超过正在进行的请求数)，为0时不等待
+ * @return 执行的回调个数
+ */
+int aio_poll(int min) {
+  std::vector<struct aio_req*> done;
+  int n = 0;
+
+  for (;;) {
+    {
+      std::unique_lock<std::mutex> g(ctx.lock);
+      // 没有正在进行的请求时不再等待
+      if (ctx.done.empty() && (n >= min || !ctx.inflight)) break;
+      ctx.cv.wait(g, [] { return !ctx.done.empty(); });
+      done.swap(ctx.done);
+    }
+    for (auto req : done) {
+      if (req->op == AIO_OPEN && req->res == 0) {
+        struct session* saved = current;
+        current = req->session;
+        req->res = fd_install(req->inode, req->flag, req->mode);
+        current = saved;
+        req->inode = NULL;
+      }
+      iput(req->inode);
+      delete req->filp;
+      ctx.inflight--;
+      n++;
+      req->cb(req->res);
+      delete req;
+    }
+    done.clear();
+  }
+  return n;
+}
+
+/*
+线程退出时还有请求没有完成，等它们完成后再让aio_ctx随线程析构，
+这时不再执行回调，只释放请求持有的引用，异步打开的文件直接关闭
+*/
+aio_ctx::~aio_ctx() {
+  std::vector<struct aio_req*> reqs;
+  while (inflight) {
+    {
+      std::unique_lock<std::mutex> g(lock);
+      cv.wait(g, [this] { return !done.empty(); });
+      reqs.swap(done);
+    }
+    for (auto req : reqs) {
+      iput(req->inode);
+      delete req->filp;
+      inflight--;
+      delete req;
+    }
+    reqs.clear();
+  }
+}
+
+/*本线程已提交而还未执行回调的请求数*/
+int aio_inflight() { return ctx.inflight; }
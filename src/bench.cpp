@@ -0,0 +1,464 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <numeric>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "fs.h"
+#include "printfc.h"
+#include "sys.h"
+using namespace std;
+
+/*
+基准测试命令，测量文件系统各部分的性能，输出均为一行一项结果
+测试用的文件与目录建在根设备的根目录下
+*/
+
+/*aiobench读取的文件块数(缓冲区的4倍，随机读取大多要读盘)与每次读取的字节数*/
+#define AIOBENCH_BLOCKS (BUFFER_SIZE * 4)
+#define AIOBENCH_IO 512
+/*allocbench查找的路径*/
+#define ALLOCBENCH_PATH "/allocbench/a/b/c/f"
+/*createbench创建文件的目录*/
+#define CREATEBENCH_DIR "/createbench"
+/*lookupbench使用的目录与每种目录大小下查找的次数*/
+#define LOOKUPBENCH_DIR "/lookupbench"
+#define LOOKUPBENCH_LOOKUPS 10000
+/*seqbench与writebench每次读写的字节数*/
+#define SEQBENCH_IO (64 * 1024)
+
+/*准备aiobench读取的文件，每块开头是该块的序号，返回块大小*/
+static int aiobench_file() {
+  int bs = get_super(ROOT_DEV)->s_blocksize, fd, i, k;
+  vector<char> buf(bs * 64);
+
+  if ((fd = sys_open("/aiobench", O_RDWR, S_IFREG)) < 0) return fd;
+  if (get_file(fd)->f_inode->i_size != (unsigned int)bs * AIOBENCH_BLOCKS)
+    for (i = 0; i < AIOBENCH_BLOCKS; i += 64) {
+      for (k = 0; k < 64; k++) *(int*)(buf.data() + k * bs) = i + k;
+      sys_write(fd, buf.data(), buf.size());
+    }
+  sys_close(fd);
+  return bs;
+}
+
+static void aiobench_report(const char* name, vector<double>& lat, double sec,
+                            int errors) {
+  int n = lat.size();
+  sort(lat.begin(), lat.end());
+  printf("%s: %d reads, time: %.3fs, %.0f reads/s, latency avg %.1fus ", name,
+         n, sec, n / sec, accumulate(lat.begin(), lat.end(), 0.0) / n);
+  printf("p50 %.1fus p99 %.1fus, errors: %d\n", lat[n / 2], lat[n * 99 / 100],
+         errors);
+}
+
+/*
+aiobench命令，在一个文件中随机读取，比较同步接口与异步接口
+同步：每次lseek+read，读盘时停下等待；异步：一次提交全部读取，再统一等待回调
+延迟为从发出(提交)读取到得到结果(执行回调)的时间
+*/
+int cmd_aiobench(const string& reads) {
+  unsigned long rn;
+  int n, bs, fd, i, errors = 0;
+  mt19937 rng(1);
+  using clk = chrono::steady_clock;
+  using usec = chrono::duration<double, micro>;
+
+  // 先检查次数再按次数分配缓冲区
+  if (parse_uint(reads, 10000, &rn) < 0 || !rn || rn > 1000000)
+    return -EINVAL;
+  n = rn;
+  vector<char> bufs((size_t)n * (AIOBENCH_IO + 1));
+  vector<int> blocks(n);
+  vector<double> lat(n);
+  if ((bs = aiobench_file()) < 0) return bs;
+  for (i = 0; i < n; i++) blocks[i] = rng() % AIOBENCH_BLOCKS;
+
+  // 同步接口
+  if ((fd = sys_open("/aiobench", O_RDWR, S_IFREG)) < 0) return fd;
+  auto start = clk::now();
+  for (i = 0; i < n; i++) {
+    char* buf = &bufs[(size_t)i * (AIOBENCH_IO + 1)];
+    auto t = clk::now();
+    sys_lseek(fd, (off_t)blocks[i] * bs, 0);
+    if (sys_read(fd, buf, AIOBENCH_IO) != AIOBENCH_IO ||
+        *(int*)buf != blocks[i])
+      errors++;
+    lat[i] = usec(clk::now() - t).count();
+  }
+  double sec = chrono::duration<double>(clk::now() - start).count();
+  sys_close(fd);
+  aiobench_report("sync", lat, sec, errors);
+
+  // 异步接口：打开后在回调中提交全部读取，最后关闭，关闭不影响已提交的读取
+  for (i = 0; i < n; i++) blocks[i] = rng() % AIOBENCH_BLOCKS;
+  vector<clk::time_point> issued(n);
+  errors = 0;
+  start = clk::now();
+  aio_open("/aiobench", O_RDWR, S_IFREG, [&](int fd) {
+    if (fd < 0) {
+      errors = n;
+      return;
+    }
+    for (int i = 0; i < n; i++) {
+      char* buf = &bufs[(size_t)i * (AIOBENCH_IO + 1)];
+      auto done = [&, i, buf](int res) {
+        if (res != AIOBENCH_IO || *(int*)buf != blocks[i]) errors++;
+        lat[i] = usec(clk::now() - issued[i]).count();
+      };
+      issued[i] = clk::now();
+      aio_read(fd, buf, AIOBENCH_IO, (off_t)blocks[i] * bs, done);
+    }
+    aio_close(fd, [](int) {});
+  });
+  while (aio_inflight()) aio_poll(1);
+  sec = chrono::duration<double>(clk::now() - start).count();
+  aiobench_report("async", lat, sec, errors);
+  return 0;
+}
+
+#ifdef ALLOCBENCH
+/*allocbench统计的堆分配次数，每个线程分别计数，不受其他线程的影响*/
+static thread_local unsigned long alloc_count;
+
+/*
+替换全局的operator new与operator delete，string、vector等的分配都经过这里，
+new[]与nothrow版本(stable_sort等使用)也一并替换，
+申请与释放总是成对的malloc与free
+只在make ALLOCBENCH=1时编译，平常的程序使用默认的分配器
+*/
+void* operator new(size_t size, const nothrow_t&) noexcept {
+  alloc_count++;
+  return malloc(size ? size : 1);
+}
+void* operator new(size_t size) {
+  void* p;
+
+  if (!(p = operator new(size, nothrow))) throw bad_alloc();
+  return p;
+}
+void* operator new[](size_t size) { return operator new(size); }
+void* operator new[](size_t size, const nothrow_t&) noexcept {
+  return operator new(size, nothrow);
+}
+void operator delete(void* p) noexcept { free(p); }
+void operator delete(void* p, size_t) noexcept { free(p); }
+void operator delete(void* p, const nothrow_t&) noexcept { free(p); }
+void operator delete[](void* p) noexcept { free(p); }
+void operator delete[](void* p, size_t) noexcept { free(p); }
+void operator delete[](void* p, const nothrow_t&) noexcept { free(p); }
+
+static void allocbench_report(const char* name, unsigned long n, double sec,
+                              unsigned long allocs) {
+  printf("%s: %lu lookups, time: %.3fs, %.0f lookups/s, allocations: %lu\n",
+         name, n, sec, n / sec, allocs);
+}
+
+/*
+allocbench命令，统计路径查找过程中的堆分配次数：
+依次反复查找已缓存的路径(get_inode)、路径的父目录(dir_namei)，
+以及每次都不同的不存在的文件名(dcache未命中，需要扫描目录块)，
+输出每种查找的速度与期间operator new被调用的次数，查找路径上应为0
+*/
+int cmd_allocbench(const string& lookups) {
+  const char* dirs[] = {"/allocbench", "/allocbench/a", "/allocbench/a/b",
+                        "/allocbench/a/b/c"};
+  const char* basename;
+  struct m_inode* inode;
+  unsigned long n, i, allocs;
+  char name[64];
+  int code, namelen;
+  using clk = chrono::steady_clock;
+
+  if (parse_uint(lookups, 100000, &n) < 0 || !n) return -EINVAL;
+  for (auto d : dirs)
+    if ((code = cmd_mkdir(d, S_IFDIR)) < 0 && code != -EEXIST) return code;
+  if ((code = open_file(ALLOCBENCH_PATH, O_RDWR, S_IFREG, inode)) < 0)
+    return code;
+  iput(inode);
+
+  allocs = alloc_count;
+  auto start = clk::now();
+  for (i = 0; i < n; i++)
+    if ((inode = get_inode(ALLOCBENCH_PATH))) iput(inode);
+  double sec = chrono::duration<double>(clk::now() - start).count();
+  allocbench_report("get_inode", n, sec, alloc_count - allocs);
+
+  allocs = alloc_count;
+  start = clk::now();
+  for (i = 0; i < n; i++)
+    if ((inode = dir_namei(ALLOCBENCH_PATH, &namelen, &basename))) iput(inode);
+  sec = chrono::duration<double>(clk::now() - start).count();
+  allocbench_report("dir_namei", n, sec, alloc_count - allocs);
+
+  allocs = alloc_count;
+  start = clk::now();
+  for (i = 0; i < n; i++) {
+    snprintf(name, sizeof(name), "/allocbench/a/b/c/x%lu", i);
+    if ((inode = get_inode(name))) iput(inode);
+  }
+  sec = chrono::duration<double>(clk::now() - start).count();
+  allocbench_report("missing names", n, sec, alloc_count - allocs);
+  return 0;
+}
+#else
+/*没有替换operator new时无法计数，需要以make ALLOCBENCH=1重新编译*/
+int cmd_allocbench(const string&) {
+  perrorc("allocbench需要以make clean && make ALLOCBENCH=1编译");
+  return 0;
+}
+#endif
+
+/*
+createbench命令，在同一个目录中依次创建N个文件，之后再全部删除，
+分四段输出创建速度与平均每次创建读取的块数(包括在缓冲区中命中的)，
+创建文件不再从头扫描目录时，读取的块数只随目录索引与间接块的层数增加，
+不随文件数线性增长
+目录项中的inode号只有16位，文件数最多为MAX_DIR_INODE
+*/
+int cmd_createbench(const string& files) {
+  struct buffer_stats st0, st1;
+  struct m_inode* inode;
+  unsigned long n;
+  char name[64];
+  int i = 0, k, from, to, code = 0;
+  using clk = chrono::steady_clock;
+
+  if (parse_uint(files, 10000, &n) < 0 || !n) return -EINVAL;
+  n = min(n, (unsigned long)MAX_DIR_INODE);
+  if ((code = cmd_mkdir(CREATEBENCH_DIR, S_IFDIR)) < 0 && code != -EEXIST)
+    return code;
+  code = 0;
+  auto start = clk::now();
+  for (k = 0; k < 4 && code == 0; k++) {
+    from = n * k / 4;
+    to = n * (k + 1) / 4;
+    get_buffer_stats(&st0);
+    auto t = clk::now();
+    for (i = from; i < to; i++) {
+      snprintf(name, sizeof(name), CREATEBENCH_DIR "/f%d", i);
+      if ((code = open_file(name, O_RDWR, S_IFREG, inode)) < 0) break;
+      iput(inode);
+    }
+    double sec = chrono::duration<double>(clk::now() - t).count();
+    get_buffer_stats(&st1);
+    if (i == from) continue;
+    printf("files %d-%d: %.0f creates/s, blocks read per create: %.2f, "
+           "disk reads: %lu\n",
+           from, i - 1, (i - from) / sec,
+           (double)(st1.hits + st1.reads - st0.hits - st0.reads) / (i - from),
+           st1.reads - st0.reads);
+  }
+  double sec = chrono::duration<double>(clk::now() - start).count();
+  printf("created: %d files, time: %.3fs, %.0f creates/s%s\n", i, sec,
+         i / sec, code == -ENOSPC ? " (out of inodes or blocks)" : "");
+  // 空间用完时按已创建的个数统计，不作为错误
+  if (code == -ENOSPC && i > 0) code = 0;
+
+  // 删除创建的文件，目录保留，下次运行时继续使用
+  n = i;
+  start = clk::now();
+  for (i = 0; i < (int)n; i++) {
+    snprintf(name, sizeof(name), CREATEBENCH_DIR "/f%d", i);
+    sys_unlink(name);
+  }
+  sec = chrono::duration<double>(clk::now() - start).count();
+  printf("removed: %lu files, time: %.3fs, %.0f deletes/s\n", n, sec, n / sec);
+  return code;
+}
+
+/*
+在dir中查找prefix加上ids中各个编号组成的文件名，直接扫描目录(不经过dcache)，
+返回找到的个数，*sec为用时，*blocks为平均每次读取的块数
+*/
+static int lookupbench_find(struct m_inode* dir, const char* prefix,
+                            const vector<int>& ids, double* sec,
+                            double* blocks) {
+  struct buffer_stats st0, st1;
+  struct buffer_head* bh;
+  struct dir_entry* de;
+  char name[32];
+  int found = 0, len;
+
+  get_buffer_stats(&st0);
+  auto start = chrono::steady_clock::now();
+  for (int id : ids) {
+    len = snprintf(name, sizeof(name), "%s%d", prefix, id);
+    lock_inode_shared(dir);
+    if ((bh = find_entry(&dir, name, len, &de))) {
+      found++;
+      brelse(bh);
+    }
+    unlock_inode_shared(dir);
+  }
+  *sec = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+  get_buffer_stats(&st1);
+  *blocks = (double)(st1.hits + st1.reads - st0.hits - st0.reads) / ids.size();
+  return found;
+}
+
+/*
+lookupbench命令，测试大目录中的创建与查找：
+目录中依次有1k、10k、100k个文件(不超过给出的最大项数)时，
+输出创建速度，以及随机查找存在与不存在的文件名的速度与平均每次读取的块数，
+每种大小测完后删除这些文件
+目录项中的inode号只有16位，文件数最多为MAX_DIR_INODE，
+inode用完时按已创建的个数测试
+*/
+int cmd_lookupbench(const string& entries) {
+  static const int sizes[] = {1000, 10000, 100000};
+  struct m_inode *dir, *inode;
+  unsigned long max;
+  vector<int> hits(LOOKUPBENCH_LOOKUPS), misses(LOOKUPBENCH_LOOKUPS);
+  mt19937 rng(1);
+  char name[64];
+  int i, n, code = 0, found;
+  double csec, hsec, msec, hblocks, mblocks;
+  using clk = chrono::steady_clock;
+
+  if (parse_uint(entries, 100000, &max) < 0 || !max) return -EINVAL;
+  if ((code = cmd_mkdir(LOOKUPBENCH_DIR, S_IFDIR)) < 0 && code != -EEXIST)
+    return code;
+  if (!(dir = get_inode(LOOKUPBENCH_DIR))) return -ENOENT;
+  code = 0;
+  for (int size : sizes) {
+    if ((unsigned long)size > max) break;
+    n = min(size, MAX_DIR_INODE);
+    auto start = clk::now();
+    for (i = 0; i < n; i++) {
+      snprintf(name, sizeof(name), LOOKUPBENCH_DIR "/f%d", i);
+      if ((code = open_file(name, O_RDWR, S_IFREG, inode)) < 0) break;
+      iput(inode);
+    }
+    csec = chrono::duration<double>(clk::now() - start).count();
+    if ((n = i) > 0) {
+      for (i = 0; i < LOOKUPBENCH_LOOKUPS; i++) {
+        hits[i] = rng() % n;
+        misses[i] = rng() % n;
+      }
+      found = lookupbench_find(dir, "f", hits, &hsec, &hblocks);
+      lookupbench_find(dir, "g", misses, &msec, &mblocks);
+      printf("entries: %d, create: %.0f/s, lookup: %.0f/s %.2f blocks, "
+             "miss: %.0f/s %.2f blocks, not found: %d%s\n",
+             n, n / csec, LOOKUPBENCH_LOOKUPS / hsec, hblocks,
+             LOOKUPBENCH_LOOKUPS / msec, mblocks, LOOKUPBENCH_LOOKUPS - found,
+             code == -ENOSPC ? " (out of inodes or blocks)" : "");
+    }
+    for (i = 0; i < n; i++) {
+      snprintf(name, sizeof(name), LOOKUPBENCH_DIR "/f%d", i);
+      sys_unlink(name);
+    }
+    // 空间用完时按已创建的个数测试，不作为错误
+    if (code == -ENOSPC && n > 0) code = 0;
+    if (code < 0) break;
+  }
+  iput(dir);
+  return code;
+}
+
+/*
+seqbench命令，顺序写入再读出一个文件(默认64MB)，输出卷的块大小与读写速度，
+写入的时间包括最后写回缓冲区，文件比缓冲区大，读出时大部分块要从磁盘读入
+比较不同的块大小见Makefile中的seqbench目标，它依次以1K、4K、8K格式化并运行本命令
+*/
+int cmd_seqbench(const string& mb) {
+  vector<char> buf(SEQBENCH_IO + 1, 's');
+  unsigned long n;
+  int fd, i, chunks, code = 0;
+  using clk = chrono::steady_clock;
+
+  if (parse_uint(mb, 64, &n) < 0 || !n || n > 1024) return -EINVAL;
+  chunks = n * (1 << 20) / SEQBENCH_IO;
+  if ((fd = sys_open("/seqbench", O_RDWR, S_IFREG)) < 0) return fd;
+  auto start = clk::now();
+  for (i = 0; i < chunks; i++)
+    if (sys_write(fd, buf.data(), SEQBENCH_IO) != SEQBENCH_IO) {
+      code = -ENOSPC;
+      break;
+    }
+  sync_blocks();
+  double wsec = chrono::duration<double>(clk::now() - start).count();
+  sys_lseek(fd, 0, 0);
+  start = clk::now();
+  for (i = 0; i < chunks && code == 0; i++)
+    if (sys_read(fd, buf.data(), SEQBENCH_IO) != SEQBENCH_IO) code = -EIO;
+  double rsec = chrono::duration<double>(clk::now() - start).count();
+  sys_close(fd);
+  sys_unlink("/seqbench");
+  if (code < 0) return code;
+  printf("block size: %dK, file: %luMB, write: %.1fMB/s, read: %.1fMB/s\n",
+         get_super(ROOT_DEV)->s_blocksize / 1024, n, n / wsec, n / rsec);
+  return 0;
+}
+
+/*从pos开始以SEQBENCH_IO字节为单位写chunks次，输出期间的读盘次数与整块覆盖次数*/
+static int writebench_pass(const char* name, int fd, off_t pos, int chunks,
+                           char* buf) {
+  struct buffer_stats st0, st1;
+  int i;
+
+  get_buffer_stats(&st0);
+  auto start = chrono::steady_clock::now();
+  sys_lseek(fd, pos, 0);
+  for (i = 0; i < chunks; i++)
+    if (sys_write(fd, buf, SEQBENCH_IO) != SEQBENCH_IO) return -ENOSPC;
+  sync_blocks();
+  double sec =
+      chrono::duration<double>(chrono::steady_clock::now() - start).count();
+  get_buffer_stats(&st1);
+  printf("%s: %.1fMB/s, disk reads: %lu, overwrites without read: %lu\n",
+         name, (double)chunks * SEQBENCH_IO / (1 << 20) / sec,
+         st1.reads - st0.reads, st1.overwrites - st0.overwrites);
+  return 0;
+}
+
+/*没有空洞、共nblocks块的文件用到的间接块数*/
+static long long indirect_blocks(long long nblocks, long long zpb) {
+  long long rest = nblocks - NR_DIRECT, span = 1, n = 0, k, per;
+
+  for (int level = 1; rest > 0 && level <= 3; level++) {
+    span *= zpb;  // 这一级索引最多对应的数据块数
+    k = min(rest, span);
+    per = 1;
+    for (int i = 0; i < level; i++) {
+      per *= zpb;
+      n += (k + per - 1) / per;
+    }
+    rest -= k;
+  }
+  return n;
+}
+
+/*
+writebench命令，检查整块覆盖写不读盘：
+依次写一个新文件(默认16MB，比缓冲区大)、按块对齐重写一遍、错开1字节重写一遍，
+输出每一遍的速度、读盘次数与省去读盘的整块覆盖次数
+新文件不读盘；对齐重写时数据块都是整块覆盖，读盘的只有已被换出的间接块；
+错开时每次写入首尾两块只覆盖一部分，需要先读入
+*/
+int cmd_writebench(const string& mb) {
+  vector<char> buf(SEQBENCH_IO, 'w');
+  struct super_block* sb;
+  unsigned long n;
+  long long nblocks;
+  int fd, chunks, code;
+
+  if (parse_uint(mb, 16, &n) < 0 || !n || n > 1024) return -EINVAL;
+  chunks = n * (1 << 20) / SEQBENCH_IO;
+  if ((fd = sys_open("/writebench", O_RDWR, S_IFREG)) < 0) return fd;
+  sb = get_super(current->filp[fd]->f_inode->i_dev);
+  nblocks = n * (1 << 20) / sb->s_blocksize;
+  printf("file: %luMB, %lld blocks, %lld indirect blocks\n", n, nblocks,
+         indirect_blocks(nblocks, sb->s_zones_per_block));
+  if ((code = writebench_pass("new file", fd, 0, chunks, buf.data())) == 0 &&
+      (code = writebench_pass("aligned rewrite", fd, 0, chunks,
+                              buf.data())) == 0)
+    code = writebench_pass("unaligned rewrite", fd, 1, chunks, buf.data());
+  sys_close(fd);
+  sys_unlink("/writebench");
+  return code;
+}
@@ -1,6 +1,9 @@
 /*包含对位图操作函数，有i节点位图和逻辑块位图*/
 
+#include <algorithm>
+
 #include "fs.h"
+#include "lock.h"
 //设置某一位为1
 #define _set_bit(x, y) x |= (1 << y)
 //设置某一位为0
@@ -18,10 +21,167 @@ int clear_bit(int k, char* data) {
 }
 int get_bit(int k, char* data) { return _get_bit(data[k / 8], k % 8); }
 
-int find_first_zero(char* data) {
+/*在bits位的位图中查找第一个为0的位，没有则返回bits*/
+int find_first_zero(char* data, int bits) {
+  unsigned long long* w = (unsigned long long*)data;
   int i = 0;
-  for (i = 0; i < BLOCK_BIT; ++i) {
+  /*先按64位跳过全为1的部分，再逐位查找*/
+  while (i < bits / 64 && !~w[i]) ++i;
+  for (i *= 64; i < bits; ++i) {
     if (!get_bit(i, data)) break;
   }
   return i;
 }
+
+/*在bits位的位图中从第start位开始查找第一个为0的位，没有则返回bits*/
+int find_next_zero(char* data, int bits, int start) {
+  unsigned long long* w = (unsigned long long*)data;
+  int i;
+  for (i = start; i < bits && i % 64; ++i)
+    if (!get_bit(i, data)) return i;
+  while (i + 64 <= bits && !~w[i / 64]) i += 64;
+  for (; i < bits; ++i)
+    if (!get_bit(i, data)) return i;
+  return bits;
+}
+
+/*位图前bits位中0的个数*/
+static int count_zero(char* data, int bits) {
+  unsigned long long* w = (unsigned long long*)data;
+  int i, n = 0;
+  for (i = 0; i + 64 <= bits; i += 64) n += 64 - __builtin_popcountll(w[i / 64]);
+  for (; i < bits; ++i) n += !get_bit(i, data);
+  return n;
+}
+
+/*
+分配组：i节点位图与逻辑块位图的每个位图块为一组，每组有自己的锁、空闲个数与查找起点。
+每个线程有自己的亲和组，不同线程在不同的组中分配，不会竞争同一个锁和同一段位图，
+同一线程连续分配到的块也是连续的。亲和组满了之后线程换到下一个有空闲的组。
+给出goal时先从goal开始查找，使一个文件的数据块尽量连续，见map_blocks
+同一时刻最多只持有一个组的锁
+*/
+template <int LEVEL>
+struct alloc_group {
+  level_mutex lock{LEVEL};
+  int inited;  // nr_free是否已经统计
+  int nr_free;
+  int cursor;  // 下次从这一位开始查找
+};
+/*每个超级块一份，读入超级块时建立*/
+struct alloc_groups {
+  alloc_group<LOCK_IMAP> inode[I_MAP_SLOTS];
+  alloc_group<LOCK_ZMAP> zone[Z_MAP_SLOTS];
+};
+/*新线程的亲和组依次分配，各个设备使用相同的亲和组*/
+static std::atomic<int> next_inode_group, next_zone_group;
+static thread_local int inode_affinity = -1, zone_affinity = -1;
+
+void init_alloc_groups(struct super_block* sb) {
+  sb->s_groups = new alloc_groups();
+}
+void free_alloc_groups(struct super_block* sb) {
+  delete sb->s_groups;
+  sb->s_groups = NULL;
+}
+
+/*重新读入或修复位图后，各组的统计作废*/
+void reset_alloc_groups(struct super_block* sb) {
+  for (auto& g : sb->s_groups->inode) {
+    std::lock_guard<level_mutex> l(g.lock);
+    g.inited = g.cursor = 0;
+  }
+  for (auto& g : sb->s_groups->zone) {
+    std::lock_guard<level_mutex> l(g.lock);
+    g.inited = g.cursor = 0;
+  }
+}
+
+/*在一组中从start(为-1时从cursor)开始查找空闲位并置位，返回组内的位置，没有则返回-1*/
+template <class G>
+static int group_take(G& g, struct buffer_head* bh, int bits, int start) {
+  std::lock_guard<level_mutex> l(g.lock);
+  int j;
+
+  if (!g.inited) {
+    g.nr_free = count_zero(bh->b_data, bits);
+    g.inited = 1;
+  }
+  if (!g.nr_free) return -1;
+  if (start < 0 || start >= bits) start = g.cursor;
+  if ((j = find_next_zero(bh->b_data, bits, start)) >= bits &&
+      (j = find_next_zero(bh->b_data, start, 0)) >= start)
+    return -1;
+  set_bit(j, bh->b_data);
+  bh->b_dirt = 1;
+  g.nr_free--;
+  g.cursor = j + 1;
+  return j;
+}
+
+/*
+在位图中分配一位，返回其在整个位图中的位置，没有空闲时返回-1
+total为位图中有效的位数，bpg为每组的位数
+*/
+template <class G>
+static int group_alloc(G* groups, struct buffer_head** maps, int ngroups,
+                       int bpg, int total, std::atomic<int>& next,
+                       int& affinity, int goal) {
+  int i, g, j, bits;
+
+  if (goal > 0 && goal < total) {
+    g = goal / bpg;
+    bits = std::min(bpg, total - g * bpg);
+    if (maps[g] && (j = group_take(groups[g], maps[g], bits, goal % bpg)) >= 0)
+      return g * bpg + j;
+  }
+  if (affinity < 0 || affinity >= ngroups) affinity = next++ % ngroups;
+  for (i = 0; i < ngroups; i++) {
+    g = (affinity + i) % ngroups;
+    bits = std::min(bpg, total - g * bpg);
+    if (maps[g] && (j = group_take(groups[g], maps[g], bits, -1)) >= 0) {
+      affinity = g;
+      return g * bpg + j;
+    }
+  }
+  return -1;
+}
+
+/*清除一位，该位原本就为0时返回-1*/
+template <class G>
+static int group_free(G* groups, struct buffer_head** maps, int bpg, int bit) {
+  G& g = groups[bit / bpg];
+  struct buffer_head* bh = maps[bit / bpg];
+  std::lock_guard<level_mutex> l(g.lock);
+
+  bit %= bpg;
+  if (!get_bit(bit, bh->b_data)) return -1;
+  clear_bit(bit, bh->b_data);
+  bh->b_dirt = 1;
+  if (g.inited) g.nr_free++;
+  return 0;
+}
+
+/*分配一个i节点号，没有空闲时返回0*/
+int alloc_inode_bit(struct super_block* sb) {
+  int bit = group_alloc(sb->s_groups->inode, sb->s_imap, sb->s_imap_blocks,
+                        BLOCK_BITS(sb), sb->s_ninodes + 1, next_inode_group,
+                        inode_affinity, 0);
+  return bit < 0 ? 0 : bit;
+}
+int free_inode_bit(struct super_block* sb, int nr) {
+  return group_free(sb->s_groups->inode, sb->s_imap, BLOCK_BITS(sb), nr);
+}
+
+/*分配一个数据块，优先使用goal及其之后的块，没有空闲时返回0*/
+int alloc_zone_bit(struct super_block* sb, int goal) {
+  int base = sb->s_firstdatazone - 1;
+  int bit = group_alloc(sb->s_groups->zone, sb->s_zmap, sb->s_zmap_blocks,
+                        BLOCK_BITS(sb), sb->s_nzones - base, next_zone_group,
+                        zone_affinity, goal > base ? goal - base : 0);
+  return bit < 0 ? 0 : bit + base;
+}
+int free_zone_bit(struct super_block* sb, int block) {
+  return group_free(sb->s_groups->zone, sb->s_zmap, BLOCK_BITS(sb),
+                    block - (sb->s_firstdatazone - 1));
+}
@@ -0,0 +1,276 @@
+/*
+复制文件与目录树(cp -r)，直接在缓冲区中按块复制，数据不经过用户缓冲区
+可以在已挂载的卷之间复制，但两个卷的块大小与格式必须相同
+每个线程有自己的任务队列，一个任务复制一个文件或目录：
+  复制目录时先建好目标目录，再把其中的每一项作为新任务放入自己的队列，
+  自己的队列空了就从其他线程队列的另一端取任务(work stealing)，
+  因此大目录和深目录树都能分散到所有线程中
+新的文件或目录在内容复制完成之后才加入目标目录，复制过程中其他线程看不到它，
+不需要对它加锁；复制源文件时持有源文件的读锁
+任务中只记录源文件的设备号与inode号，执行时才iget，排队的任务不占用inode_table
+*/
+#include <atomic>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "fs.h"
+
+/*每次映射的逻辑块数*/
+#define COPY_BATCH 64
+
+struct copy_task {
+  int dev, ino;        // 源文件的设备号与inode号
+  struct m_inode* dir; // 目标父目录，任务持有它的一个引用
+  std::string name;    // 目标文件名
+};
+
+/*
+线程的任务队列，自己从尾部存取，其他线程从头部窃取
+队列锁不在lock.h的层次中：持有它时不会再获取文件系统的锁
+*/
+struct copy_queue {
+  std::mutex lock;
+  std::deque<copy_task> tasks;
+};
+
+struct copy_pool {
+  std::vector<copy_queue> queues;
+  std::atomic<int> pending{0}; // 还未完成的任务数，包括正在执行的
+  std::atomic<int> error{0};   // 第一个错误码
+  std::atomic<unsigned long> files{0}, dirs{0}, bytes{0};
+};
+
+static void push_task(struct copy_pool* pool, int self, int dev, int ino,
+                      struct m_inode* dir, const std::string& name) {
+  pool->pending++;
+  std::lock_guard<std::mutex> g(pool->queues[self].lock);
+  pool->queues[self].tasks.push_back({dev, ino, igrab(dir), name});
+}
+
+/*取一个任务，先取自己队列的尾部，再依次窃取其他队列的头部*/
+static int take_task(struct copy_pool* pool, int self, struct copy_task* t) {
+  int n = pool->queues.size();
+  for (int i = 0; i < n; i++) {
+    struct copy_queue* q = &pool->queues[(self + i) % n];
+    std::lock_guard<std::mutex> g(q->lock);
+    if (q->tasks.empty()) continue;
+    if (!i) {
+      *t = std::move(q->tasks.back());
+      q->tasks.pop_back();
+    } else {
+      *t = std::move(q->tasks.front());
+      q->tasks.pop_front();
+    }
+    return 1;
+  }
+  return 0;
+}
+
+static void set_error(struct copy_pool* pool, int err) {
+  int zero = 0;
+  pool->error.compare_exchange_strong(zero, err);
+}
+
+/*先为目标文件分配全部数据块，再逐块从源文件的缓冲块复制到目标文件的缓冲块*/
+static int copy_data(struct m_inode* src, struct m_inode* dst) {
+  unsigned int szones[COPY_BATCH], dzones[COPY_BATCH];
+  struct super_block* sb = get_super(src->i_dev);
+  struct super_block* dsb = get_super(dst->i_dev);
+  struct buffer_head *sbh, *dbh;
+  int bs = sb->s_blocksize, nblocks, block, n, k;
+
+  if (dsb->s_blocksize != sb->s_blocksize || dsb->s_version != sb->s_version)
+    return -EXDEV;
+  dst->i_size = src->i_size;
+  if (src->i_flags & I_INLINE) {
+    memcpy(dst->i_zone, src->i_zone, sizeof(dst->i_zone));
+    dst->i_flags |= I_INLINE;
+    return 0;
+  }
+  nblocks = (src->i_size + bs - 1) / bs;
+  // 一次分配完，目标文件的块连续存放，空间不足时也不会复制一半
+  for (block = 0; block < nblocks; block += n) {
+    n = nblocks - block < COPY_BATCH ? nblocks - block : COPY_BATCH;
+    if (map_blocks(dst, block, n, dzones, 1) < n) return -ENOSPC;
+  }
+  for (block = 0; block < nblocks; block += n) {
+    n = nblocks - block < COPY_BATCH ? nblocks - block : COPY_BATCH;
+    if (map_blocks(src, block, n, szones, 0) < n ||
+        map_blocks(dst, block, n, dzones, 0) < n)
+      return -EIO;
+    for (k = 0; k < n; k++) {
+      // 整块覆盖，不需要读入目标块原有的内容
+      if (!(dbh = bget(dst->i_dev, dzones[k]))) return -EIO;
+      if (!szones[k]) {
+        memset(dbh->b_data, 0, bs);
+      } else if ((sbh = bread(src->i_dev, szones[k]))) {
+        memcpy(dbh->b_data, sbh->b_data, bs);
+        brelse(sbh);
+      } else {
+        brelse(dbh);
+        return -EIO;
+      }
+      dbh->b_dirt = 1;
+      brelse(dbh);
+    }
+  }
+  return 0;
+}
+
+/*建立只含 . 和 .. 的新目录，parent为它将要加入的目录*/
+static int init_dir(struct m_inode* inode, struct m_inode* parent) {
+  struct buffer_head* bh;
+  struct dir_entry* de;
+
+  if (!(inode->i_zone[0] = new_block(inode->i_dev))) return -ENOSPC;
+  if (!(bh = bread(inode->i_dev, inode->i_zone[0]))) return -EIO;
+  de = (struct dir_entry*)bh->b_data;
+  de->inode = inode->i_num;
+  strcpy(de->name, ".");
+  de++;
+  de->inode = parent->i_num;
+  strcpy(de->name, "..");
+  bh->b_dirt = 1;
+  brelse(bh);
+  inode->i_size = 2 * sizeof(struct dir_entry);
+  inode->i_nlinks = 2;
+  return 0;
+}
+
+/*把复制好的inode加入目标目录*/
+static int link_copy(struct m_inode* dir, const std::string& name,
+                     struct m_inode* inode) {
+  struct buffer_head* bh;
+  struct dir_entry* de;
+  struct m_inode* d = dir;
+
+  lock_inode(dir);
+  if ((bh = find_entry(&d, name.c_str(), name.size(), &de))) {
+    brelse(bh);
+    unlock_inode(dir);
+    return -EEXIST;
+  }
+  if (!(bh = add_entry(dir, name.c_str(), name.size(), &de))) {
+    unlock_inode(dir);
+    return -ENOSPC;
+  }
+  dir_set_inode(de, inode->i_num);
+  bh->b_dirt = 1;
+  brelse(bh);
+  if (S_ISDIR(inode->i_mode)) dir->i_nlinks++;
+  dir->i_mtime = CurrentTime();
+  dir->i_dirt = 1;
+  unlock_inode(dir);
+  return 0;
+}
+
+/*源目录中除 . 和 .. 以外的目录项*/
+static void list_dir(struct m_inode* dir,
+                     std::vector<std::pair<std::string, int>>& out) {
+  char name[LONG_NAME_LEN + 1];
+  struct dir_entry* de;
+  struct dir_iter it;
+
+  lock_inode_shared(dir);
+  dir_iter_init(&it, dir, 0);
+  while ((de = dir_iter_next(&it))) {
+    if (DE_IS_CONT(de) || !strcmp(de->name, ".") || !strcmp(de->name, ".."))
+      continue;
+    dir_entry_name(de, name);
+    out.emplace_back(name, de->inode);
+  }
+  dir_iter_end(&it);
+  unlock_inode_shared(dir);
+}
+
+/*执行一个任务：复制一个文件，或者建立一个目录并把其中的项加入队列*/
+static int run_task(struct copy_pool* pool, int self, struct copy_task* t) {
+  std::vector<std::pair<std::string, int>> entries;
+  struct m_inode *src, *dst;
+  int err;
+
+  if (!(src = iget(t->dev, t->ino))) return -ENOENT;
+  if (!(dst = new_inode(t->dir->i_dev))) {
+    iput(src);
+    return -ENOSPC;
+  }
+  dst->i_mode = src->i_mode;
+  dst->i_mtime = src->i_mtime;
+  dst->i_atime = dst->i_ctime = CurrentTime();
+  dst->i_dirt = 1;
+  if (S_ISDIR(src->i_mode)) {
+    err = init_dir(dst, t->dir);
+  } else {
+    lock_inode_shared(src);
+    err = copy_data(src, dst);
+    unlock_inode_shared(src);
+  }
+  if (!err) err = link_copy(t->dir, t->name, dst);
+  if (err) {
+    // 还未加入目录，释放时一并释放已分配的数据块
+    dst->i_nlinks = 0;
+    iput(dst);
+    iput(src);
+    return err;
+  }
+  if (S_ISDIR(src->i_mode)) {
+    list_dir(src, entries);
+    for (auto& e : entries)
+      push_task(pool, self, src->i_dev, e.second, dst, e.first);
+    pool->dirs++;
+  } else {
+    pool->files++;
+    pool->bytes += src->i_size;
+  }
+  iput(dst);
+  iput(src);
+  return 0;
+}
+
+static void copy_worker(struct copy_pool* pool, int self) {
+  struct copy_task t;
+  int err;
+
+  while (pool->pending > 0) {
+    if (!take_task(pool, self, &t)) {
+      std::this_thread::yield();
+      continue;
+    }
+    if ((err = run_task(pool, self, &t)) < 0) set_error(pool, err);
+    iput(t.dir);
+    pool->pending--;
+  }
+}
+
+/*
+ * @brief 把src(文件或整个目录树)复制为目录dir中的name
+ * @param src 源文件或目录的i节点
+ * @param dir 目标父目录的i节点
+ * @param name 目标文件名
+ * @param threads 使用的线程数
+ * @param st 返回复制的文件数、目录数与字节数，可以为NULL
+ * @return 成功返回0，失败返回第一个错误码(其余部分仍会被复制)
+ */
+int copy_tree(struct m_inode* src, struct m_inode* dir, const char* name,
+              int threads, struct copy_stats* st) {
+  struct copy_pool pool;
+  std::vector<std::thread> workers;
+  int i;
+
+  if (threads < 1) threads = 1;
+  pool.queues = std::vector<copy_queue>(threads);
+  push_task(&pool, 0, src->i_dev, src->i_num, dir, name);
+  for (i = 1; i < threads; i++) workers.emplace_back(copy_worker, &pool, i);
+  copy_worker(&pool, 0);
+  for (auto& w : workers) w.join();
+  if (st) {
+    st->files = pool.files;
+    st->dirs = pool.dirs;
+    st->bytes = pool.bytes;
+  }
+  return pool.error;
+}
@@ -0,0 +1,175 @@
+/*
+目录项缓存(dcache)，记录 (父目录, 文件名) -> inode号 的查找结果
+get_inode逐层查找路径时先查缓存，命中则不必再读取目录块
+找不到的文件名也会被记录(inode号为0)，重复查找不存在的路径同样不需要读盘
+缓存项放在固定大小的数组中，用哈希链查找，按最近使用的顺序串成双向链表，
+满了之后淘汰最久未使用的一项，查找与插入都不需要申请内存
+长文件名的定长形式只有前缀和长度，不能区分不同的文件名，因此不缓存
+目录项被增加或删除时，调用者需要使对应的缓存项失效，见add_entry、cmd_rm、cmd_rmdir
+所有操作都在dcache_lock下进行
+*/
+#include <cstring>
+
+#include "fs.h"
+#include "lock.h"
+
+#define DCACHE_HASH (DCACHE_SIZE * 2)
+
+struct dentry {
+  int dev;
+  int dir;             // 父目录的inode号，0表示该项未使用
+  char name[NAME_LEN]; // 文件名，不足NAME_LEN的部分补0
+  int inode;           // 0表示该文件名不存在
+  int hash_next;       // 哈希链中的下一项，-1表示链尾
+  int prev, next;      // 最近使用链表，DCACHE_SIZE为表头
+};
+
+static struct dentry dentries[DCACHE_SIZE + 1];
+static int hash_table[DCACHE_HASH];
+static struct dcache_stats stats;
+static int inited;
+static level_mutex dcache_lock(LOCK_DCACHE);
+
+static struct dentry *const lru = dentries + DCACHE_SIZE;
+
+static void lru_unlink(int i) {
+  dentries[dentries[i].prev].next = dentries[i].next;
+  dentries[dentries[i].next].prev = dentries[i].prev;
+}
+/*放到表头，即最近使用的位置*/
+static void lru_push(int i) {
+  dentries[i].next = lru->next;
+  dentries[i].prev = DCACHE_SIZE;
+  dentries[lru->next].prev = i;
+  lru->next = i;
+}
+
+static void dcache_init() {
+  int i;
+  for (i = 0; i < DCACHE_HASH; i++) hash_table[i] = -1;
+  lru->next = lru->prev = DCACHE_SIZE;
+  for (i = 0; i < DCACHE_SIZE; i++) {
+    dentries[i].dir = 0;
+    lru_push(i);
+  }
+  inited = 1;
+}
+
+/*缓存项中的文件名，长文件名返回0*/
+static int dcache_key(char *key, const char *name, int namelen) {
+  return namelen <= NAME_LEN && dir_name_key(key, name, namelen);
+}
+
+static unsigned int dcache_hashfn(int dev, int dir, const char *name) {
+  unsigned int h = 2166136261u ^ (dev * 31 + dir);
+  for (int i = 0; i < NAME_LEN; i++) {
+    h ^= (unsigned char)name[i];
+    h *= 16777619u;
+  }
+  return h % DCACHE_HASH;
+}
+
+/*查找缓存项，*slot返回其所在的哈希链*/
+static int dcache_find(struct m_inode *dir, const char *key, int **slot) {
+  int i;
+  if (!inited) dcache_init();
+  *slot = hash_table + dcache_hashfn(dir->i_dev, dir->i_num, key);
+  for (; (i = **slot) >= 0; *slot = &dentries[i].hash_next)
+    if (dentries[i].dir == (int)dir->i_num && dentries[i].dev == dir->i_dev &&
+        !memcmp(dentries[i].name, key, NAME_LEN))
+      return i;
+  return -1;
+}
+
+/*从哈希链中去掉一项，并放到最近使用链表的末尾等待重新使用*/
+static void dcache_drop(int i) {
+  int *slot = hash_table +
+              dcache_hashfn(dentries[i].dev, dentries[i].dir, dentries[i].name);
+  while (*slot != i) slot = &dentries[*slot].hash_next;
+  *slot = dentries[i].hash_next;
+  dentries[i].dir = 0;
+  lru_unlink(i);
+  dentries[i].prev = lru->prev;
+  dentries[i].next = DCACHE_SIZE;
+  dentries[lru->prev].next = i;
+  lru->prev = i;
+}
+
+/*查找缓存，命中时返回inode号(不存在的文件名返回0)，未命中返回-1*/
+int dcache_lookup(struct m_inode *dir, const char *name, int namelen) {
+  char key[NAME_LEN];
+  int *slot, i;
+  std::lock_guard<level_mutex> g(dcache_lock);
+
+  if (!dcache_key(key, name, namelen) ||
+      (i = dcache_find(dir, key, &slot)) < 0) {
+    stats.misses++;
+    return -1;
+  }
+  lru_unlink(i);
+  lru_push(i);
+  if (dentries[i].inode)
+    stats.hits++;
+  else
+    stats.negative_hits++;
+  return dentries[i].inode;
+}
+
+/*记录一次查找的结果，inode为0表示该文件名不存在*/
+void dcache_add(struct m_inode *dir, const char *name, int namelen,
+                int inode) {
+  char key[NAME_LEN];
+  int *slot, i;
+  std::lock_guard<level_mutex> g(dcache_lock);
+
+  if (!dcache_key(key, name, namelen)) return;
+  if ((i = dcache_find(dir, key, &slot)) < 0) {
+    // 取最久未使用的一项
+    i = lru->prev;
+    if (dentries[i].dir) dcache_drop(i);
+    dentries[i].dev = dir->i_dev;
+    dentries[i].dir = dir->i_num;
+    memcpy(dentries[i].name, key, NAME_LEN);
+    slot = hash_table + dcache_hashfn(dir->i_dev, dir->i_num, key);
+    dentries[i].hash_next = *slot;
+    *slot = i;
+  }
+  dentries[i].inode = inode;
+  lru_unlink(i);
+  lru_push(i);
+}
+
+/*目录项被增加或删除后，使对应的缓存项失效*/
+void dcache_invalidate(struct m_inode *dir, const char *name, int namelen) {
+  char key[NAME_LEN];
+  int *slot, i;
+  std::lock_guard<level_mutex> g(dcache_lock);
+
+  if (dcache_key(key, name, namelen) &&
+      (i = dcache_find(dir, key, &slot)) >= 0)
+    dcache_drop(i);
+}
+
+/*目录被删除后，其inode号可能被重新使用，清除以它为父目录的所有缓存项*/
+void dcache_purge_dir(struct m_inode *dir) {
+  std::lock_guard<level_mutex> g(dcache_lock);
+  for (int i = 0; i < DCACHE_SIZE; i++)
+    if (dentries[i].dir == (int)dir->i_num && dentries[i].dev == dir->i_dev)
+      dcache_drop(i);
+}
+
+/*设备被卸载后，其设备号可能给其他卷使用，清除该设备的所有缓存项*/
+void dcache_purge_dev(int dev) {
+  std::lock_guard<level_mutex> g(dcache_lock);
+  for (int i = 0; i < DCACHE_SIZE; i++)
+    if (dentries[i].dir && dentries[i].dev == dev) dcache_drop(i);
+}
+
+void get_dcache_stats(struct dcache_stats *out) {
+  int i;
+  std::lock_guard<level_mutex> g(dcache_lock);
+  *out = stats;
+  out->entries = 0;
+  for (i = 0; i < DCACHE_SIZE; i++)
+    if (dentries[i].dir) out->entries++;
+}
@@ -0,0 +1,178 @@
+/*
+目录块的扫描：dir_entry是定长的16字节(2字节inode号 + 14字节文件名)，
+查找文件名时把补齐后的文件名作为16字节的key，与块中的每一项整体比较，
+比较结果中去掉inode号的两个字节即可。x86上用SSE2一次比较一项，
+CPU支持AVX2时一次比较两项，其他平台使用逐项比较的实现
+长文件名先用同样的方法找到首项，再比较续项，短文件名的查找不受影响
+*/
+#include <cstring>
+
+#include "fs.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define DIRSCAN_X86
+#endif
+
+/*比较结果的低两位对应inode号，不参与比较*/
+#define NAME_MASK 0xfffc
+
+#ifdef DIRSCAN_X86
+static int scan_sse2(const struct dir_entry* de, int n,
+                     const struct dir_entry* key) {
+  const __m128i k = _mm_loadu_si128((const __m128i*)key);
+  const __m128i zero = _mm_setzero_si128();
+  for (int i = 0; i < n; i++) {
+    __m128i v = _mm_loadu_si128((const __m128i*)(de + i));
+    int eq = _mm_movemask_epi8(_mm_cmpeq_epi8(v, k));
+    int z = _mm_movemask_epi8(_mm_cmpeq_epi8(v, zero));
+    if ((eq & NAME_MASK) == NAME_MASK && (z & 3) != 3) return i;
+  }
+  return -1;
+}
+
+__attribute__((target("avx2"))) static int scan_avx2(
+    const struct dir_entry* de, int n, const struct dir_entry* key) {
+  const __m256i k =
+      _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)key));
+  const __m256i zero = _mm256_setzero_si256();
+  const unsigned int mask = NAME_MASK | (NAME_MASK << 16);
+  int i;
+  for (i = 0; i + 1 < n; i += 2) {
+    __m256i v = _mm256_loadu_si256((const __m256i*)(de + i));
+    unsigned int eq = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, k));
+    unsigned int z = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, zero));
+    if ((eq & mask) == 0) continue;
+    if ((eq & NAME_MASK) == NAME_MASK && (z & 3) != 3) return i;
+    eq >>= 16;
+    z >>= 16;
+    if ((eq & NAME_MASK) == NAME_MASK && (z & 3) != 3) return i + 1;
+  }
+  if (i < n && scan_sse2(de + i, 1, key) == 0) return i;
+  return -1;
+}
+#else
+static int scan_scalar(const struct dir_entry* de, int n,
+                       const struct dir_entry* key) {
+  for (int i = 0; i < n; i++)
+    if (de[i].inode && !memcmp(de[i].name, key->name, NAME_LEN)) return i;
+  return -1;
+}
+#endif
+
+/*
+在一个目录块的前n项中查找与key文件名相同的有效目录项，返回其下标，没有则返回-1
+key的文件名部分须按dir_name_key补齐，inode号部分不参与比较
+*/
+int dir_scan_block(const char* data, int n, const struct dir_entry* key) {
+  const struct dir_entry* de = (const struct dir_entry*)data;
+#ifdef DIRSCAN_X86
+  static const int avx2 = __builtin_cpu_supports("avx2");
+  return avx2 ? scan_avx2(de, n, key) : scan_sse2(de, n, key);
+#else
+  return scan_scalar(de, n, key);
+#endif
+}
+
+/*
+求一个目录块的前n项中有效目录项(inode号不为0)的位图，第i位对应第i项，
+live至少需要 (n + 63) / 64 个元素，返回有效项的个数
+*/
+int dir_live_map(const char* data, int n, unsigned long long* live) {
+  const struct dir_entry* de = (const struct dir_entry*)data;
+  int i, count = 0;
+
+  memset(live, 0, (n + 63) / 64 * sizeof(*live));
+  for (i = 0; i < n; i++)
+    if (de[i].inode) {
+      live[i / 64] |= 1ULL << (i % 64);
+      count++;
+    }
+  return count;
+}
+
+/*
+在一个目录块的前n项中查找文件名，返回首项的下标，没有则返回-1
+长文件名的首项只包含前缀和长度，找到后还要比较续项，不同时继续向后查找
+*/
+int dir_find_name(const char* data, int n, const char* name, int namelen) {
+  const struct dir_entry* de = (const struct dir_entry*)data;
+  struct dir_entry key;
+  int i, off = 0, k, c;
+
+  if (!dir_name_key(key.name, name, namelen)) return -1;
+  key.inode = 0;
+  while ((i = dir_scan_block(data + off * sizeof(key), n - off, &key)) >= 0) {
+    i += off;
+    if (namelen <= NAME_LEN) return i;
+    // 续项必须都在本块中
+    if (i + dir_name_slots(namelen) <= n) {
+      for (k = DE_PREFIX, c = 1; k < namelen; k += DE_CONT_CHARS, c++)
+        if (!DE_IS_CONT(de + i + c) ||
+            memcmp(de[i + c].name, name + k,
+                   namelen - k < DE_CONT_CHARS ? namelen - k : DE_CONT_CHARS))
+          break;
+      if (k >= namelen) return i;
+    }
+    off = i + 1;
+  }
+  return -1;
+}
+
+/*在一个目录块的前n项中查找连续slots个空闲项，返回第一项的下标，没有则返回-1*/
+int dir_find_free(const char* data, int n, int slots) {
+  const struct dir_entry* de = (const struct dir_entry*)data;
+  int i, run = 0;
+
+  for (i = 0; i < n; i++) {
+    run = de[i].inode ? 0 : run + 1;
+    if (run == slots) return i - slots + 1;
+  }
+  return -1;
+}
+
+/*写入文件名，长文件名同时写入续项，调用者需保证有dir_name_slots个空闲项*/
+void dir_set_name(struct dir_entry* de, const char* name, int namelen) {
+  int k, c;
+
+  dir_name_key(de->name, name, namelen);
+  if (namelen <= NAME_LEN) return;
+  for (k = DE_PREFIX, c = 1; k < namelen; k += DE_CONT_CHARS, c++) {
+    memset(de[c].name, 0, NAME_LEN);
+    memcpy(de[c].name, name + k,
+           namelen - k < DE_CONT_CHARS ? namelen - k : DE_CONT_CHARS);
+    de[c].name[NAME_LEN - 1] = DE_CONT;
+    de[c].inode = 0;
+  }
+}
+
+/*设置目录项的inode号，长文件名的续项一起设置，inode为0时即删除该目录项*/
+void dir_set_inode(struct dir_entry* de, int inode) {
+  int i, n = dir_entry_slots(de);
+
+  for (i = 0; i < n; i++) de[i].inode = inode;
+}
+
+/*目录项(首项)所占的项数*/
+int dir_entry_slots(const struct dir_entry* de) {
+  if (!DE_IS_LONG(de)) return 1;
+  return dir_name_slots((unsigned char)de->name[DE_PREFIX]);
+}
+
+/*取出目录项(首项)的完整文件名，buf至少需要LONG_NAME_LEN+1字节，返回文件名长度*/
+int dir_entry_name(const struct dir_entry* de, char* buf) {
+  int len, k, c;
+
+  if (!DE_IS_LONG(de)) {
+    len = strnlen(de->name, NAME_LEN);
+    memcpy(buf, de->name, len);
+    buf[len] = 0;
+    return len;
+  }
+  len = (unsigned char)de->name[DE_PREFIX];
+  memcpy(buf, de->name, DE_PREFIX);
+  for (k = DE_PREFIX, c = 1; k < len; k += DE_CONT_CHARS, c++)
+    memcpy(buf + k, de[c].name,
+           len - k < DE_CONT_CHARS ? len - k : DE_CONT_CHARS);
+  buf[len] = 0;
+  return len;
+}
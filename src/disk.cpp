@@ -1,9 +1,12 @@
+#include <cstring>
 #include <fstream>
 #include <iostream>
-#include <map>
-#include <set>
+#include <thread>
+#include <vector>
 
+#include "epoch.h"
 #include "fs.h"
+#include "lock.h"
 using namespace std;
 /*
 目前暂不设置内存中blocks 的大小
@@ -12,103 +15,588 @@ using namespace std;
 2. 在磁盘上创建一个新的数据块  new_block()
 3. 在磁盘上删除并清空一个数据块  free_block()
 4. 对于多进程而言，需要定义brelse 让进程放弃对block的使用权
-！！！注意 目前由于没有多进程，故对于b_count等信号量使用并不规范
+block中的数据由使用者自己加锁保护，修改完数据之后才置b_dirt(见sync_blocks)
+缓冲区采用延迟写：brelse时不写盘，被修改的block在被换出、sync或退出时才写回
 */
-map<int, buffer_head*> blocks;  // 所有block dirt,count任意，但一定是uptodate
-set<int> freeblocks;            // 所有count为=0的block
+/*
+每个设备(见sb)对应一个映像文件，有自己的块大小和锁，不同设备的读写可以同时进行，
+缓冲区中的block以(设备号, 块号)区分
+设备也可以是条带卷：块按顺序轮流存放在k个映像文件中(RAID-0)，
+第i个文件名为映像文件名加".i"(第0个就是映像文件本身)，可以分别放在不同的磁盘上，
+每个文件一个锁，相邻的块在不同的文件中，可以同时读写，见bread_ahead
+条带数在格式化时决定，记录在映像文件的开头(引导块)，没有记录的是普通的单文件映像
+设备也可以是另一个设备上的卷的快照，只读，读取由snapshot.cpp完成
+*/
+/*
+缓冲区按块号分为NR_BUF_SHARDS片，每片有自己的锁、哈希表和时钟环。
+已经在内存中的block不加锁即可取得：沿哈希链查找，再用原子操作增加b_count，
+brelse也只是原子地减少b_count。只有读入新的block、换出或删除block时才加分片的锁。
+换出时把b_count由0置为-1，之后不会再被持有，从哈希链摘下后按epoch延迟释放，
+正在无锁查找的线程仍然可以安全地访问它，见epoch.h
+*/
+#define SHARD_HASH (BUFFER_SIZE / NR_BUF_SHARDS * 2)
+
+struct alignas(64) buffer_shard {
+  level_mutex lock{LOCK_BUFFER};
+  atomic<buffer_head*> hash[SHARD_HASH];  // 哈希链，修改时持有lock，读取时不加锁
+  /*所有block串成环，需要换出时从hand开始找最近没有被使用过的(时钟算法)*/
+  buffer_head* hand;
+  int nr;
+  vector<pair<unsigned long, buffer_head*>> retired;  // 已摘下，等待释放
+  vector<buffer_head*> spare;                         // 已可以重新使用
+  // 缓冲区命中与磁盘读写次数
+  atomic<unsigned long> hits, reads, writes, overwrites;
+};
+static buffer_shard shards[NR_BUF_SHARDS];
+
+/*根设备的映像文件，不存在时创建*/
+#define ROOT_IMAGE "hdc-0.11.img"
+
+#define STRIPE_MAGIC "STRIPES"
+struct stripe_label {
+  char magic[8];
+  int stripes;
+};
+
+struct stripe {
+  level_mutex lock{LOCK_DISK};  // 保护file的读写位置
+  // 映像文件，打开之后一直保持打开，每次读写都重新打开的开销比读写本身还大
+  fstream file;
+};
+struct device {
+  level_mutex lock{LOCK_DISK};  // 保护path
+  stripe stripes[MAX_STRIPES];
+  // 打开后才不为0，打开、关闭与格式化时没有其他线程在读写该设备
+  int nstripes = 0;
+  int origin = -1;  // 快照设备：被快照的设备号
+  string path;
+  int blocksize = BLOCK_SIZE;  // 挂载时由超级块决定
+};
+static device devices[NR_SUPER];
+/*本线程正在进行不等待磁盘的读取，以及期间是否遇到了不在缓冲区中的block*/
+static thread_local int nowait, missed;
+
+/*同一设备相邻的块落在不同的分片中，每个设备都能用到全部分片*/
+static inline unsigned int block_key(int dev, int block) {
+  return (unsigned int)block + (unsigned int)dev * 0x9E3779B1u;
+}
+static inline buffer_shard& shard_of(int dev, int block) {
+  return shards[block_key(dev, block) % NR_BUF_SHARDS];
+}
+static inline atomic<buffer_head*>& bucket_of(buffer_shard& sh, int dev,
+                                              int block) {
+  return sh.hash[block_key(dev, block) / NR_BUF_SHARDS % SHARD_HASH];
+}
+
+/*整体偏移1位以适应已有的img，block所在的条带与在该条带文件中的偏移*/
+static inline stripe& stripe_of(device& d, int block) {
+  return d.stripes[(block + 1) % d.nstripes];
+}
+static inline streamoff stripe_offset(device& d, int block) {
+  return (block + 1) / d.nstripes * (streamoff)d.blocksize;
+}
+static string stripe_path(const string& path, int i) {
+  return i ? path + "." + to_string(i) : path;
+}
+
+static void close_stripes(device& d) {
+  for (auto& s : d.stripes)
+    if (s.file.is_open()) s.file.close();
+  d.nstripes = 0;
+}
+/*打开设备的全部映像文件，调用者需持有设备的锁*/
+static int open_stripes(device& d, const string& path) {
+  stripe_label label;
+  int i, k = 1;
+
+  /*血泪啊，c++想要修改文件部分的值，必须以读加写模式打开，单纯以写模式打开，会清空数据*/
+  d.stripes[0].file.open(path, ios::binary | ios::out | ios::in);
+  if (!d.stripes[0].file.is_open()) return -ENOENT;
+  if (d.stripes[0].file.read((char*)&label, sizeof(label)) &&
+      !memcmp(label.magic, STRIPE_MAGIC, sizeof(label.magic)) &&
+      label.stripes > 1 && label.stripes <= MAX_STRIPES)
+    k = label.stripes;
+  for (i = 1; i < k; i++) {
+    d.stripes[i].file.open(stripe_path(path, i),
+                           ios::binary | ios::out | ios::in);
+    if (!d.stripes[i].file.is_open()) {
+      close_stripes(d);
+      return -ENOENT;
+    }
+  }
+  d.nstripes = k;
+  return 0;
+}
+
+/*
+根设备第一次读写时打开(在启动时，此时还只有一个线程)，映像文件不存在时创建
+其他设备由dev_open打开
+*/
+static device& get_device(int dev) {
+  device& d = devices[dev];
+  if (!d.nstripes && dev == ROOT_DEV) {
+    {
+      lock_guard<level_mutex> g(d.lock);
+      if (open_stripes(d, ROOT_IMAGE) < 0) {
+        // 映像文件不存在时先创建
+        ofstream(string(ROOT_IMAGE), ios::binary).close();
+        open_stripes(d, ROOT_IMAGE);
+      }
+      d.path = ROOT_IMAGE;
+    }
+    snap_load(dev, ROOT_IMAGE);
+  }
+  return d;
+}
+
+/*直接从映像文件读取block，不经过缓冲区，快照设备经过快照读取*/
+void disk_read(int dev, int block, char* data) {
+  device& d = get_device(dev);
+  if (d.origin >= 0) {
+    snap_read(d.origin, block, data);
+    return;
+  }
+  stripe& s = stripe_of(d, block);
+  lock_guard<level_mutex> g(s.lock);
+  // 读到文件末尾之后会置位eof/fail，需要清除才能继续读写
+  s.file.clear();
+  s.file.seekg(stripe_offset(d, block));
+  s.file.read(data, d.blocksize);
+}
+
+static void flush_device(device& d) {
+  for (int i = 0; i < d.nstripes; i++) {
+    lock_guard<level_mutex> g(d.stripes[i].lock);
+    d.stripes[i].file.flush();
+  }
+}
+
+/*
+ * @brief 把映像文件path作为设备dev，供之后挂载，path为快照文件时设备为该快照
+ * @return 成功返回0，文件不存在返回-ENOENT，已被其他设备使用返回-EBUSY
+ */
+int dev_open(int dev, const char* path) {
+  int i;
+
+  if (dev <= ROOT_DEV || dev >= NR_SUPER) return -EINVAL;
+  for (i = 0; i < NR_SUPER; i++) {
+    lock_guard<level_mutex> g(devices[i].lock);
+    if (devices[i].path == path) return -EBUSY;
+  }
+  device& d = devices[dev];
+  {
+    lock_guard<level_mutex> g(d.lock);
+    if (d.nstripes || d.origin >= 0) return -EBUSY;
+    if ((d.origin = snap_attach(path)) < 0 &&
+        (i = open_stripes(d, path)) < 0)
+      return i;
+    d.path = path;
+    d.blocksize = BLOCK_SIZE;
+  }
+  if (d.origin < 0) snap_load(dev, path);
+  return 0;
+}
+/*写回并去掉设备的全部block，关闭映像文件，调用时不能再有人经过路径访问该设备，
+  还被临时持有的block等放开后才关闭*/
+void dev_close(int dev) {
+  device& d = devices[dev];
+  invalidate_blocks(dev);
+  if (d.origin >= 0)
+    snap_detach(d.origin);
+  else
+    snap_close(dev);
+  lock_guard<level_mutex> g(d.lock);
+  close_stripes(d);
+  d.origin = -1;
+  d.path.clear();
+}
+/*
+ * @brief 把设备重新建立为由stripes个映像文件组成的条带卷，用于格式化
+ * 原有内容全部丢弃，调用时缓冲区中不能有该设备的block
+ * @return 成功返回0，失败返回错误码
+ */
+int dev_create(int dev, int stripes) {
+  device& d = get_device(dev);
+  stripe_label label = {STRIPE_MAGIC, stripes};
+  int i;
+
+  if (stripes < 1 || stripes > MAX_STRIPES) return -EINVAL;
+  // 原有的快照也不再有效
+  snap_close(dev);
+  lock_guard<level_mutex> g(d.lock);
+  if (d.path.empty()) return -ENOENT;
+  remove((d.path + ".snap").c_str());
+  close_stripes(d);
+  for (i = 0; i < stripes; i++) {
+    ofstream f(stripe_path(d.path, i), ios::binary | ios::trunc);
+    // 只有一个文件时不做记录，与原有的映像相同
+    if (!i && stripes > 1) f.write((char*)&label, sizeof(label));
+  }
+  return open_stripes(d, d.path);
+}
+/*设备由几个映像文件组成，没有打开或者是快照时返回0*/
+int dev_stripes(int dev) { return get_device(dev).nstripes; }
+/*快照设备返回被快照的设备号，否则返回-1*/
+int dev_origin(int dev) { return devices[dev].origin; }
+/*设备的映像文件名，没有打开时返回空串*/
+string dev_path(int dev) {
+  lock_guard<level_mutex> g(devices[dev].lock);
+  return devices[dev].path;
+}
+
+/*设置设备的块大小，块大小改变后缓冲区中该设备已有的block全部作废*/
+void set_blocksize(int dev, int size) {
+  if (size == devices[dev].blocksize) return;
+  invalidate_blocks(dev);
+  devices[dev].blocksize = size;
+}
+int get_blocksize(int dev) { return devices[dev].blocksize; }
+
+/*在哈希链中查找block，调用者需持有分片的锁或处于epoch中*/
+static buffer_head* hash_find(buffer_shard& sh, int dev, int block) {
+  buffer_head* bh = bucket_of(sh, dev, block).load(memory_order_acquire);
+  for (; bh; bh = bh->b_next.load(memory_order_acquire))
+    if (bh->b_blocknr == (unsigned int)block && bh->b_dev == dev) return bh;
+  return NULL;
+}
+static void hash_insert(buffer_shard& sh, buffer_head* bh) {
+  atomic<buffer_head*>& head = bucket_of(sh, bh->b_dev, bh->b_blocknr);
+  bh->b_next.store(head.load(memory_order_relaxed), memory_order_relaxed);
+  head.store(bh, memory_order_release);
+}
+/*摘下后bh->b_next保持不变，正在查找的线程可以继续沿链向后*/
+static void hash_remove(buffer_shard& sh, buffer_head* bh) {
+  atomic<buffer_head*>* p = &bucket_of(sh, bh->b_dev, bh->b_blocknr);
+  while (p->load(memory_order_relaxed) != bh)
+    p = &p->load(memory_order_relaxed)->b_next;
+  p->store(bh->b_next.load(memory_order_relaxed), memory_order_release);
+}
+
+static void ring_insert(buffer_shard& sh, buffer_head* bh) {
+  if (!sh.hand) {
+    bh->b_next_free = bh->b_prev_free = bh;
+    sh.hand = bh;
+  } else {
+    bh->b_next_free = sh.hand;
+    bh->b_prev_free = sh.hand->b_prev_free;
+    sh.hand->b_prev_free->b_next_free = bh;
+    sh.hand->b_prev_free = bh;
+  }
+  sh.nr++;
+}
+static void ring_remove(buffer_shard& sh, buffer_head* bh) {
+  if (bh->b_next_free == bh) {
+    sh.hand = NULL;
+  } else {
+    bh->b_prev_free->b_next_free = bh->b_next_free;
+    bh->b_next_free->b_prev_free = bh->b_prev_free;
+    if (sh.hand == bh) sh.hand = bh->b_next_free;
+  }
+  sh.nr--;
+}
+
+/*增加b_count，block已经(或正在)被换出时返回0*/
+static inline int pin(buffer_head* bh) {
+  int c = bh->b_count.load(memory_order_relaxed);
+  while (c >= 0)
+    if (bh->b_count.compare_exchange_weak(c, c + 1, memory_order_acquire))
+      return 1;
+  return 0;
+}
+
+/*不加锁查找并持有内存中的block*/
+static buffer_head* get_hash_table(buffer_shard& sh, int dev, int block) {
+  epoch_guard g;
+  buffer_head* bh = hash_find(sh, dev, block);
+  return bh && pin(bh) ? bh : NULL;
+}
 
-/*向内存中申请一块空间存放block*/
-static buffer_head* getblk(int block) {
+/*把已经没有人持有的block从分片中去掉，等没有线程可能访问它时再重新使用*/
+static void retire(buffer_shard& sh, buffer_head* bh) {
+  hash_remove(sh, bh);
+  ring_remove(sh, bh);
+  sh.retired.push_back({epoch_stamp(), bh});
+}
+static void reclaim(buffer_shard& sh) {
+  size_t k = 0;
+  // 按摘下的先后排列，前面的不能释放时后面的也不能
+  while (k < sh.retired.size() && epoch_reclaimable(sh.retired[k].first))
+    sh.spare.push_back(sh.retired[k++].second);
+  sh.retired.erase(sh.retired.begin(), sh.retired.begin() + k);
+}
+
+/*时钟算法找一个可以换出的block，并将其b_count置为-1*/
+static buffer_head* evict(buffer_shard& sh) {
+  buffer_head* bh;
+  int zero;
+  for (int i = 0; i < 2 * sh.nr; i++) {
+    bh = sh.hand;
+    sh.hand = bh->b_next_free;
+    if (bh->b_count.load(memory_order_relaxed)) continue;
+    // 最近被使用过的block再保留一轮
+    if (bh->b_ref.exchange(0, memory_order_relaxed)) continue;
+    zero = 0;
+    if (bh->b_count.compare_exchange_strong(zero, -1, memory_order_acquire))
+      return bh;
+  }
+  return NULL;
+}
+
+/*向内存中申请一块空间存放block，还没有加入分片，调用者需持有分片的锁*/
+static buffer_head* getblk(buffer_shard& sh, int dev, int block) {
   buffer_head* bh;
 
-  if (!blocks.count(block)) {
-    if (freeblocks.size() >= BUFFER_SIZE) {
-      // printf("try to del free\n");
-      int f = *freeblocks.begin();
-      bh = blocks[f];
-      freeblocks.erase(f);
-      blocks.erase(f);
+  if (!sh.retired.empty()) reclaim(sh);
+  if (sh.nr >= BUFFER_SIZE / NR_BUF_SHARDS && (bh = evict(sh))) {
+    // 被换出的block如果被修改过，先写回磁盘
+    if (bh->b_dirt && !bwrite(bh->b_dev, bh->b_blocknr, bh->b_data)) {
+      // 写不回去时留在缓冲区中，之后换出或sync时再试
+      bh->b_count.store(0, memory_order_release);
     } else {
-      auto bb = new buffer_block();
-      bh = new buffer_head();
-      bh->b_data = bb;
+      if (bh->b_dirt) sh.writes++;
+      retire(sh, bh);
     }
-    bh->b_blocknr = block;
   }
-  bh->b_count = 1;
-  memset(bh->b_data, 0, sizeof(buffer_block));
+  if (!sh.spare.empty()) {
+    bh = sh.spare.back();
+    sh.spare.pop_back();
+  } else {
+    // 按最大的块大小申请，可以给任何设备使用
+    bh = new buffer_head();
+    bh->b_data = new buffer_block;
+  }
+  bh->b_dev = dev;
+  bh->b_blocknr = block;
+  bh->b_count.store(1, memory_order_relaxed);
+  bh->b_ref.store(0, memory_order_relaxed);
+  memset(bh->b_data, 0, devices[dev].blocksize);
   bh->b_dirt = 0;
   //刚刚申请的内存还未读入数据块
   bh->b_uptodate = 0;
-  // 注意全部要初始化
-  blocks[block] = bh;
   return bh;
 }
-/*获取内存中已经存在的block*/
-static buffer_head* get_hash_table(int block) {
-  auto bk = blocks.find(block);
-  if (bk != blocks.end()) {
-    if (bk->second->b_uptodate) {
-      return bk->second;
-    }
-  }
-  return NULL;
+/*加入分片，之后其他线程不加锁就能找到*/
+static void publish(buffer_shard& sh, buffer_head* bh) {
+  ring_insert(sh, bh);
+  hash_insert(sh, bh);
 }
-//磁盘块写入函数
-char* bwrite(int block, char* bh) {
-  ofstream disk;
-  /*血泪啊，c++想要修改文件部分的值，必须以读加写模式打开，单纯以写模式打开，会清空数据*/
-  disk.open("hdc-0.11.img", ios::binary | ios::out | ios::in);
-  disk.seekp((block + 1) * BLOCK_SIZE, ios::beg);
+//磁盘块写入函数，覆盖快照中的块之前保存原内容失败时不写入，返回NULL
+char* bwrite(int dev, int block, char* bh) {
+  device& d = get_device(dev);
+  // 快照只读，其中的修改直接丢弃
+  if (d.origin >= 0) return bh;
+  // 覆盖快照中的块之前先保存原内容
+  if (snap_before_write(dev, block) < 0) return NULL;
+  stripe& s = stripe_of(d, block);
+  lock_guard<level_mutex> g(s.lock);
+  s.file.clear();
+  s.file.seekp(stripe_offset(d, block), ios::beg);
   // cout << block << "  Write to the file" << endl;
-  disk.write(bh, BLOCK_SIZE);
-  disk.close();
+  s.file.write(bh, d.blocksize);
   return bh;
 }
-static bool realse_block(buffer_head* bh) {
-  if (bh->b_dirt) {
-    // printf("WARING %d b_count!=0 \n",i.first);
-    // printf("%d block write\n", i.first);
-    bwrite(bh->b_blocknr, bh->b_data);
-    delete bh->b_data;
-    delete bh;
-    return true;
+/*
+将所有被修改过的block写回磁盘，缓冲区保持不变，返回写回的个数
+不加分片的锁，写回期间持有该block，保证它不会同时被换出
+*/
+int sync_blocks() {
+  int n = 0;
+  buffer_head* bh;
+  for (auto& sh : shards) {
+    epoch_guard g;
+    for (auto& head : sh.hash)
+      for (bh = head.load(memory_order_acquire); bh;
+           bh = bh->b_next.load(memory_order_acquire)) {
+        if (!bh->b_dirt.load(memory_order_relaxed) || !pin(bh)) continue;
+        // 先清除标记再写回，修改者写完数据之后才置位b_dirt，
+        // 写回期间完成的修改会重新置位，下次再写回，不会丢失
+        if (bh->b_dirt.exchange(0, memory_order_acquire)) {
+          if (bwrite(bh->b_dev, bh->b_blocknr, bh->b_data)) {
+            sh.writes++;
+            n++;
+          } else {
+            // 写不回去时仍是脏的，下次再试
+            bh->b_dirt.store(1, memory_order_relaxed);
+          }
+        }
+        bh->b_count.fetch_sub(1, memory_order_release);
+      }
+  }
+  for (auto& d : devices) flush_device(d);
+  return n;
+}
+/*
+写回并从缓冲区中去掉设备的全部block，用于改变块大小与卸载
+调用时不能再有人经过路径访问该设备，sync等临时持有的block要等它们放开，
+一个分片中有block被持有时整个分片都不动，放开锁等一会儿再重试
+*/
+void invalidate_blocks(int dev) {
+  vector<buffer_head*> victims;
+  for (auto& sh : shards) {
+    for (;;) {
+      {
+        lock_guard<level_mutex> g(sh.lock);
+        buffer_head* bh = sh.hand;
+        size_t n;
+        for (int i = 0; i < sh.nr; i++, bh = bh->b_next_free)
+          if (bh->b_dev == dev) victims.push_back(bh);
+        for (n = 0; n < victims.size(); n++) {
+          int zero = 0;
+          if (!victims[n]->b_count.compare_exchange_strong(zero, -1)) break;
+        }
+        if (n == victims.size()) {
+          for (auto bh : victims) {
+            if (bh->b_dirt) {
+              if (!bwrite(dev, bh->b_blocknr, bh->b_data))
+                printf("WARING lost block (%04x:%d)\n", dev, bh->b_blocknr);
+              sh.writes++;
+            }
+            retire(sh, bh);
+          }
+          victims.clear();
+          break;
+        }
+        // 还有人持有，已经置为-1的恢复原样
+        while (n--) victims[n]->b_count.store(0, memory_order_release);
+        victims.clear();
+      }
+      this_thread::yield();
+    }
   }
-  return false;
+  flush_device(devices[dev]);
 }
+/*
+写回并释放所有的block，之后超级块中持有的位图也不再有效，需要重新读入
+调用时不能有其他线程在使用缓冲区
+*/
 void realse_all_blocks() {
-  for (auto i : blocks) {
-    auto bh = i.second;
-    if (realse_block(bh)) printf("%d block write\n", i.first);
+  int n = sync_blocks();
+  if (n) printf("%d block write\n", n);
+  for (auto& sh : shards) {
+    lock_guard<level_mutex> g(sh.lock);
+    while (sh.hand) {
+      buffer_head* bh = sh.hand;
+      ring_remove(sh, bh);
+      sh.spare.push_back(bh);
+    }
+    for (auto& i : sh.retired) sh.spare.push_back(i.second);
+    for (auto bh : sh.spare) {
+      delete[] bh->b_data;
+      delete bh;
+    }
+    sh.retired.clear();
+    sh.spare.clear();
+    for (auto& head : sh.hash) head.store(NULL, memory_order_relaxed);
+  }
+}
+void get_buffer_stats(struct buffer_stats* out) {
+  memset(out, 0, sizeof(*out));
+  for (auto& sh : shards) {
+    out->hits += sh.hits;
+    out->reads += sh.reads;
+    out->writes += sh.writes;
+    out->overwrites += sh.overwrites;
   }
-  blocks.clear();
-  freeblocks.clear();
 }
 
 /*
-根据block编号获取已经在磁盘上存在的数据块
+根据设备号与block编号获取已经在磁盘上存在的数据块
 */
-buffer_head* bread(int block) {
+buffer_head* bread(int dev, int block) {
+  buffer_shard& sh = shard_of(dev, block);
   buffer_head* bh;
-  //从blocks查找看该block是否已经读入内存，存在则直接返回
-  if ((bh = get_hash_table(block))) {
-    if (bh->b_count++ == 0) {
-      freeblocks.erase(block);
-    }
+  //从blocks查找看该block是否已经读入内存，存在则直接返回，不需要加锁
+  if ((bh = get_hash_table(sh, dev, block))) {
+    sh.hits.fetch_add(1, memory_order_relaxed);
+    return bh;
+  }
+  if (nowait) {
+    missed = 1;
+    return NULL;
+  }
+  lock_guard<level_mutex> g(sh.lock);
+  // 等待锁期间可能已经被其他线程读入
+  if ((bh = get_hash_table(sh, dev, block))) {
+    sh.hits.fetch_add(1, memory_order_relaxed);
     return bh;
   }
   //向blocks申请内存中block
-  bh = getblk(block);
-  //从磁盘中读取
-  ifstream disk;
-  disk.open("hdc-0.11.img", ios::binary);
-  disk.seekg((block + 1) * BLOCK_SIZE); // 整体偏移1位，以适应已有的img
-  disk.read(bh->b_data, BLOCK_SIZE);
+  bh = getblk(sh, dev, block);
+  sh.reads++;
+  //从磁盘中读取，读完之后才加入分片，其他线程不会看到未读入的block
+  disk_read(dev, block, bh->b_data);
   // cout << block<<"  Reading from the file"<< endl;
-  disk.close();
   bh->b_uptodate = 1;
-  bh->b_dirt = 0;
-  bh->b_count = 1;
+  publish(sh, bh);
+  return bh;
+}
+
+/*
+预读条带卷上的blocks(为0的跳过)：按条带分开，每个条带由一个线程读取自己的那部分，
+各个映像文件的读盘同时进行，读入的block留在缓冲区中，之后的bread直接命中
+单文件的设备上不做任何事，由之后的bread逐块读入
+*/
+void bread_ahead(int dev, const unsigned int* blocks, int n) {
+  device& d = devices[dev];
+  vector<int> todo[MAX_STRIPES];
+  vector<thread> readers;
+  int i, last = -1;
+
+  if (d.nstripes < 2 || nowait) return;
+  for (i = 0; i < n; i++) {
+    if (!blocks[i]) continue;
+    {
+      epoch_guard g;
+      if (hash_find(shard_of(dev, blocks[i]), dev, blocks[i])) continue;
+    }
+    todo[&stripe_of(d, blocks[i]) - d.stripes].push_back(blocks[i]);
+  }
+  auto read = [dev](vector<int>* v) {
+    for (int block : *v) brelse(bread(dev, block));
+  };
+  // 最后一个条带在本线程中读取，只涉及一个条带时不必启动线程
+  for (i = 0; i < d.nstripes; i++) {
+    if (todo[i].empty()) continue;
+    if (last >= 0) readers.emplace_back(read, &todo[last]);
+    last = i;
+  }
+  if (last >= 0) read(&todo[last]);
+  for (auto& t : readers) t.join();
+}
+
+/*
+开始不等待磁盘的读取：之后本线程的bread遇到不在缓冲区中的block时不读盘，直接返回NULL
+bread_nowait_end结束并返回期间是否遇到过这样的block，遇到过则期间读到的结果不完整
+*/
+void bread_nowait_begin() {
+  nowait = 1;
+  missed = 0;
+}
+int bread_nowait_end() {
+  nowait = 0;
+  return missed;
+}
+
+/*
+获取一个将被整块覆盖写的数据块，已经在内存中则直接返回，
+否则不从磁盘读取，直接返回清零的缓冲区，调用者必须写满整块并置b_dirt
+*/
+buffer_head* bget(int dev, int block) {
+  buffer_shard& sh = shard_of(dev, block);
+  buffer_head* bh;
+  if ((bh = get_hash_table(sh, dev, block))) {
+    sh.hits.fetch_add(1, memory_order_relaxed);
+    return bh;
+  }
+  lock_guard<level_mutex> g(sh.lock);
+  if ((bh = get_hash_table(sh, dev, block))) {
+    sh.hits.fetch_add(1, memory_order_relaxed);
+    return bh;
+  }
+  bh = getblk(sh, dev, block);
+  bh->b_uptodate = 1;
+  publish(sh, bh);
+  sh.overwrites++;
   return bh;
 }
 
@@ -118,62 +606,47 @@ void free_block(int dev, int block) {
   struct buffer_head* bh;
   if (!(sb = get_super(dev)))
     printf("trying to free block on nonexistent device");
-  if (block < sb->s_firstdatazone || block >= sb->s_nzones)
+  // 负数转为无符号后大于s_nzones
+  if ((unsigned int)block < sb->s_firstdatazone ||
+      (unsigned int)block >= sb->s_nzones)
     printf("trying to free block not in datazone");
-  /*首先查看内存中是否已经存在要清空的数据区，有则将该数据区作废*/
-  bh = get_hash_table(block);
-  if (bh) {
-    bh->b_count++;
-    if (bh->b_count != 1) {
-      printf("WARING trying to free block (%04x:%d), count=%d\n", dev, block,
-             bh->b_count);
-      return;
+  /*
+  首先查看内存中是否已经存在要清空的数据区，有则将该数据区作废
+  sync、预读和fsck等可能正短暂地持有它，等它们放开后再去掉，
+  否则写回中的旧内容可能覆盖之后重新分配到该块的数据。
+  调用者自己不会持有要释放的块，等待期间不持有分片的锁
+  */
+  buffer_shard& sh = shard_of(dev, block);
+  for (;;) {
+    {
+      lock_guard<level_mutex> g(sh.lock);
+      if (!(bh = hash_find(sh, dev, block))) break;
+      int zero = 0;
+      if (bh->b_count.compare_exchange_strong(zero, -1)) {
+        // 数据块作废，不必写回，直接从缓冲区中去掉，下次用到还是用bread
+        retire(sh, bh);
+        break;
+      }
     }
-    bh->b_dirt = 0;
-    /*修改uptodata，表示内存中数据不是最新的*/
-    bh->b_uptodate = 0;
-    brelse(bh);
-    // 因为不再uptodate，因此没有必要保存，下次用到还是用bread
-    blocks.erase(block);
-    freeblocks.erase(block);
-  }
-  /*修改数据块位图*/
-  block -= sb->s_firstdatazone - 1;
-  if (!get_bit(block % BLOCK_BIT,
-               sb->s_zmap[block / BLOCK_BIT]
-                   ->b_data)) {  //如果要修改的位图已经为0,说明出现程序bug
-    printf("WARING block :%d already cleared\n",
-           block + sb->s_firstdatazone - 1);
-  }
-  clear_bit(block % BLOCK_BIT, sb->s_zmap[block / BLOCK_BIT]->b_data);
-  sb->s_zmap[block / 8192]->b_dirt = 1;
+    this_thread::yield();
+  }
+  /*修改数据块位图，如果要修改的位图已经为0,说明出现程序bug*/
+  if (free_zone_bit(sb, block) < 0)
+    printf("WARING block :%d already cleared\n", block);
 }
 
 /*创建一个新的数据块，并写回磁盘的数据区*/
-int new_block(int dev) {
+int new_block(int dev) { return new_block_near(dev, 0); }
+
+/*创建一个新的数据块，优先使用goal及其之后的块，goal为0时在当前线程的分配组中分配*/
+int new_block_near(int dev, int goal) {
   struct buffer_head* bh;
   struct super_block* sb;
-  int i, j;
+  int j;
 
   if (!(sb = get_super(dev)))
     printf("trying to get new block from nonexistant device");
-
-  j = 8192;
-  for (i = 0; i < 8; i++)
-    if ((bh = sb->s_zmap[i]))
-      if ((j = find_first_zero(bh->b_data)) < 8192) break;
-  if (i >= 8 || !bh || j >= 8192) return 0;
-  //修改逻辑块位图
-  if (get_bit(j, bh->b_data)) {
-    printf("new_block: bit already set\n");
-    return 0;
-  }
-  set_bit(j, bh->b_data);
-  bh->b_dirt = 1;
-
-  j += i * 8192 + sb->s_firstdatazone - 1;
-  //超过了超级块的范围
-  if (j >= sb->s_nzones) return 0;
+  if (!(j = alloc_zone_bit(sb, goal))) return 0;
 
   //之后可以考虑增加blocks的最大值，即需要申请空闲block
   /*
@@ -183,31 +656,25 @@ int new_block(int dev) {
           panic("new block: count is != 1");
   clear_block(bh->b_data);
   */
-  //申请一块新的block空间
-  bh = getblk(j);
-  bh->b_count = 1;
+  //申请一块新的block空间，清零后留在缓冲区中，之后的读写不必再访问磁盘
+  buffer_shard& sh = shard_of(dev, j);
+  lock_guard<level_mutex> g(sh.lock);
+  bh = getblk(sh, dev, j);
   bh->b_uptodate = 1;
   bh->b_dirt = 1;
-  brelse(bh);
+  bh->b_count.store(0, memory_order_relaxed);
+  bh->b_ref.store(1, memory_order_relaxed);
+  publish(sh, bh);
   return j;
 }
 
-/*给予其他进程使用，每当一个进程通过bread获取数据块时，i_count++，
-当b_count=0时，如果该数据块已经被修改，则写回磁盘，该块将加入空闲队列
+/*给予其他进程使用，每当一个进程通过bread获取数据块时，b_count++，
+当b_count=0时，该块可以被换出，被修改过的块等到换出或sync时才写回磁盘
 b_count=0 仅代表目前该数据块没有进程使用*/
 int brelse(buffer_head* bh) {
   if (!bh) return 1;
-  if (bh->b_count > 1) {
-    bh->b_count--;
-    return 1;
-  }
-  if (bh->b_dirt) {
-    // printf("WARING %d b_count!=0 \n",i.first);
-    bwrite(bh->b_blocknr, bh->b_data);
-    bh->b_dirt = 0;
-  }
-  bh->b_count--;
-  freeblocks.insert(bh->b_blocknr);
-  //暂且不考虑内存的释放
+  // 不加锁，换出时会跳过最近被使用过的block
+  bh->b_ref.store(1, memory_order_relaxed);
+  bh->b_count.fetch_sub(1, memory_order_release);
   return 1;
 }
@@ -0,0 +1,69 @@
+/*
+epoch的实现，见epoch.h
+全局epoch只有在所有正在读的线程都已经看到当前值时才能加一，
+因此在stamp时摘下的节点，等全局epoch到达stamp+2时，不会再有读者持有它
+*/
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+
+#include "epoch.h"
+
+/*同时使用文件系统的线程数上限*/
+#define EPOCH_SLOTS 256
+
+struct alignas(64) epoch_slot {
+  std::atomic<unsigned long> local;  // 该线程进入时看到的epoch，0表示不在读
+  std::atomic<int> used;
+};
+
+/*每个线程第一次进入时占用一个slot，线程退出时归还*/
+struct epoch_thread {
+  int slot = -1;
+  int depth = 0;  // 允许嵌套进入
+  ~epoch_thread();
+};
+
+static std::atomic<unsigned long> global_epoch{1};
+static epoch_slot slots[EPOCH_SLOTS];
+static thread_local epoch_thread self;
+
+epoch_thread::~epoch_thread() {
+  if (slot >= 0) slots[slot].used.store(0, std::memory_order_release);
+}
+
+static int claim_slot() {
+  for (int i = 0; i < EPOCH_SLOTS; i++) {
+    int free = 0;
+    if (slots[i].used.compare_exchange_strong(free, 1)) return i;
+  }
+  fprintf(stderr, "epoch: too many threads\n");
+  abort();
+}
+
+void epoch_enter() {
+  if (self.depth++) return;
+  if (self.slot < 0) self.slot = claim_slot();
+  slots[self.slot].local.store(global_epoch.load());
+  // 之后的读取必须在公布epoch之后进行
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+}
+
+void epoch_exit() {
+  if (--self.depth) return;
+  slots[self.slot].local.store(0, std::memory_order_release);
+}
+
+unsigned long epoch_stamp() { return global_epoch.load(); }
+
+/*stamp时摘下的节点是否可以释放，必要时尝试推进全局epoch*/
+bool epoch_reclaimable(unsigned long stamp) {
+  unsigned long g = global_epoch.load();
+  if (g >= stamp + 2) return true;
+  for (int i = 0; i < EPOCH_SLOTS; i++) {
+    unsigned long l = slots[i].local.load();
+    if (l && l != g) return false;
+  }
+  global_epoch.compare_exchange_strong(g, g + 1);
+  return global_epoch.load() >= stamp + 2;
+}
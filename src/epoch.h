@@ -0,0 +1,22 @@
+#pragma once
+/*
+基于epoch的延迟释放，用于无锁读取的数据结构(目前是缓冲区的哈希链)：
+  读者在访问前epoch_enter，访问结束后epoch_exit，期间读到的节点不会被释放
+  写者把节点从链上摘下后，记下epoch_stamp()，之后epoch_reclaimable(stamp)
+  返回true时才能真正释放，此时所有可能读到该节点的读者都已经退出
+读者不需要加任何锁，只写自己线程的一个计数
+*/
+
+void epoch_enter();
+void epoch_exit();
+unsigned long epoch_stamp();
+bool epoch_reclaimable(unsigned long stamp);
+
+/*作用域内处于读者状态*/
+class epoch_guard {
+ public:
+  epoch_guard() { epoch_enter(); }
+  ~epoch_guard() { epoch_exit(); }
+  epoch_guard(const epoch_guard&) = delete;
+  epoch_guard& operator=(const epoch_guard&) = delete;
+};
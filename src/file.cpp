@@ -8,6 +8,11 @@
 
 #define MIN(a, b) (((a) < (b)) ? (a) : (b))
 #define MAX(a, b) (((a) > (b)) ? (a) : (b))
+/*file_write每批映射的逻辑块数*/
+#define WRITE_BATCH 64
+/*条带卷上file_read每次预读的逻辑块数，
+  不超过缓冲区的1/4，预读的block在用到之前不会被换出*/
+#define READ_AHEAD MIN(128, BUFFER_SIZE / 4)
 
 /*改自open_namei*/
 
@@ -22,7 +27,7 @@
 int open_file(const char* pathname, int flag, int mode,
               struct m_inode*& res_inode) {
   const char* basename;
-  int inr, dev, namelen;
+  int namelen;
   struct m_inode *dir, *inode;
   struct buffer_head* bh;
   struct dir_entry* de;
@@ -36,41 +41,63 @@ int open_file(const char* pathname, int flag, int mode,
     return -EISDIR;
   }
 
-  // 查找文件项
-  bh = find_entry(&dir, basename, namelen, &de);
+  // 文件名中不能含有长文件名的标记字节，这样的文件不会存在，也不能创建
+  if (!dir_name_valid(basename, namelen)) {
+    iput(dir);
+    return -EINVAL;
+  }
+
+  // 只读的卷上只能以只读方式打开
+  if (flag != O_RDONLY && is_rdonly(dir)) {
+    iput(dir);
+    return -EROFS;
+  }
 
-  // 如果文件项不存在，则创建新文件
+  // 先加读锁查找文件项，不存在时再加写锁重新查找并创建
+  lock_inode_shared(dir);
+  bh = find_entry(&dir, basename, namelen, &de);
   if (!bh) {
-    inode = new_inode(dir->i_dev);
-    if (!inode) {
-      iput(dir);
-      return -ENOSPC;
-    }
-    inode->i_mode = mode;
-    inode->i_dirt = 1;
-    bh = add_entry(dir, basename, namelen, &de);
+    unlock_inode_shared(dir);
+    lock_inode(dir);
+    bh = find_entry(&dir, basename, namelen, &de);
+    // 如果文件项不存在，则创建新文件
     if (!bh) {
-      inode->i_nlinks--;  // 如果添加目录项失败，减少文件的链接数
-      iput(inode);
+      inode = new_inode(dir->i_dev);
+      if (!inode) {
+        unlock_inode(dir);
+        iput(dir);
+        return -ENOSPC;
+      }
+      inode->i_mode = mode;
+      inode->i_dirt = 1;
+      inline_init(inode);
+      bh = add_entry(dir, basename, namelen, &de);
+      if (!bh) {
+        inode->i_nlinks--;  // 如果添加目录项失败，减少文件的链接数
+        unlock_inode(dir);
+        iput(inode);
+        iput(dir);
+        return -ENOSPC;
+      }
+      dir_set_inode(de, inode->i_num);
+      bh->b_dirt = 1;  // 将目录项所在的块标记为已修改
+      brelse(bh);
+      unlock_inode(dir);
       iput(dir);
-      return -ENOSPC;
+      res_inode = inode;
+      return 0;
     }
-    de->inode = inode->i_num;
-    bh->b_dirt = 1;  // 将目录项所在的块标记为已修改
-    brelse(bh);
-    iput(dir);
-    res_inode = inode;
-    return 0;
+    // 其他线程已经创建了该文件
+    inode = iget(dir->i_dev, de->inode);
+    unlock_inode(dir);
+  } else {
+    // 文件存在，在持有目录锁时获取文件i节点，防止目录项被同时删除
+    inode = iget(dir->i_dev, de->inode);
+    unlock_inode_shared(dir);
   }
-
-  // 文件存在，获取文件i节点
-  inr = de->inode;
-  dev = dir->i_dev;
   brelse(bh);
   iput(dir);
-
-  // 获取文件的i节点
-  if (!(inode = iget(dev, inr))) return -EPERM;
+  if (!inode) return -EPERM;
 
   // 如果文件是目录而且要求非只读操作，则拒绝打开
   if (S_ISDIR(inode->i_mode) && flag != O_RDONLY) {
@@ -85,15 +112,83 @@ int open_file(const char* pathname, int flag, int mode,
 }
 
 /*
- * @brief 从文件中读取指定长度的内容到缓冲区中
- * @param inode 指向文件i节点的指针
- * @param filp 指向文件描述符的指针
- * @param buf 用于存储读取内容的缓冲区
- * @param count 需要读取的字节数
- * @return 返回实际读取的字节数，若出错则返回相应错误码
+ * 小于INLINE_DATA_SIZE的普通文件，数据直接存放在i_zone的空间中，
+ * 读写时无需再读取数据块，文件增大后再转换为按块存放
  */
-int file_read(struct m_inode* inode, struct file* filp, char* buf, int count) {
-  int left, chars, nr;
+void inline_init(struct m_inode* inode) {
+  struct super_block* sb = get_super(inode->i_dev);
+  if (S_ISREG(inode->i_mode) && sb->s_version == 2) {
+    memset(inode->i_zone, 0, sizeof(inode->i_zone));
+    inode->i_flags |= I_INLINE;
+    inode->i_dirt = 1;
+  }
+}
+
+/*将内联数据搬到第0个数据块，之后该文件按块存放*/
+static int inline_to_blocks(struct m_inode* inode) {
+  char data[INLINE_DATA_SIZE];
+  struct buffer_head* bh;
+  int block;
+
+  memcpy(data, inode->i_zone, INLINE_DATA_SIZE);
+  memset(inode->i_zone, 0, sizeof(inode->i_zone));
+  inode->i_flags &= ~I_INLINE;
+  inode->i_dirt = 1;
+  if (!inode->i_size) return 0;
+  if (!(block = create_block(inode, 0)) ||
+      !(bh = bread(inode->i_dev, block))) {
+    // 申请数据块失败，恢复为内联存放
+    memcpy(inode->i_zone, data, INLINE_DATA_SIZE);
+    inode->i_flags |= I_INLINE;
+    return -ENOSPC;
+  }
+  memcpy(bh->b_data, data, inode->i_size);
+  bh->b_dirt = 1;
+  brelse(bh);
+  return 0;
+}
+
+static int inline_read(struct m_inode* inode, struct file* filp, char* buf,
+                       int count) {
+  int chars;
+
+  if (count <= 0) return 0;
+  if (~filp->f_flags & 1) return -EACCES;
+  chars = MIN(count, (int)INLINE_DATA_SIZE - filp->f_pos);
+  if (chars < 0) chars = 0;
+  memcpy(buf, (char*)inode->i_zone + filp->f_pos, chars);
+  memset(buf + chars, 0, count - chars);
+  buf[count] = 0;
+  filp->f_pos += count;
+  inode->i_atime = CurrentTime();
+  return count;
+}
+
+/*写入后仍能内联存放则直接写入i_zone，返回写入字节数，否则返回0*/
+static int inline_write(struct m_inode* inode, struct file* filp, char* buf,
+                        int count) {
+  off_t pos = (filp->f_flags == O_APPEND) ? inode->i_size : filp->f_pos;
+
+  if (pos + count > (off_t)INLINE_DATA_SIZE) return 0;
+  memcpy((char*)inode->i_zone + pos, buf, count);
+  pos += count;
+  if (pos > inode->i_size) inode->i_size = pos;
+  inode->i_mtime = CurrentTime();
+  inode->i_dirt = 1;
+  if (!(filp->f_flags == O_APPEND)) {
+    filp->f_pos = pos;
+    inode->i_ctime = CurrentTime();
+  }
+  return count;
+}
+
+/*file_read与file_write按块大小特化的实现，BS为编译期常量*/
+template <int BS>
+static int do_file_read(struct m_inode* inode, struct file* filp, char* buf,
+                        int count) {
+  unsigned int zones[READ_AHEAD];
+  int left, chars, nr, block, ahead = -1;
+  int striped = dev_stripes(inode->i_dev) > 1;
   struct buffer_head* bh;
 
   // 如果需要读取的字节数小于等于0，直接返回
@@ -104,15 +199,23 @@ int file_read(struct m_inode* inode, struct file* filp, char* buf, int count) {
 
   // 逐块读取文件内容
   while (left) {
+    // 条带卷上一次映射之后的一段，各个映像文件同时读盘
+    block = filp->f_pos / BS;
+    if (striped && (ahead < 0 || block >= ahead)) {
+      nr = MIN((filp->f_pos % BS + left + BS - 1) / BS, READ_AHEAD);
+      if ((nr = map_blocks(inode, block, nr, zones, 0)) > 0)
+        bread_ahead(inode->i_dev, zones, nr);
+      ahead = block + READ_AHEAD;
+    }
     // 获取逻辑块号
-    if ((nr = bmap(inode, (filp->f_pos) / BLOCK_SIZE))) {
-      if (!(bh = bread(nr))) break;
+    if ((nr = bmap(inode, (filp->f_pos) / BS))) {
+      if (!(bh = bread(inode->i_dev, nr))) break;
     } else
       bh = NULL;
 
     // 计算在当前逻辑块中的偏移量和实际需要读取的字节数
-    nr = filp->f_pos % BLOCK_SIZE;
-    chars = MIN(BLOCK_SIZE - nr, left);
+    nr = filp->f_pos % BS;
+    chars = MIN(BS - nr, left);
 
     // 更新文件读取位置
     filp->f_pos += chars;
@@ -141,24 +244,20 @@ int file_read(struct m_inode* inode, struct file* filp, char* buf, int count) {
   }
   buf[0] = 0;
 
-  // 更新文件访问时间
-  inode->i_atime = CurrentTime();
+  // 更新文件访问时间，持有读锁的线程可能同时读取同一个文件
+  __atomic_store_n(&inode->i_atime, CurrentTime(), __ATOMIC_RELAXED);
 
   // 返回实际读取的字节数，如果没有读取任何数据则返回错误码ERANGE
   return (count - left) ? (count - left) : -ERANGE;
 }
 
-/*
- * @brief 将指定长度的数据写入文件，更新文件的相关属性
- * @param inode 指向文件i节点的指针
- * @param filp 指向文件描述符的指针
- * @param buf 包含待写入数据的缓冲区
- * @param count 待写入数据的字节数
- * @return 返回实际写入的字节数，若出错则返回相应错误码
- */
-int file_write(struct m_inode* inode, struct file* filp, char* buf, int count) {
+
+template <int BS>
+static int do_file_write(struct m_inode* inode, struct file* filp, char* buf,
+                         int count) {
   off_t pos;
-  int block, c;
+  int c, k, n, mapped;
+  unsigned int zones[WRITE_BATCH];
   struct buffer_head* bh;
   char* p;
   int i = 0;
@@ -174,39 +273,44 @@ int file_write(struct m_inode* inode, struct file* filp, char* buf, int count) {
   else
     pos = filp->f_pos;
 
-  // 逐块写入文件内容
+  // 按批写入文件内容，每批的逻辑块一次性映射(必要时创建)
   while (i < count) {
-    // 获取逻辑块号并创建逻辑块
-    if (!(block = create_block(inode, pos / BLOCK_SIZE))) break;
-
-    // 读取逻辑块到缓冲区
-    if (!(bh = bread(block))) break;
-
-    // 计算在当前逻辑块中的偏移量和实际需要写入的字节数
-    c = pos % BLOCK_SIZE;
-    p = c + bh->b_data;
-    bh->b_dirt = 1;
-    c = BLOCK_SIZE - c;
-    if (c > count - i) c = count - i;
-    pos += c;
-
-    // 更新文件大小
-    if (pos > inode->i_size) {
-      inode->i_size = pos;
-      inode->i_dirt = 1;
-    }
-
-    i += c;
+    n = (pos % BS + (count - i) + BS - 1) / BS;
+    if (n > WRITE_BATCH) n = WRITE_BATCH;
+    if ((mapped = map_blocks(inode, pos / BS, n, zones, 1)) <= 0) break;
+
+    for (k = 0; k < mapped && i < count; k++) {
+      // 计算在当前逻辑块中的偏移量和实际需要写入的字节数
+      c = pos % BS;
+      // 整块覆盖时不必先从磁盘读取原有内容
+      if (!c && count - i >= BS)
+        bh = bget(inode->i_dev, zones[k]);
+      else
+        bh = bread(inode->i_dev, zones[k]);
+      if (!bh) break;
+      p = c + bh->b_data;
+      c = BS - c;
+      if (c > count - i) c = count - i;
+      pos += c;
+
+      // 更新文件大小
+      if (pos > inode->i_size) {
+        inode->i_size = pos;
+        inode->i_dirt = 1;
+      }
+
+      i += c;
+
+      // 将数据从缓冲区写入逻辑块
+      memcpy(p, buf, c);
+      buf += c;
+      // 写完之后再标记，写回时清除的标记不会盖过这次修改
+      bh->b_dirt = 1;
 
-    // 将数据从缓冲区写入逻辑块
-    memcpy(p, buf, c);
-    buf += c;
-    // while (c-- > 0) {
-    //   *(p++) = buf[0];
-    //   buf++;
-    // }
-
-    brelse(bh);
+      brelse(bh);
+    }
+    // 空间不足，只映射到了部分逻辑块
+    if (k < n) break;
   }
 
   // 更新文件修改时间
@@ -220,3 +324,43 @@ int file_write(struct m_inode* inode, struct file* filp, char* buf, int count) {
 
   return (i ? i : -1);
 }
+
+/*
+ * @brief 从文件中读取指定长度的内容到缓冲区中
+ * @param inode 指向文件i节点的指针
+ * @param filp 指向文件描述符的指针
+ * @param buf 用于存储读取内容的缓冲区
+ * @param count 需要读取的字节数
+ * @return 返回实际读取的字节数，若出错则返回相应错误码
+ */
+int file_read(struct m_inode* inode, struct file* filp, char* buf, int count) {
+  struct super_block* sb = get_super(inode->i_dev);
+  if (inode->i_flags & I_INLINE) return inline_read(inode, filp, buf, count);
+  return BLOCKSIZE_DISPATCH(sb->s_blocksize, -EINVAL, do_file_read, inode,
+                            filp, buf, count);
+}
+
+/*
+ * @brief 将指定长度的数据写入文件，更新文件的相关属性
+ * @param inode 指向文件i节点的指针
+ * @param filp 指向文件描述符的指针
+ * @param buf 包含待写入数据的缓冲区
+ * @param count 待写入数据的字节数
+ * @return 返回实际写入的字节数，若出错则返回相应错误码
+ */
+int file_write(struct m_inode* inode, struct file* filp, char* buf, int count) {
+  struct super_block* sb = get_super(inode->i_dev);
+  int i;
+
+  if (inode->i_flags & I_INLINE) {
+    // 检查文件是否具有写权限
+    if (filp->f_flags != O_WRONLY && filp->f_flags != O_RDWR &&
+        filp->f_flags != O_APPEND)
+      return -EACCES;
+    if ((i = inline_write(inode, filp, buf, count))) return i;
+    // 超出内联空间，转换为按块存放后再写入
+    if ((i = inline_to_blocks(inode)) < 0) return i;
+  }
+  return BLOCKSIZE_DISPATCH(sb->s_blocksize, -EINVAL, do_file_write, inode,
+                            filp, buf, count);
+}
@@ -3,24 +3,41 @@
 #include<iostream>
 #include<string>
 #include<cstring>
+#include<atomic>
+#include<vector>
 
 #define NAME_LEN 14
+/*最小(也是v1默认)的块大小，实际块大小为 BLOCK_SIZE << s_log_zone_size*/
 #define BLOCK_SIZE 1024
+#define MAX_BLOCK_SIZE 8192
 #define BLOCK_BIT (BLOCK_SIZE*8)
 /*dev是设备号，ino是根节点的INODE号 初始化时候会读取磁盘的根目录*/
 /*超级块是存放在磁盘的第一个block，用bread(1)读取*/
 #define ROOT_INO 1
 #define ROOT_DEV 0
-/*一个block中inode个数---32*/
-#define INODES_PER_BLOCK ((BLOCK_SIZE)/(sizeof (struct d_inode)))
+/*一个block中inode个数---1K块时为32*/
+#define INODES_PER_BLOCK(size) ((size)/(sizeof (struct d_inode)))
+/*v2格式一个block中inode个数---1K块时为16*/
+#define INODES_PER_BLOCK_V2(size) ((size)/(sizeof (struct d_inode2)))
 #define SUPER_MAGIC 0x137F
-/*最多打开20个文件*/
-#define NR_OPEN 20
-/*内存中最多的inode的数量*/
-#define NR_INODE 32
+/*v2磁盘格式：32位的逻辑块号与i节点号，支持三级索引*/
+#define SUPER_MAGIC_V2 0x2468
+/*内存中最多的inode的数量，每个会话打开的文件都会占用一个*/
+#define NR_INODE 1024
+/*最多的设备(映像文件)个数，设备号即sb中的下标，0为根设备*/
 #define NR_SUPER 8
+/*一个设备最多由几个映像文件组成条带卷*/
+#define MAX_STRIPES 8
 // 最多保存count=0的buffer个数
 #define BUFFER_SIZE 1024
+// 缓冲区的分片数，每片有自己的锁
+#define NR_BUF_SHARDS 16
+// 每个目录在内存中记录的含有空闲目录项的块数
+#define DIR_HOLES 8
+// 目录项缓存的最大项数
+#define DCACHE_SIZE 4096
+// 遍历目录时每次映射的数据块数
+#define DIR_ITER_BATCH 32
 
 /*文件读写权限*/
 #define O_RDONLY 1
@@ -28,11 +45,24 @@
 #define O_RDWR 3
 #define O_APPEND 4 //append模式即可读又可写，写只能在文件末尾添加
 
-/*一块中目录项的个数---64*/
-#define DIR_ENTRIES_PER_BLOCK ((BLOCK_SIZE)/(sizeof (struct dir_entry)))
-/**/
-#define I_MAP_SLOTS 8
-#define Z_MAP_SLOTS 8
+/*一块中目录项的个数---1K块时为64*/
+#define DIR_ENTRIES_PER_BLOCK(sb) (((sb)->s_blocksize)/(sizeof (struct dir_entry)))
+/*一个位图块中的位数*/
+#define BLOCK_BITS(sb) ((sb)->s_blocksize * 8)
+/*位图块的最大个数，v1格式最多使用8个*/
+#define I_MAP_SLOTS 64
+#define Z_MAP_SLOTS 256
+/*i_zone中直接索引的个数，之后依次为一级、二级、(v2)三级索引*/
+#define NR_DIRECT 7
+#define NR_ZONES_V1 9
+#define NR_ZONES_V2 10
+/*i_flags: 小文件的数据直接存放在i_zone中(仅v2格式)*/
+#define I_INLINE 0x0001
+#define INLINE_DATA_SIZE (sizeof(unsigned int) * NR_ZONES_V2)
+/*i_flags: 目录建有哈希索引(仅v2格式)，见htree.cpp*/
+#define I_INDEX 0x0002
+/*目录项中的inode号只有16位，v2格式的i节点数也不能超过该值*/
+#define MAX_DIR_INODE 65535
 
 /*定义文件类型*/
 #define S_IFMT  00170000
@@ -54,22 +84,22 @@
 
 #define reverse_bit(x,y)  x^=(1<<y)
 
-//磁盘块
-typedef char buffer_block[BLOCK_SIZE];
+//磁盘块，实际只使用前 s_blocksize 个字节
+typedef char buffer_block[MAX_BLOCK_SIZE];
 
 // 用于缓冲读入与写出磁盘块
 struct buffer_head {
 	char * b_data;			/* pointer to data block (1024 bytes) */
 	unsigned int b_blocknr;	/* block number */
-	unsigned short b_dev;		/* device (0 = free) */
+	unsigned short b_dev;		/* device */
 	unsigned char b_uptodate;
-	unsigned char b_dirt;		/* 0-clean,1-dirty */
-	unsigned char b_count;		/* users using this block */
+	std::atomic<unsigned char> b_dirt;	/* 0-clean,1-dirty，修改完数据之后再置位 */
 	unsigned char b_lock;		/* 0 - ok, 1 -locked */
+	std::atomic<unsigned char> b_ref;	/* 最近被使用过，换出时跳过一次 */
+	std::atomic<int> b_count;	/* users using this block, -1表示正在换出 */
 	struct task_struct * b_wait;
-	struct buffer_head * b_prev;
-	struct buffer_head * b_next;
-	struct buffer_head * b_prev_free;
+	std::atomic<struct buffer_head *> b_next;	/* 哈希链，读取时不加锁 */
+	struct buffer_head * b_prev_free;	/* 分片中所有block组成的环 */
 	struct buffer_head * b_next_free;
 };
 //超级块
@@ -83,13 +113,27 @@ struct d_super_block {
 	unsigned int s_max_size;
 	unsigned short s_magic;/*文件类型*/
 };
+//v2超级块，s_magic与v1处于相同的偏移(16)，挂载时据此判断格式
+struct d_super_block2 {
+	unsigned short s_imap_blocks;
+	unsigned short s_zmap_blocks;
+	unsigned short s_log_zone_size;
+	unsigned short s_pad;
+	unsigned int s_max_size;
+	unsigned int s_firstdatazone;
+	unsigned short s_magic;
+	unsigned short s_pad2;
+	unsigned int s_ninodes;
+	unsigned int s_nzones;
+};
+struct alloc_groups;
 //内存中超级块
 struct super_block {
-	unsigned short s_ninodes;
-	unsigned short s_nzones;
+	unsigned int s_ninodes;
+	unsigned int s_nzones;
 	unsigned short s_imap_blocks;
 	unsigned short s_zmap_blocks;
-	unsigned short s_firstdatazone;
+	unsigned int s_firstdatazone;
 	unsigned short s_log_zone_size;
 	unsigned int s_max_size;
 	unsigned short s_magic;
@@ -97,8 +141,13 @@ struct super_block {
 	struct buffer_head * s_imap[I_MAP_SLOTS];/*i节点位图数组*/
 	struct buffer_head * s_zmap[Z_MAP_SLOTS];/*逻辑节点位图数组*/
 	unsigned short s_dev;
-	struct m_inode * s_isup;
-	struct m_inode * s_imount;
+	unsigned char s_version; /*1 或 2*/
+	unsigned int s_blocksize; /*块大小，1K/4K/8K*/
+	unsigned short s_inodes_per_block;
+	unsigned short s_zones_per_block; /*一个索引块中的逻辑块号个数*/
+	struct alloc_groups * s_groups; /*位图的分配组，见bitmap.cpp*/
+	struct m_inode * s_isup;   /*该卷的根目录*/
+	struct m_inode * s_imount; /*该卷挂载在哪个目录上*/
 	unsigned int s_time;
 	struct task_struct * s_wait;
 	unsigned char s_lock;
@@ -110,6 +159,60 @@ struct dir_entry {
 	unsigned short inode;
 	char name[NAME_LEN];
 };
+/*一个目录块中有效目录项位图所需的64位字数*/
+#define DIR_LIVE_WORDS (MAX_BLOCK_SIZE / sizeof(struct dir_entry) / 64)
+/*
+长文件名：不超过NAME_LEN个字符的文件名仍然只占一个目录项，与原来的格式相同。
+更长的文件名占用同一块中连续的多个目录项：首项的name依次存放前DE_PREFIX个字符、
+文件名长度和DE_LONG，之后每个续项存放接下来的DE_CONT_CHARS个字符和DE_CONT，
+续项的inode号与首项相同，因此按inode号判断空闲项的代码不会把它们当作空闲项
+文件名中不能含有DE_LONG和DE_CONT，NAME_LEN个字符的文件名最后一个字符因此不会被当作标记
+*/
+#define LONG_NAME_LEN 255
+#define DE_PREFIX 12
+#define DE_CONT_CHARS 13
+#define DE_LONG 0x01
+#define DE_CONT 0x02
+#define DE_IS_LONG(de) ((de)->name[NAME_LEN - 1] == DE_LONG)
+#define DE_IS_CONT(de) ((de)->name[NAME_LEN - 1] == DE_CONT)
+/*文件名所占的目录项个数*/
+static inline int dir_name_slots(int namelen) {
+	if (namelen <= NAME_LEN) return 1;
+	return 1 + (namelen - DE_PREFIX + DE_CONT_CHARS - 1) / DE_CONT_CHARS;
+}
+/*文件名是否可以写入目录项，不能含有长文件名的标记字节*/
+static inline int dir_name_valid(const char * name, int namelen) {
+	return !memchr(name, DE_LONG, namelen) && !memchr(name, DE_CONT, namelen);
+}
+/*
+把文件名转换为NAME_LEN字节的定长形式，与dir_entry::name直接比较，
+超长或含有标记字节时返回0
+长文件名得到的是首项的形式，比较相同后还需要比较续项
+*/
+static inline int dir_name_key(char * key, const char * name, int namelen) {
+	if (namelen > LONG_NAME_LEN || !dir_name_valid(name, namelen)) return 0;
+	if (namelen <= NAME_LEN) {
+		memcpy(key, name, namelen);
+		memset(key + namelen, 0, NAME_LEN - namelen);
+	} else {
+		memcpy(key, name, DE_PREFIX);
+		key[DE_PREFIX] = namelen;
+		key[NAME_LEN - 1] = DE_LONG;
+	}
+	return 1;
+}
+/*按块大小特化的常量，BS为编译期常量时，块内的除法与取模都会被编译为移位*/
+template <int BS>
+struct block_geometry {
+	static const int size = BS;
+	static const int bits = BS * 8;
+	static const int dir_entries = BS / sizeof(struct dir_entry);
+};
+/*按块大小分派到对应的特化实现，size不是支持的块大小时返回err*/
+#define BLOCKSIZE_DISPATCH(size, err, fn, ...) \
+	((size) == 1024 ? fn<1024>(__VA_ARGS__) : \
+	 (size) == 4096 ? fn<4096>(__VA_ARGS__) : \
+	 (size) == 8192 ? fn<8192>(__VA_ARGS__) : (err))
 //磁盘中inode节点，即FCB，记录文件的meta-data与其存放的数据块位置
 struct d_inode {
 	unsigned short i_mode;
@@ -121,6 +224,19 @@ struct d_inode {
 	unsigned char i_nlinks;
 	unsigned short i_zone[9]; // 信息放在数据区的第x个块
 };
+//v2磁盘inode，64字节，逻辑块号为32位，i_zone[9]为三级索引
+struct d_inode2 {
+	unsigned short i_mode;
+	unsigned short i_uid;
+	unsigned int i_size;
+	unsigned int i_time;
+	unsigned int i_atime;
+	unsigned int i_ctime;
+	unsigned char i_gid;
+	unsigned char i_nlinks;
+	unsigned short i_flags;
+	unsigned int i_zone[10];
+};
 //内存中inode节点
 struct m_inode {
 	unsigned short i_mode;
@@ -129,13 +245,14 @@ struct m_inode {
 	unsigned int i_mtime;
 	unsigned char i_gid;
 	unsigned char i_nlinks;
-	unsigned short i_zone[9];
+	unsigned short i_flags;
+	unsigned int i_zone[10];
 	/* these are in memory also */
 	struct task_struct * i_wait;
 	unsigned int i_atime;
 	unsigned int i_ctime;
 	unsigned short i_dev; // 设备号
-	unsigned short i_num; // 第x个i节点
+	unsigned int i_num; // 第x个i节点
 	unsigned short i_count; // 在内存中被多少个文件所使用
 	unsigned char i_lock;
 	unsigned char i_dirt;
@@ -143,6 +260,19 @@ struct m_inode {
 	unsigned char i_mount;
 	unsigned char i_seek;
 	unsigned char i_update;
+	/*目录中含有空闲目录项的数据块，i_packed表示除这些块外目录中没有空闲项*/
+	unsigned int i_holes[DIR_HOLES];
+	unsigned char i_nholes;
+	unsigned char i_packed;
+	/*读入后目录中被删除而尚未重新使用的目录项数，用于决定何时压缩目录*/
+	unsigned int i_ndead;
+	/*下次为该文件分配数据块时优先使用的块号，0表示没有*/
+	unsigned int i_goal;
+	/*在inode_table中的位置，对应的读写锁见lock_inode*/
+	unsigned short i_slot;
+	/*通过路径查找到该inode时记下的父目录inode号与文件名，0表示未知*/
+	unsigned int i_parent;
+	char i_name[LONG_NAME_LEN + 1];
 };
 
 struct file {
@@ -152,45 +282,203 @@ struct file {
 	struct m_inode * f_inode;
 	off_t f_pos;
 };
+//缓冲区统计信息
+struct buffer_stats {
+	unsigned long hits;       /*在缓冲区中命中的次数*/
+	unsigned long reads;      /*从磁盘读入的次数*/
+	unsigned long writes;     /*写回磁盘的次数*/
+	unsigned long overwrites; /*整块覆盖写而省去的读盘次数*/
+};
+//目录项缓存统计信息
+struct dcache_stats {
+	unsigned long hits;          /*命中存在的文件名*/
+	unsigned long negative_hits; /*命中不存在的文件名*/
+	unsigned long misses;        /*未命中，需要查找目录块*/
+	unsigned long entries;       /*当前缓存的项数*/
+};
+/*
+目录迭代器，按顺序遍历目录的数据块，逻辑块号每次成批映射，
+读取失败或不存在的块被跳过，见namei.cpp中的dir_iter_block
+*/
+struct dir_iter {
+	struct m_inode * dir;
+	int entries;             /*目录项总数*/
+	int epb;                 /*一块中的目录项数*/
+	int pos;                 /*下一个要访问的块的起始位置*/
+	int base, nzones;        /*zones中映射好的逻辑块范围*/
+	unsigned int zones[DIR_ITER_BATCH];
+	struct buffer_head * bh; /*当前目录块，没有时为NULL*/
+	struct dir_entry * de;   /*当前块中的第0项*/
+	int index;               /*当前块第0项在目录中的位置*/
+	int n;                   /*当前块中属于目录的项数*/
+	int k;                   /*dir_iter_next在当前块中的下一项*/
+};
+//copy_tree复制的文件数、目录数与字节数
+struct copy_stats {
+	unsigned long files;
+	unsigned long dirs;
+	unsigned long bytes;
+};
+//fsck检查的结果
+struct fsck_stats {
+	unsigned long inodes;   /*可达的inode数*/
+	unsigned long dirs;     /*其中的目录数*/
+	unsigned long zones;    /*使用中的逻辑块数*/
+	unsigned long problems; /*发现的问题数*/
+	unsigned long fixed;    /*修复的问题数*/
+};
+//sys_getdents_plus返回的目录项及其属性
+struct dirent_plus {
+	unsigned int d_ino;
+	char d_name[LONG_NAME_LEN + 1];
+	unsigned short d_mode;
+	unsigned int d_size;
+	unsigned int d_mtime;
+};
+//所有会话共享的已挂载的卷
 struct FileManageMent
 {
-	struct file* filp[NR_OPEN];
 	m_inode* root;
-	m_inode* current;
-	std::string name;
 };
 extern FileManageMent* fileSystem;
+//一个会话(客户端)的上下文，仿照Linux的task_struct，每个会话有自己的工作目录与打开的文件
+struct session
+{
+	std::vector<struct file*> filp;	/*文件描述符表，按需增长*/
+	m_inode* pwd;			/*当前工作目录*/
+	std::string name;		/*当前工作目录的路径*/
+};
+//当前线程正在服务的会话
+extern thread_local struct session* current;
+struct session* session_create();
+void session_destroy(struct session* s);
 
-buffer_head* bread(int block);
-char* bwrite(int block, char* bh);
+buffer_head* bread(int dev, int block);
+buffer_head* bget(int dev, int block);
+void bread_ahead(int dev, const unsigned int * blocks, int n);
+void bread_nowait_begin();
+int bread_nowait_end();
+char* bwrite(int dev, int block, char* bh);
 int brelse(buffer_head* bh);
+int dev_open(int dev, const char * path);
+void dev_close(int dev);
+int dev_create(int dev, int stripes);
+int dev_stripes(int dev);
+int dev_origin(int dev);
+void disk_read(int dev, int block, char * data);
+std::string dev_path(int dev);
+void invalidate_blocks(int dev);
 struct super_block * get_super(int dev);
 struct m_inode *iget(int dev, int nr);
 void mount_root();
-void initialize_block(int dev);
+int mount_image(const char * image, struct m_inode * dir);
+int umount_dev(int dev);
+void initialize_block(int dev, int version, unsigned int nzones,
+	int blocksize, int stripes);
+int is_rdonly(struct m_inode * inode);
+void set_blocksize(int dev, int size);
+/*卷的快照，见snapshot.cpp*/
+int snapshot_create(int dev);
+int snapshot_delete(int dev);
+void snap_load(int dev, const std::string & path);
+void snap_close(int dev);
+int snap_attach(const char * path);
+void snap_detach(int dev);
+int snap_mounted(int dev);
+int snap_before_write(int dev, int block);
+void snap_read(int dev, int block, char * data);
+int snap_saved(int dev);
+int get_blocksize(int dev);
 int bmap(struct m_inode * inode, int block);
+int map_blocks(struct m_inode * inode, int block, int count,
+	unsigned int * zones, int create);
+unsigned int get_zone(struct super_block * sb, char * data, int i);
+void set_zone(struct super_block * sb, char * data, int i, unsigned int zone);
 struct m_inode * get_inode(const char * pathname);
+struct m_inode * walk_path(const char * pathname, int len);
 //struct m_inode * get_dir(const char * pathname);
 void free_block(int dev, int block);
 void free_inode(struct m_inode * inode);
 struct m_inode * new_inode(int dev);
 int new_block(int dev);
+int new_block_near(int dev, int goal);
 void truncate(struct m_inode * inode);
+void truncate_blocks(struct m_inode * inode, int from);
 void iput(struct m_inode * inode);
 struct m_inode * dir_namei(const char * pathname,int * namelen, const char ** name);
 struct buffer_head * find_entry(struct m_inode ** dir,const char * name, int namelen, struct dir_entry ** res_dir);
 struct buffer_head * add_entry(struct m_inode * dir,
 	const char * name, int namelen, struct dir_entry ** res_dir);
 int create_block(struct m_inode * inode, int block);
+/*目录项缓存*/
+int dcache_lookup(struct m_inode * dir, const char * name, int namelen);
+void dcache_add(struct m_inode * dir, const char * name, int namelen, int inode);
+void dcache_invalidate(struct m_inode * dir, const char * name, int namelen);
+void dcache_purge_dir(struct m_inode * dir);
+void dcache_purge_dev(int dev);
+void get_dcache_stats(struct dcache_stats * out);
+/*目录哈希索引*/
+int dx_make_index(struct m_inode * dir);
+int dx_compact(struct m_inode * dir);
+struct buffer_head * dx_find_entry(struct m_inode * dir,
+	const char * name, int namelen, struct dir_entry ** res_dir);
+struct buffer_head * dx_add_entry(struct m_inode * dir,
+	const char * name, int namelen, struct dir_entry ** res_dir);
 // struct m_inode * get_empty_inode();
 int empty_dir(struct m_inode * inode);
+/*目录迭代器*/
+void dir_iter_init(struct dir_iter * it, struct m_inode * dir, int pos);
+struct buffer_head * dir_iter_block(struct dir_iter * it);
+struct dir_entry * dir_iter_next(struct dir_iter * it);
+int dir_iter_pos(struct dir_iter * it);
+void dir_iter_end(struct dir_iter * it);
+void dir_add_hole(struct m_inode * dir, struct buffer_head * bh);
+int dir_compact(struct m_inode * dir);
+void dir_maybe_compact(struct m_inode * dir);
+int dir_scan_block(const char * data, int n, const struct dir_entry * key);
+int dir_find_name(const char * data, int n, const char * name, int namelen);
+int dir_find_free(const char * data, int n, int slots);
+void dir_set_name(struct dir_entry * de, const char * name, int namelen);
+void dir_set_inode(struct dir_entry * de, int inode);
+int dir_entry_slots(const struct dir_entry * de);
+int dir_entry_name(const struct dir_entry * de, char * buf);
+int dir_live_map(const char * data, int n, unsigned long long * live);
+/*在卷内复制文件或目录树*/
+int copy_tree(struct m_inode * src, struct m_inode * dir, const char * name,
+	int threads, struct copy_stats * st);
+/*一致性检查*/
+int fsck(int dev, int repair, int threads, struct fsck_stats * st);
+void read_disk_inode(int dev, int nr, struct m_inode * inode);
 int get_name(struct m_inode * inode, char *buf,int size);
 struct m_inode *get_father(struct m_inode * inode);
+struct m_inode * igrab(struct m_inode * inode);
+void lock_inode(struct m_inode * inode);
+void unlock_inode(struct m_inode * inode);
+void lock_inode_shared(struct m_inode * inode);
+void unlock_inode_shared(struct m_inode * inode);
+int trylock_inode_shared(struct m_inode * inode);
+void inode_set_parent(struct m_inode * inode, unsigned int parent,
+	const char * name, int namelen);
+unsigned int inode_get_parent(struct m_inode * inode, char * buf, int size);
+int stat_inodes(int dev, struct dirent_plus * ents, int n);
+int mount_inode(struct m_inode * dir, struct super_block * s);
+int umount_inodes(int dev);
+int inodes_busy(int dev, struct m_inode * self);
 void init_inode_table();
 void realse_inode_table();
 void realse_all_blocks();
+int sync_blocks();
+void get_buffer_stats(struct buffer_stats * out);
 /*位图操作函数*/
-int find_first_zero(char* data);
+int find_first_zero(char* data, int bits);
+int find_next_zero(char* data, int bits, int start);
+void init_alloc_groups(struct super_block* sb);
+void reset_alloc_groups(struct super_block* sb);
+void free_alloc_groups(struct super_block* sb);
+int alloc_inode_bit(struct super_block* sb);
+int free_inode_bit(struct super_block* sb, int nr);
+int alloc_zone_bit(struct super_block* sb, int goal);
+int free_zone_bit(struct super_block* sb, int block);
 int get_bit(int k, char* data);
 int clear_bit(int k, char* data);
 int set_bit(int k, char* data);
@@ -201,3 +489,4 @@ int open_file(const char * pathname, int flag, int mode,
 	struct m_inode* &res_inode);
 int file_read(struct m_inode * inode, struct file * filp, char * buf, int count);
 int file_write(struct m_inode * inode, struct file * filp, char * buf, int count);
+void inline_init(struct m_inode * inode);
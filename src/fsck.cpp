@@ -0,0 +1,427 @@
+/*
+文件系统一致性检查(fsck)，应在没有其他会话使用该卷时运行：
+  1. 多线程分块读取磁盘上的全部inode
+  2. 多线程读取所有目录的目录项
+  3. 从ROOT_INO开始遍历目录树，求出可达的inode与每个inode被引用的次数
+  4. 多线程遍历可达inode的数据块与索引块，得到实际使用的逻辑块位图
+  5. 把实际的使用情况与i节点位图、逻辑块位图、i_nlinks比较
+位图按16字节一组比较(x86上用SSE2)，只逐位检查不同的组
+修复时删除无效的目录项，改正i_nlinks，释放不可达的inode，再按实际使用情况重写两个位图；
+重复使用或超出范围的逻辑块只报告，不修复
+*/
+#include <algorithm>
+#include <atomic>
+#include <cstdarg>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "fs.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define FSCK_X86
+#endif
+
+/*每类问题最多逐条输出的个数*/
+#define FSCK_REPORT 20
+/*每个线程每次处理的inode个数*/
+#define FSCK_CHUNK 256
+
+enum fsck_problem {
+  FSCK_BAD_ENTRY,   // 目录项指向无效的inode
+  FSCK_NLINKS,      // i_nlinks与实际引用数不同
+  FSCK_ORPHAN,      // 位图中已使用但不可达的inode
+  FSCK_IMAP,        // 可达但位图中未标记的inode
+  FSCK_BAD_ZONE,    // 超出数据区的逻辑块号
+  FSCK_DUP_ZONE,    // 被多处使用的逻辑块
+  FSCK_ZMAP_FREE,   // 正在使用但位图中空闲的逻辑块
+  FSCK_ZMAP_LEAK,   // 位图中已使用但没有被使用的逻辑块
+  FSCK_NR_PROBLEMS,
+};
+
+static const char* problem_names[FSCK_NR_PROBLEMS] = {
+    "无效的目录项",     "错误的链接数",       "不可达的inode",
+    "位图中未标记的inode", "超出范围的逻辑块", "重复使用的逻辑块",
+    "位图中未标记的逻辑块", "位图中多余的逻辑块",
+};
+
+/*一个inode的检查结果*/
+struct fsck_inode {
+  unsigned short mode;
+  unsigned char nlinks;
+  unsigned char used;      // i节点位图中的位
+  unsigned char reachable; // 能从根目录到达
+  unsigned int refs;       // 指向它的目录项数(包括 . 与 ..)
+};
+
+/*目录中的一个目录项*/
+struct fsck_dent {
+  unsigned int ino;
+  int block, index;  // 所在的逻辑块与块内的位置，删除时使用
+  unsigned char dots; // 1为 .，2为 ..
+};
+
+struct fsck_ctx {
+  struct super_block* sb;
+  int dev, threads;
+  std::vector<struct fsck_inode> inodes;
+  std::vector<struct m_inode> disk;        // 磁盘上的inode，下标为inode号
+  std::vector<std::vector<struct fsck_dent>> dents; // 每个目录的目录项
+  std::vector<unsigned int> reachable;     // 可达的inode号
+  std::vector<std::atomic<unsigned long long>> zones; // 实际使用的逻辑块位图
+  std::mutex report_lock;
+  int counts[FSCK_NR_PROBLEMS];
+  int fixed;
+  std::vector<struct fsck_dent> bad; // 待删除的目录项
+  std::vector<unsigned int> bad_dirs;
+};
+
+static void report(struct fsck_ctx* c, int kind, const char* fmt, ...) {
+  va_list ap;
+  std::lock_guard<std::mutex> g(c->report_lock);
+  if (c->counts[kind]++ >= FSCK_REPORT) return;
+  printf("%s: ", problem_names[kind]);
+  va_start(ap, fmt);
+  vprintf(fmt, ap);
+  va_end(ap);
+  printf("\n");
+}
+
+/*用threads个线程执行f(from, to)，每次领取FSCK_CHUNK个下标*/
+template <class F>
+static void parallel_for(struct fsck_ctx* c, int begin, int end, F f) {
+  std::atomic<int> next(begin);
+  auto worker = [&]() {
+    int from;
+    while ((from = next.fetch_add(FSCK_CHUNK)) < end)
+      f(from, std::min(from + FSCK_CHUNK, end));
+  };
+  std::vector<std::thread> workers;
+  for (int i = 1; i < c->threads; i++) workers.emplace_back(worker);
+  worker();
+  for (auto& w : workers) w.join();
+}
+
+static int inode_valid(struct fsck_ctx* c, unsigned int nr) {
+  struct fsck_inode* i;
+  if (!nr || nr > c->sb->s_ninodes) return 0;
+  i = &c->inodes[nr];
+  // 位图中的位被错误清除时，磁盘上的inode仍然完整
+  return i->used || (i->nlinks && (S_ISREG(i->mode) || S_ISDIR(i->mode)));
+}
+
+static int zone_valid(struct fsck_ctx* c, unsigned int zone) {
+  return zone >= c->sb->s_firstdatazone && zone < c->sb->s_nzones;
+}
+
+/*第1步：读取磁盘上的inode*/
+static void scan_inodes(struct fsck_ctx* c, int from, int to) {
+  struct super_block* sb = c->sb;
+  int bits = BLOCK_BITS(sb);
+
+  for (int nr = std::max(from, 1); nr < to; nr++) {
+    struct m_inode* d = &c->disk[nr];
+    read_disk_inode(c->dev, nr, d);
+    c->inodes[nr].mode = d->i_mode;
+    c->inodes[nr].nlinks = d->i_nlinks;
+    c->inodes[nr].used = get_bit(nr % bits, sb->s_imap[nr / bits]->b_data);
+  }
+}
+
+/*第2步：读取一个目录的全部目录项*/
+static void scan_dir(struct fsck_ctx* c, unsigned int nr) {
+  struct m_inode* dir = &c->disk[nr];
+  int epb = DIR_ENTRIES_PER_BLOCK(c->sb), entries, block, k;
+  struct buffer_head* bh;
+  struct dir_entry* de;
+  unsigned int zone;
+
+  entries = dir->i_size / sizeof(struct dir_entry);
+  for (block = 0; block * epb < entries; block++) {
+    if (map_blocks(dir, block, 1, &zone, 0) < 1 || !zone_valid(c, zone) ||
+        !(bh = bread(c->dev, zone)))
+      continue;
+    de = (struct dir_entry*)bh->b_data;
+    for (k = 0; k < epb && block * epb + k < entries; k++) {
+      if (!de[k].inode || DE_IS_CONT(de + k)) continue;
+      struct fsck_dent d = {de[k].inode, block, k, 0};
+      if (!strcmp(de[k].name, "."))
+        d.dots = 1;
+      else if (!strcmp(de[k].name, ".."))
+        d.dots = 2;
+      c->dents[nr].push_back(d);
+    }
+    brelse(bh);
+  }
+}
+
+/*第3步：从根目录开始遍历，统计引用数，找出无效的目录项*/
+static void walk_tree(struct fsck_ctx* c) {
+  std::vector<unsigned int> queue = {ROOT_INO};
+  char name[LONG_NAME_LEN + 1];
+  struct buffer_head* bh;
+  unsigned int zone;
+
+  c->inodes[ROOT_INO].reachable = 1;
+  for (size_t q = 0; q < queue.size(); q++) {
+    unsigned int dir = queue[q];
+    c->reachable.push_back(dir);
+    if (!S_ISDIR(c->inodes[dir].mode)) continue;
+    for (auto& d : c->dents[dir]) {
+      if (!inode_valid(c, d.ino) || (d.dots == 1 && d.ino != dir)) {
+        name[0] = 0;
+        if (map_blocks(&c->disk[dir], d.block, 1, &zone, 0) == 1 &&
+            (bh = bread(c->dev, zone))) {
+          dir_entry_name((struct dir_entry*)bh->b_data + d.index, name);
+          brelse(bh);
+        }
+        report(c, FSCK_BAD_ENTRY, "目录%u中的%s指向inode %u", dir, name,
+               d.ino);
+        c->bad.push_back(d);
+        c->bad_dirs.push_back(dir);
+        continue;
+      }
+      c->inodes[d.ino].refs++;
+      if (d.dots || c->inodes[d.ino].reachable) continue;
+      c->inodes[d.ino].reachable = 1;
+      queue.push_back(d.ino);
+    }
+  }
+}
+
+/*第4步：记录一个逻辑块被使用，depth>0时为索引块，继续遍历其中的逻辑块号*/
+static void claim_zone(struct fsck_ctx* c, unsigned int nr, unsigned int zone,
+                       int depth) {
+  unsigned int bit = zone - (c->sb->s_firstdatazone - 1);
+  unsigned long long mask = 1ULL << (bit % 64);
+  struct buffer_head* bh;
+  int i;
+
+  if (!zone_valid(c, zone)) {
+    report(c, FSCK_BAD_ZONE, "inode %u使用了逻辑块%u", nr, zone);
+    return;
+  }
+  if (c->zones[bit / 64].fetch_or(mask) & mask) {
+    report(c, FSCK_DUP_ZONE, "inode %u使用的逻辑块%u已被其他文件使用", nr,
+           zone);
+    return;
+  }
+  if (!depth || !(bh = bread(c->dev, zone))) return;
+  for (i = 0; i < c->sb->s_zones_per_block; i++)
+    if ((zone = get_zone(c->sb, bh->b_data, i)))
+      claim_zone(c, nr, zone, depth - 1);
+  brelse(bh);
+}
+
+static void scan_zones(struct fsck_ctx* c, unsigned int nr) {
+  struct m_inode* inode = &c->disk[nr];
+  int nzones = c->sb->s_version == 1 ? NR_ZONES_V1 : NR_ZONES_V2;
+
+  if (!(S_ISREG(inode->i_mode) || S_ISDIR(inode->i_mode)) ||
+      (inode->i_flags & I_INLINE))
+    return;
+  for (int i = 0; i < nzones; i++)
+    if (inode->i_zone[i])
+      claim_zone(c, nr, inode->i_zone[i], i < NR_DIRECT ? 0 : i - NR_DIRECT + 1);
+}
+
+/*在x86上一次比较16字节，跳过相同的部分，返回第一个可能不同的字节*/
+static int skip_equal(const char* a, const char* b, int from, int to) {
+#ifdef FSCK_X86
+  for (; from + 16 <= to; from += 16) {
+    __m128i x = _mm_loadu_si128((const __m128i*)(a + from));
+    __m128i y = _mm_loadu_si128((const __m128i*)(b + from));
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) != 0xffff) break;
+  }
+#endif
+  return from;
+}
+
+/*比较磁盘上的位图maps与实际的位图real的前bits位，对不同的位调用f(bit, 磁盘上的值)*/
+template <class F>
+static void bitmap_diff(struct buffer_head** maps, int bpb, const char* real,
+                        int bits, F f) {
+  int nbytes = (bits + 7) / 8, bpb_bytes = bpb / 8;
+  for (int base = 0; base < nbytes; base += bpb_bytes) {
+    const char* disk = maps[base / bpb_bytes]->b_data;
+    int n = std::min(bpb_bytes, nbytes - base);
+    for (int i = skip_equal(disk, real + base, 0, n); i < n;
+         i = skip_equal(disk, real + base, i + 1, n)) {
+      unsigned char d = disk[i] ^ real[base + i];
+      for (; d; d &= d - 1) {
+        int bit = (base + i) * 8 + __builtin_ctz(d);
+        if (bit < bits) f(bit, get_bit(bit % bpb, (char*)disk));
+      }
+    }
+  }
+}
+
+/*第5步：比较链接数与两个位图*/
+static void check_maps(struct fsck_ctx* c, std::vector<unsigned long long>& imap,
+                       std::vector<unsigned long long>& zmap) {
+  struct super_block* sb = c->sb;
+  int ibits = sb->s_ninodes + 1;
+  int zbits = sb->s_nzones - (sb->s_firstdatazone - 1);
+
+  for (unsigned int nr : c->reachable) {
+    struct fsck_inode* i = &c->inodes[nr];
+    imap[nr / 64] |= 1ULL << (nr % 64);
+    if (i->nlinks != i->refs)
+      report(c, FSCK_NLINKS, "inode %u的i_nlinks为%u，实际有%u个目录项", nr,
+             i->nlinks, i->refs);
+  }
+  imap[0] |= 1;
+  for (size_t k = 0; k < zmap.size(); k++) zmap[k] = c->zones[k];
+  zmap[0] |= 1;
+  bitmap_diff(sb->s_imap, BLOCK_BITS(sb), (const char*)imap.data(), ibits,
+              [&](int bit, int disk) {
+                if (disk)
+                  report(c, FSCK_ORPHAN, "inode %d", bit);
+                else
+                  report(c, FSCK_IMAP, "inode %d", bit);
+              });
+  bitmap_diff(sb->s_zmap, BLOCK_BITS(sb), (const char*)zmap.data(), zbits,
+              [&](int bit, int disk) {
+                unsigned int zone = bit + sb->s_firstdatazone - 1;
+                if (disk)
+                  report(c, FSCK_ZMAP_LEAK, "逻辑块%u", zone);
+                else
+                  report(c, FSCK_ZMAP_FREE, "逻辑块%u", zone);
+              });
+}
+
+/*把实际的使用情况写入位图，位图之后的位保持不变*/
+static void write_bitmap(struct buffer_head** maps, int bpb, const char* real,
+                         int bits) {
+  for (int bit = 0; bit < bits; bit += bpb) {
+    struct buffer_head* bh = maps[bit / bpb];
+    int n = std::min(bpb, bits - bit);
+    memcpy(bh->b_data, real + bit / 8, n / 8);
+    for (int k = n / 8 * 8; k < n; k++)
+      if (get_bit(bit + k, (char*)real))
+        set_bit(k, bh->b_data);
+      else
+        clear_bit(k, bh->b_data);
+    bh->b_dirt = 1;
+  }
+}
+
+/*修复：删除无效目录项，改正链接数，释放不可达的inode，重写位图*/
+static void fsck_repair(struct fsck_ctx* c,
+                        std::vector<unsigned long long>& imap,
+                        std::vector<unsigned long long>& zmap) {
+  struct super_block* sb = c->sb;
+  struct m_inode* inode;
+  struct buffer_head* bh;
+  unsigned int zone, nr;
+
+  for (size_t k = 0; k < c->bad.size(); k++) {
+    if (!(inode = iget(c->dev, c->bad_dirs[k]))) continue;
+    lock_inode(inode);
+    if (map_blocks(inode, c->bad[k].block, 1, &zone, 0) == 1 &&
+        (bh = bread(c->dev, zone))) {
+      dir_set_inode((struct dir_entry*)bh->b_data + c->bad[k].index, 0);
+      bh->b_dirt = 1;
+      brelse(bh);
+      c->fixed++;
+    }
+    dcache_purge_dir(inode);
+    unlock_inode(inode);
+    iput(inode);
+  }
+  for (unsigned int nr : c->reachable)
+    if (c->inodes[nr].nlinks != c->inodes[nr].refs &&
+        (inode = iget(c->dev, nr))) {
+      inode->i_nlinks = c->inodes[nr].refs;
+      inode->i_dirt = 1;
+      iput(inode);
+      c->fixed++;
+    }
+  for (nr = 1; nr <= sb->s_ninodes; nr++) {
+    if (!c->inodes[nr].used || c->inodes[nr].reachable ||
+        !(inode = iget(c->dev, nr)))
+      continue;
+    // 数据块不在实际的位图中，重写位图时一并释放，这里只清空inode
+    if (inode->i_count == 1) {
+      memset(inode->i_zone, 0, sizeof(inode->i_zone));
+      inode->i_mode = inode->i_size = inode->i_flags = 0;
+      inode->i_nlinks = 0;
+      c->fixed++;
+    } else {
+      // 仍被打开的文件暂时保留，它的数据块也不能释放
+      imap[nr / 64] |= 1ULL << (nr % 64);
+      scan_zones(c, nr);
+    }
+    iput(inode);
+  }
+  for (size_t k = 0; k < zmap.size(); k++) zmap[k] |= c->zones[k];
+  write_bitmap(sb->s_imap, BLOCK_BITS(sb), (const char*)imap.data(),
+               sb->s_ninodes + 1);
+  write_bitmap(sb->s_zmap, BLOCK_BITS(sb), (const char*)zmap.data(),
+               sb->s_nzones - (sb->s_firstdatazone - 1));
+  c->fixed += c->counts[FSCK_IMAP] + c->counts[FSCK_ZMAP_FREE] +
+              c->counts[FSCK_ZMAP_LEAK];
+  reset_alloc_groups(sb);
+  realse_inode_table();
+  sync_blocks();
+}
+
+/*
+ * @brief 检查卷的一致性
+ * @param dev 设备号
+ * @param repair 非0时修复发现的问题
+ * @param threads 使用的线程数
+ * @param st 返回检查的数量与问题数，可以为NULL
+ * @return 发现的问题数，失败返回错误码
+ */
+int fsck(int dev, int repair, int threads, struct fsck_stats* st) {
+  struct fsck_ctx c;
+  struct super_block* sb;
+  int n, problems = 0;
+
+  if (!(sb = get_super(dev)) || !sb->s_imap[0]) return -EINVAL;
+  // 内存中修改过的inode先写入缓冲区，之后直接读取缓冲区中的inode
+  realse_inode_table();
+  c.sb = sb;
+  c.dev = dev;
+  c.threads = threads < 1 ? 1 : threads;
+  c.fixed = 0;
+  memset(c.counts, 0, sizeof(c.counts));
+  n = sb->s_ninodes + 1;
+  c.inodes.assign(n, fsck_inode());
+  c.disk.resize(n);
+  c.dents.resize(n);
+  c.zones = std::vector<std::atomic<unsigned long long>>(
+      (sb->s_nzones - sb->s_firstdatazone + 1 + 63) / 64 + 1);
+
+  parallel_for(&c, 0, n, [&](int from, int to) { scan_inodes(&c, from, to); });
+  parallel_for(&c, 1, n, [&](int from, int to) {
+    for (int nr = from; nr < to; nr++)
+      if (inode_valid(&c, nr) && S_ISDIR(c.inodes[nr].mode)) scan_dir(&c, nr);
+  });
+  walk_tree(&c);
+  parallel_for(&c, 0, c.reachable.size(), [&](int from, int to) {
+    for (int k = from; k < to; k++) scan_zones(&c, c.reachable[k]);
+  });
+  std::vector<unsigned long long> imap(n / 64 + 1), zmap(c.zones.size());
+  check_maps(&c, imap, zmap);
+  if (repair) fsck_repair(&c, imap, zmap);
+
+  for (int k = 0; k < FSCK_NR_PROBLEMS; k++) {
+    problems += c.counts[k];
+    if (c.counts[k] > FSCK_REPORT)
+      printf("%s: 共%d处\n", problem_names[k], c.counts[k]);
+  }
+  if (st) {
+    st->inodes = c.reachable.size();
+    st->dirs = 0;
+    for (unsigned int nr : c.reachable)
+      if (S_ISDIR(c.inodes[nr].mode)) st->dirs++;
+    st->zones = 0;
+    for (auto& w : c.zones) st->zones += __builtin_popcountll(w);
+    st->problems = problems;
+    st->fixed = c.fixed;
+  }
+  return problems;
+}
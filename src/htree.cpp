@@ -0,0 +1,471 @@
+/*
+目录的哈希索引(仿ext3的htree)，仅v2格式使用
+目录的第0块仍然保存 . 和 .. 两项，之后的目录项位置存放索引：
+  第2项为索引头，之后每项为一个索引项 {hash, 逻辑块号}
+索引项与空闲目录项一样inode字段为0，因此按顺序遍历目录的代码会直接跳过它们，
+目录中的文件名仍然存放在普通的目录块(叶子块)中
+索引最多两层：根(第0块)直接指向叶子块，根满之后插入一层中间索引块
+同一个哈希值的目录项总在同一个叶子块中，因此一次查找只需读取根、中间块和一个叶子块
+*/
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+#include "fs.h"
+
+/*索引头，占用一个目录项的位置*/
+struct dx_head {
+  unsigned short inode;  // 恒为0，顺序遍历时被当作空闲项跳过
+  unsigned char levels;  // 根之下中间索引的层数，0或1
+  unsigned char unused;
+  unsigned short count;  // 索引项个数
+  unsigned short limit;  // 本块最多能存放的索引项个数
+  unsigned int magic;
+  unsigned int unused2;
+};
+/*索引项，hash为该项所指向的叶子块中最小的哈希值*/
+struct dx_entry {
+  unsigned short inode;  // 恒为0
+  unsigned short unused;
+  unsigned int hash;
+  unsigned int block;  // 目录内的逻辑块号
+  unsigned int unused2;
+};
+#define DX_MAGIC 0x78644458
+#define DX_MAX_LEVELS 2
+/*根块中 . 与 .. 之后是索引头*/
+#define DX_ROOT_HEAD 2
+
+/*查找路径上的一层索引*/
+struct dx_frame {
+  struct buffer_head *bh;
+  struct dx_head *head;
+  struct dx_entry *entries;
+  struct dx_entry *at;
+};
+
+/*FNV-1a 哈希，对完整的文件名(包括长文件名)计算*/
+static unsigned int dx_hash(const char *name, int namelen) {
+  unsigned int h = 2166136261u;
+  for (int i = 0; i < namelen; i++) {
+    h ^= (unsigned char)name[i];
+    h *= 16777619u;
+  }
+  return h;
+}
+
+/*初始化一个索引块(根或中间块)中的索引头*/
+static struct dx_entry *dx_init_node(struct super_block *sb, char *data,
+                                     int slot, int levels) {
+  struct dx_head *head = (struct dx_head *)((struct dir_entry *)data + slot);
+  memset(head, 0, (DIR_ENTRIES_PER_BLOCK(sb) - slot) * sizeof(struct dir_entry));
+  head->levels = levels;
+  head->limit = DIR_ENTRIES_PER_BLOCK(sb) - slot - 1;
+  head->magic = DX_MAGIC;
+  return (struct dx_entry *)(head + 1);
+}
+
+static void dx_release(struct dx_frame *frames, int depth) {
+  for (int i = 0; i < depth; i++) brelse(frames[i].bh);
+}
+
+/*在一个索引块中查找hash应该落入的索引项，即最后一个hash不大于目标的项*/
+static struct dx_entry *dx_search(struct dx_frame *frame, unsigned int hash) {
+  int lo = 1, hi = frame->head->count - 1;
+  while (lo <= hi) {
+    int mid = (lo + hi) / 2;
+    if (frame->entries[mid].hash <= hash)
+      lo = mid + 1;
+    else
+      hi = mid - 1;
+  }
+  return frame->entries + lo - 1;
+}
+
+/*
+从根开始查找hash所在的叶子块，frames中记录每一层索引块，调用者负责释放
+返回叶子块的逻辑块号，索引损坏时返回-1
+*/
+static int dx_probe(struct m_inode *dir, unsigned int hash,
+                    struct dx_frame *frames, int *depth) {
+  struct buffer_head *bh;
+  int slot = DX_ROOT_HEAD, levels, block;
+
+  *depth = 0;
+  if (!dir->i_zone[0] || !(bh = bread(dir->i_dev, dir->i_zone[0]))) return -1;
+  levels = ((struct dx_head *)((struct dir_entry *)bh->b_data + slot))->levels;
+  while (1) {
+    struct dx_frame *frame = frames + *depth;
+    frame->bh = bh;
+    frame->head = (struct dx_head *)((struct dir_entry *)bh->b_data + slot);
+    frame->entries = (struct dx_entry *)(frame->head + 1);
+    (*depth)++;
+    if (frame->head->magic != DX_MAGIC || levels >= DX_MAX_LEVELS ||
+        !frame->head->count || frame->head->count > frame->head->limit) {
+      printf("warning - bad directory index on dev %04x\n", dir->i_dev);
+      dx_release(frames, *depth);
+      *depth = 0;
+      return -1;
+    }
+    frame->at = dx_search(frame, hash);
+    block = frame->at->block;
+    if (*depth > levels) return block;
+    if (!(block = bmap(dir, block)) || !(bh = bread(dir->i_dev, block))) {
+      dx_release(frames, *depth);
+      *depth = 0;
+      return -1;
+    }
+    slot = 0;
+  }
+}
+
+/*在索引块中at之后插入一个索引项*/
+static void dx_insert(struct dx_frame *frame, unsigned int hash, int block) {
+  struct dx_entry *next = frame->at + 1;
+  struct dx_entry *end = frame->entries + frame->head->count;
+  memmove(next + 1, next, (char *)end - (char *)next);
+  memset(next, 0, sizeof(*next));
+  next->hash = hash;
+  next->block = block;
+  frame->head->count++;
+  frame->bh->b_dirt = 1;
+}
+
+/*在目录末尾增加一个数据块，返回其逻辑块号，*res为对应的缓冲块*/
+static int dx_append_block(struct m_inode *dir, struct buffer_head **res) {
+  struct super_block *sb = get_super(dir->i_dev);
+  int nr = dir->i_size / sb->s_blocksize;
+  int block;
+
+  if (!(block = create_block(dir, nr)) || !(*res = bread(dir->i_dev, block)))
+    return -1;
+  memset((*res)->b_data, 0, sb->s_blocksize);
+  (*res)->b_dirt = 1;
+  dir->i_size = (nr + 1) * sb->s_blocksize;
+  dir->i_dirt = 1;
+  return nr;
+}
+
+/*按哈希值排序的目录项，用于叶子块的分裂，长文件名的首项与续项作为一个整体*/
+struct dx_map {
+  unsigned int hash;
+  unsigned short pos;    // 在原叶子块中的位置
+  unsigned short slots;  // 所占的目录项个数
+};
+
+/*
+叶子块已满，将其中哈希值较大的一半移到新的叶子块中，
+并在父索引块中增加指向新叶子块的索引项，调用前需保证父索引块未满
+*/
+static int dx_split_leaf(struct m_inode *dir, struct dx_frame *frame,
+                         struct buffer_head *bh) {
+  struct super_block *sb = get_super(dir->i_dev);
+  int epb = DIR_ENTRIES_PER_BLOCK(sb);
+  struct dx_map *map = new dx_map[epb];
+  struct dir_entry *old = new dir_entry[epb];
+  struct dir_entry *de;
+  struct buffer_head *nbh;
+  char name[LONG_NAME_LEN + 1];
+  int n = 0, i, k, split, nr, used = 0, total = 0;
+
+  memcpy(old, bh->b_data, epb * sizeof(struct dir_entry));
+  for (i = 0; i < epb; i += k) {
+    k = 1;
+    // 没有首项的续项已经失效，直接丢弃
+    if (!old[i].inode || DE_IS_CONT(old + i)) continue;
+    k = dir_entry_slots(old + i);
+    if (i + k > epb) break;
+    map[n].hash = dx_hash(name, dir_entry_name(old + i, name));
+    map[n].pos = i;
+    map[n++].slots = k;
+    total += k;
+  }
+  std::sort(map, map + n, [](const dx_map &a, const dx_map &b) {
+    return a.hash < b.hash;
+  });
+  // 按所占的项数分为两半，相同哈希值的目录项不能被分到两个叶子块中
+  for (split = 0; split < n && used + map[split].slots <= total / 2; split++)
+    used += map[split].slots;
+  if (!split) split = 1;
+  for (i = split; i < n && map[i].hash == map[i - 1].hash;) i++;
+  if (i == n)
+    for (i = split; i > 0 && map[i].hash == map[i - 1].hash;) i--;
+  split = i;
+  if (split == 0 || split == n || (nr = dx_append_block(dir, &nbh)) < 0) {
+    delete[] map;
+    delete[] old;
+    return -ENOSPC;
+  }
+  memset(bh->b_data, 0, sb->s_blocksize);
+  de = (struct dir_entry *)bh->b_data;
+  for (i = 0; i < split; de += map[i++].slots)
+    memcpy(de, old + map[i].pos, map[i].slots * sizeof(struct dir_entry));
+  de = (struct dir_entry *)nbh->b_data;
+  for (i = split; i < n; de += map[i++].slots)
+    memcpy(de, old + map[i].pos, map[i].slots * sizeof(struct dir_entry));
+  bh->b_dirt = nbh->b_dirt = 1;
+  brelse(nbh);
+  dx_insert(frame, map[split].hash, nr);
+  delete[] map;
+  delete[] old;
+  return 0;
+}
+
+/*
+索引块已满：根满时增加一层中间索引，中间块满时将其分裂为两块
+调用后索引的结构发生变化，需要重新查找
+*/
+static int dx_split_node(struct m_inode *dir, struct dx_frame *frames,
+                         int depth) {
+  struct super_block *sb = get_super(dir->i_dev);
+  struct dx_frame *root = frames, *node = frames + depth - 1;
+  struct buffer_head *nbh;
+  struct dx_entry *entries;
+  int nr, count, half;
+
+  if (node == root) {
+    // 根已满，把根中的索引项全部移到新的中间块，根只留一项指向它
+    if (root->head->levels >= DX_MAX_LEVELS - 1) return -ENOSPC;
+    if ((nr = dx_append_block(dir, &nbh)) < 0) return -ENOSPC;
+    count = root->head->count;
+    entries = dx_init_node(sb, nbh->b_data, 0, 0);
+    memcpy(entries, root->entries, count * sizeof(struct dx_entry));
+    ((struct dx_head *)nbh->b_data)->count = count;
+    nbh->b_dirt = 1;
+    brelse(nbh);
+    entries = dx_init_node(sb, root->bh->b_data, DX_ROOT_HEAD, 1);
+    entries[0].block = nr;
+    root->head->count = 1;
+    root->bh->b_dirt = 1;
+    return 0;
+  }
+  // 中间块已满，后一半移到新的中间块
+  if (root->head->count >= root->head->limit) return -ENOSPC;
+  if ((nr = dx_append_block(dir, &nbh)) < 0) return -ENOSPC;
+  count = node->head->count;
+  half = count / 2;
+  entries = dx_init_node(sb, nbh->b_data, 0, 0);
+  memcpy(entries, node->entries + half,
+         (count - half) * sizeof(struct dx_entry));
+  ((struct dx_head *)nbh->b_data)->count = count - half;
+  memset(node->entries + half, 0, (count - half) * sizeof(struct dx_entry));
+  node->head->count = half;
+  node->bh->b_dirt = nbh->b_dirt = 1;
+  brelse(nbh);
+  dx_insert(root, entries[0].hash, nr);
+  return 0;
+}
+
+/*
+将只有一个数据块且已满的线性目录转换为索引目录：
+第0块中除 . 和 .. 以外的目录项移到新的叶子块，第0块改写为索引根
+*/
+int dx_make_index(struct m_inode *dir) {
+  struct super_block *sb = get_super(dir->i_dev);
+  struct buffer_head *bh, *leaf;
+  struct dir_entry *de;
+  struct dx_entry *entries;
+  int nr;
+
+  if (sb->s_version != 2 || (dir->i_flags & I_INDEX)) return -EINVAL;
+  if (dir->i_size > sb->s_blocksize) return -EINVAL;
+  if (!dir->i_zone[0] || !(bh = bread(dir->i_dev, dir->i_zone[0]))) return -EIO;
+  // 先占满第0块，新的叶子块作为第1块
+  dir->i_size = sb->s_blocksize;
+  if ((nr = dx_append_block(dir, &leaf)) < 0) {
+    brelse(bh);
+    return -ENOSPC;
+  }
+  de = (struct dir_entry *)bh->b_data;
+  memcpy(leaf->b_data, de + 2,
+         (DIR_ENTRIES_PER_BLOCK(sb) - 2) * sizeof(struct dir_entry));
+  leaf->b_dirt = 1;
+  brelse(leaf);
+  entries = dx_init_node(sb, bh->b_data, DX_ROOT_HEAD, 0);
+  entries[0].block = nr;
+  ((struct dx_head *)(de + DX_ROOT_HEAD))->count = 1;
+  bh->b_dirt = 1;
+  brelse(bh);
+  dir->i_flags |= I_INDEX;
+  dir->i_dirt = 1;
+  return 0;
+}
+
+/*在索引目录中查找文件名，返回包含该目录项的叶子块*/
+struct buffer_head *dx_find_entry(struct m_inode *dir, const char *name,
+                                  int namelen, struct dir_entry **res_dir) {
+  struct super_block *sb = get_super(dir->i_dev);
+  struct dx_frame frames[DX_MAX_LEVELS];
+  struct buffer_head *bh;
+  int depth, block, i;
+
+  *res_dir = NULL;
+  // . 和 .. 仍然在第0块的开头
+  if (name[0] == '.' && (namelen == 1 || (namelen == 2 && name[1] == '.'))) {
+    if (!(bh = bread(dir->i_dev, dir->i_zone[0]))) return NULL;
+    *res_dir = (struct dir_entry *)bh->b_data + namelen - 1;
+    return bh;
+  }
+  if (namelen > LONG_NAME_LEN) return NULL;
+  if ((block = dx_probe(dir, dx_hash(name, namelen), frames, &depth)) < 0)
+    return NULL;
+  dx_release(frames, depth);
+  if (!(block = bmap(dir, block)) || !(bh = bread(dir->i_dev, block)))
+    return NULL;
+  i = dir_find_name(bh->b_data, DIR_ENTRIES_PER_BLOCK(sb), name, namelen);
+  if (i >= 0) {
+    *res_dir = (struct dir_entry *)bh->b_data + i;
+    return bh;
+  }
+  brelse(bh);
+  return NULL;
+}
+
+/*在索引目录中增加一个目录项，与add_entry一样只设置名字*/
+struct buffer_head *dx_add_entry(struct m_inode *dir, const char *name,
+                                 int namelen, struct dir_entry **res_dir) {
+  struct super_block *sb = get_super(dir->i_dev);
+  struct dx_frame frames[DX_MAX_LEVELS];
+  struct buffer_head *bh;
+  struct dir_entry *de;
+  unsigned int hash = dx_hash(name, namelen);
+  int depth, block, i, slots = dir_name_slots(namelen);
+
+  *res_dir = NULL;
+  // 每次分裂之后索引结构改变，重新从根查找，最多分裂叶子、中间块和根各一次
+  for (int retry = 0; retry < 4; retry++) {
+    if ((block = dx_probe(dir, hash, frames, &depth)) < 0) return NULL;
+    if (!(block = bmap(dir, block)) || !(bh = bread(dir->i_dev, block))) {
+      dx_release(frames, depth);
+      return NULL;
+    }
+    i = dir_find_free(bh->b_data, DIR_ENTRIES_PER_BLOCK(sb), slots);
+    if (i >= 0) {
+      dx_release(frames, depth);
+      de = (struct dir_entry *)bh->b_data + i;
+      dir_set_name(de, name, namelen);
+      dir->i_mtime = dir->i_ctime = CurrentTime();
+      dir->i_dirt = 1;
+      bh->b_dirt = 1;
+      *res_dir = de;
+      return bh;
+    }
+    // 叶子块中没有足够的连续空闲项，父索引块也满时先分裂索引块
+    struct dx_frame *parent = frames + depth - 1;
+    if (parent->head->count >= parent->head->limit)
+      i = dx_split_node(dir, frames, depth);
+    else
+      i = dx_split_leaf(dir, parent, bh);
+    brelse(bh);
+    dx_release(frames, depth);
+    if (i < 0) return NULL;
+  }
+  return NULL;
+}
+
+/*
+压缩索引目录：读出各叶子块中的有效目录项，按哈希值依次紧密地放入前面的叶子块，
+重建根(叶子块超过根能容纳的个数时加一层中间索引块)，并释放末尾不再需要的数据块
+同一个哈希值的目录项与长文件名的各项仍然放在同一个叶子块中
+调用者需持有目录的写锁，返回去掉的目录项数，块数不能减少时不改动目录
+*/
+int dx_compact(struct m_inode *dir) {
+  struct super_block *sb = get_super(dir->i_dev);
+  int epb = DIR_ENTRIES_PER_BLOCK(sb), bs = sb->s_blocksize;
+  int blocks = dir->i_size / bs, root_limit = epb - DX_ROOT_HEAD - 1;
+  int node_limit = epb - 1;
+  struct item {
+    unsigned int hash;
+    int pos, slots;
+  };
+  std::vector<struct item> items;
+  std::vector<struct dir_entry> ents;
+  std::vector<int> starts;
+  struct buffer_head *bh;
+  struct dir_entry *de;
+  struct dx_entry *entries;
+  char name[LONG_NAME_LEN + 1];
+  int b, i, j, k, n, used, need, leaves, nodes, nblocks, block;
+
+  // 中间索引块中各项的inode都为0，不会被当作目录项
+  for (b = 1; b < blocks; b++) {
+    if (!(block = bmap(dir, b)) || !(bh = bread(dir->i_dev, block)))
+      return -EIO;
+    de = (struct dir_entry *)bh->b_data;
+    for (i = 0; i < epb; i += k) {
+      k = 1;
+      if (!de[i].inode || DE_IS_CONT(de + i)) continue;
+      k = dir_entry_slots(de + i);
+      if (i + k > epb) break;
+      items.push_back({dx_hash(name, dir_entry_name(de + i, name)),
+                       (int)ents.size(), k});
+      ents.insert(ents.end(), de + i, de + i + k);
+    }
+    brelse(bh);
+  }
+  std::stable_sort(
+      items.begin(), items.end(),
+      [](const item &a, const item &b) { return a.hash < b.hash; });
+  // 分配叶子块，相同哈希值的目录项不能被分到两个叶子块中
+  n = items.size();
+  for (i = 0, used = epb; i < n; i = j, used += need) {
+    for (j = i, need = 0; j < n && items[j].hash == items[i].hash; j++)
+      need += items[j].slots;
+    if (used + need > epb) {
+      starts.push_back(i);
+      used = 0;
+    }
+  }
+  if (starts.empty()) starts.push_back(0);
+  leaves = starts.size();
+  starts.push_back(n);
+  nodes = leaves <= root_limit ? 0 : (leaves + node_limit - 1) / node_limit;
+  nblocks = 1 + leaves + nodes;
+  if (nblocks >= blocks || nodes > root_limit) {
+    dir->i_ndead = 0;
+    return 0;
+  }
+  // 叶子块为第1块到第leaves块，整块覆盖，不必从磁盘读入
+  for (b = 0; b < leaves; b++) {
+    if (!(block = bmap(dir, 1 + b))) return -EIO;
+    bh = bget(dir->i_dev, block);
+    memset(bh->b_data, 0, bs);
+    de = (struct dir_entry *)bh->b_data;
+    for (i = starts[b]; i < starts[b + 1]; de += items[i++].slots)
+      memcpy(de, &ents[items[i].pos], items[i].slots * sizeof(*de));
+    bh->b_dirt = 1;
+    brelse(bh);
+  }
+  // 中间索引块紧接在叶子块之后，每块指向node_limit个叶子块
+  for (b = 0; b < nodes; b++) {
+    if (!(block = bmap(dir, 1 + leaves + b))) return -EIO;
+    bh = bget(dir->i_dev, block);
+    memset(bh->b_data, 0, bs);
+    entries = dx_init_node(sb, bh->b_data, 0, 0);
+    for (k = 0; k < node_limit && b * node_limit + k < leaves; k++) {
+      entries[k].hash = k ? items[starts[b * node_limit + k]].hash : 0;
+      entries[k].block = 1 + b * node_limit + k;
+    }
+    ((struct dx_head *)bh->b_data)->count = k;
+    bh->b_dirt = 1;
+    brelse(bh);
+  }
+  if (!(bh = bread(dir->i_dev, dir->i_zone[0]))) return -EIO;
+  entries = dx_init_node(sb, bh->b_data, DX_ROOT_HEAD, nodes ? 1 : 0);
+  k = nodes ? nodes : leaves;
+  for (i = 0; i < k; i++) {
+    j = nodes ? i * node_limit : i;
+    entries[i].hash = i ? items[starts[j]].hash : 0;
+    entries[i].block = nodes ? 1 + leaves + i : 1 + i;
+  }
+  de = (struct dir_entry *)bh->b_data;
+  ((struct dx_head *)(de + DX_ROOT_HEAD))->count = k;
+  bh->b_dirt = 1;
+  brelse(bh);
+  dir->i_size = nblocks * bs;
+  truncate_blocks(dir, nblocks);
+  dir->i_ndead = 0;
+  dir->i_mtime = dir->i_ctime = CurrentTime();
+  dir->i_dirt = 1;
+  return (blocks - nblocks) * epb;
+}
@@ -1,13 +1,20 @@
+#include <algorithm>
+#include <condition_variable>
 #include <iostream>
+#include <vector>
 
 #include "fs.h"
+#include "lock.h"
 /*对inode操作提供以下接口，
   在磁盘上创建一个新的inode
   1. 获取已经在磁盘上存在的inode iget()
   2. 在磁盘上创建一个新的inode  new_inode()
   3. 在磁盘上删除并清空一个inode  free_inode()
   4. 对于多进程而言，需要定义iput 让进程放弃对inode的使用权
-！！！注意 目前由于没有多进程，故对于i_count等信号量使用并不规范
+inode_table与i_count等由itable_lock保护，inode中的数据由每个inode的读写锁保护，
+见lock_inode，加锁顺序见lock.h
+读入、写回与释放inode要读写磁盘，期间不持有itable_lock，而是置i_lock，
+其他线程找到i_lock不为0的inode时在itable_wait上等待，完成后重新查找
 */
 
 /*
@@ -18,6 +25,101 @@
  */
 static struct m_inode *inode_tabel[NR_INODE];
 static int head = 0;
+static level_mutex itable_lock(LOCK_ITABLE);
+static std::condition_variable_any itable_wait;
+/*每个inode_table位置对应的读写锁，inode被引用期间不会被换出，锁也就不会被别的inode使用*/
+static level_rwlock inode_locks[NR_INODE];
+
+/*按设备号与inode号查找inode_table的哈希表，链中存放下标，-1表示链尾*/
+#define INODE_HASH (NR_INODE * 2)
+static int inode_hash[INODE_HASH];
+static int hash_next[NR_INODE];
+
+static inline int *hash_head(int dev, unsigned int nr) {
+  return inode_hash + (nr * NR_SUPER + dev) % INODE_HASH;
+}
+static void hash_inode(struct m_inode *inode) {
+  int *head = hash_head(inode->i_dev, inode->i_num);
+  hash_next[inode->i_slot] = *head;
+  *head = inode->i_slot;
+}
+static void unhash_inode(struct m_inode *inode) {
+  int *p = hash_head(inode->i_dev, inode->i_num);
+  if (!inode->i_num) return;
+  while (*p != inode->i_slot) p = hash_next + *p;
+  *p = hash_next[inode->i_slot];
+}
+/*查找已经在inode_table中的inode，调用者需持有itable_lock*/
+static struct m_inode *find_inode(int dev, unsigned int nr) {
+  for (int i = *hash_head(dev, nr); i >= 0; i = hash_next[i])
+    if (inode_tabel[i]->i_num == nr && inode_tabel[i]->i_dev == dev)
+      return inode_tabel[i];
+  return NULL;
+}
+
+/*清空内存中的inode并从哈希表中去掉，保留其在inode_table中的位置*/
+static void clear_inode(struct m_inode *inode) {
+  unsigned short slot = inode->i_slot;
+  unhash_inode(inode);
+  memset(inode, 0, sizeof(*inode));
+  inode->i_slot = slot;
+}
+
+/*磁盘inode与内存inode之间的转换，根据超级块的版本选择v1或v2格式*/
+static void inode_from_disk(struct super_block *sb, struct m_inode *inode,
+                            char *data, int nr) {
+  int i;
+  if (sb->s_version == 1) {
+    struct d_inode *d = (struct d_inode *)data + nr;
+    inode->i_mode = d->i_mode;
+    inode->i_uid = d->i_uid;
+    inode->i_size = d->i_size;
+    inode->i_mtime = d->i_time;
+    inode->i_gid = d->i_gid;
+    inode->i_nlinks = d->i_nlinks;
+    inode->i_flags = 0;
+    for (i = 0; i < NR_ZONES_V1; i++) inode->i_zone[i] = d->i_zone[i];
+    inode->i_zone[NR_ZONES_V1] = 0;
+  } else {
+    struct d_inode2 *d = (struct d_inode2 *)data + nr;
+    inode->i_mode = d->i_mode;
+    inode->i_uid = d->i_uid;
+    inode->i_size = d->i_size;
+    inode->i_mtime = d->i_time;
+    inode->i_atime = d->i_atime;
+    inode->i_ctime = d->i_ctime;
+    inode->i_gid = d->i_gid;
+    inode->i_nlinks = d->i_nlinks;
+    inode->i_flags = d->i_flags;
+    for (i = 0; i < NR_ZONES_V2; i++) inode->i_zone[i] = d->i_zone[i];
+  }
+}
+static void inode_to_disk(struct super_block *sb, struct m_inode *inode,
+                          char *data, int nr) {
+  int i;
+  if (sb->s_version == 1) {
+    struct d_inode *d = (struct d_inode *)data + nr;
+    d->i_mode = inode->i_mode;
+    d->i_uid = inode->i_uid;
+    d->i_size = inode->i_size;
+    d->i_time = inode->i_mtime;
+    d->i_gid = inode->i_gid;
+    d->i_nlinks = inode->i_nlinks;
+    for (i = 0; i < NR_ZONES_V1; i++) d->i_zone[i] = inode->i_zone[i];
+  } else {
+    struct d_inode2 *d = (struct d_inode2 *)data + nr;
+    d->i_mode = inode->i_mode;
+    d->i_uid = inode->i_uid;
+    d->i_size = inode->i_size;
+    d->i_time = inode->i_mtime;
+    d->i_atime = inode->i_atime;
+    d->i_ctime = inode->i_ctime;
+    d->i_gid = inode->i_gid;
+    d->i_nlinks = inode->i_nlinks;
+    d->i_flags = inode->i_flags;
+    for (i = 0; i < NR_ZONES_V2; i++) d->i_zone[i] = inode->i_zone[i];
+  }
+}
 /*写回inode*/
 static void write_inode(struct m_inode *inode) {
   struct super_block *sb;
@@ -30,35 +132,40 @@ static void write_inode(struct m_inode *inode) {
   if (!(sb = get_super(inode->i_dev)))
     printf("trying to write inode without device");
   block = 2 + sb->s_imap_blocks + sb->s_zmap_blocks +
-          (inode->i_num - 1) / INODES_PER_BLOCK;
-  if (!(bh = bread(block))) printf("unable to read i-node block");
-  ((struct d_inode *)bh->b_data)[(inode->i_num - 1) % INODES_PER_BLOCK] =
-      *(struct d_inode *)inode;
+          (inode->i_num - 1) / sb->s_inodes_per_block;
+  if (!(bh = bread(inode->i_dev, block))) printf("unable to read i-node block");
+  inode_to_disk(sb, inode, bh->b_data,
+                (inode->i_num - 1) % sb->s_inodes_per_block);
   bh->b_dirt = 1;
   inode->i_dirt = 0;
   brelse(bh);
 }
 /*申请获取inode_table 的空间，任何读取到内存中的inode
- * 都需要先向inode_tabel申请空间*/
-static struct m_inode *get_empty_inode() {
+ * 都需要先向inode_tabel申请空间，调用者需持有itable_lock，
+ * 写回脏inode时会暂时放开它，返回后调用者之前查找的结果可能已经过时*/
+static struct m_inode *get_empty_inode(std::unique_lock<level_mutex> &g) {
   struct m_inode *inode = NULL;
   for (int i = 0; i < NR_INODE; ++i) {
     inode = inode_tabel[head];
     head = (head + 1) % NR_INODE;
-    if (inode->i_count == 0) {
-      if (inode->i_dirt) {
-        write_inode(inode);
-      }
-      break;
+    if (inode->i_count == 0 && !inode->i_lock && inode->i_dirt) {
+      // 写回时不持有itable_lock，其间该inode可能又被iget引用
+      inode->i_lock = 1;
+      g.unlock();
+      write_inode(inode);
+      g.lock();
+      inode->i_lock = 0;
+      itable_wait.notify_all();
     }
+    if (inode->i_count == 0 && !inode->i_lock && !inode->i_dirt) break;
+    inode = NULL;
   }
 
   if (inode == NULL) {
     printf("inode_table 空间不足");
-    //特殊状况暂且不做处理，应该不会遇到，毕竟是单线程
     return NULL;
   }
-  memset(inode, 0, sizeof(*inode));
+  clear_inode(inode);
   inode->i_count = 1;
   return inode;
 }
@@ -67,18 +174,27 @@ static struct m_inode *get_empty_inode() {
 void init_inode_table() {
   for (int i = 0; i < NR_INODE; ++i) {
     inode_tabel[i] = new m_inode();
+    inode_tabel[i]->i_slot = i;
   }
+  for (int i = 0; i < INODE_HASH; ++i) inode_hash[i] = -1;
 }
 /*将inode_table所有信息写回磁盘*/
 void realse_inode_table() {
   m_inode *inode;
+  std::unique_lock<level_mutex> g(itable_lock);
   for (int i = 0; i < NR_INODE; ++i) {
     inode = inode_tabel[i];
-    if (inode->i_dirt) {
-      int block = 2 + 11 + (inode->i_num - 1) / INODES_PER_BLOCK;
+    // i_lock不为0的inode正在由iput写回或释放
+    if (inode->i_dirt && !inode->i_lock) {
       // if (inode->i_count != 0)
       // printf("%d WARING %d i_count!=0 \n",inode->i_num,block);
+      // 与iput一样置i_lock后放开itable_lock写回
+      inode->i_lock = 1;
+      g.unlock();
       write_inode(inode);
+      g.lock();
+      inode->i_lock = 0;
+      itable_wait.notify_all();
     }
   }
 }
@@ -94,38 +210,257 @@ static void read_inode(struct m_inode *inode) {
   block =
       2 + sb->s_imap_blocks + sb->s_zmap_blocks +
       (inode->i_num - 1) /
-          INODES_PER_BLOCK;  // 2 是一个引导块一个超级块, -1是因为从1开始
-  if (!(bh = bread(block))) printf("unable to read i-node block");
+          sb->s_inodes_per_block;  // 2 是一个引导块一个超级块, -1是因为从1开始
+  if (!(bh = bread(inode->i_dev, block))) printf("unable to read i-node block");
 
   // 该磁盘块上的inode都读，但暂时只用这一个
-  *(struct d_inode *)inode =
-      ((struct d_inode *)bh->b_data)[(inode->i_num - 1) % INODES_PER_BLOCK];
+  inode_from_disk(sb, inode, bh->b_data,
+                  (inode->i_num - 1) % sb->s_inodes_per_block);
   brelse(bh);
 }
 
-/*给出i节点号，返回inode节点*/
+/*不经过inode_table直接读取磁盘上的inode，供fsck检查全部inode使用*/
+void read_disk_inode(int dev, int nr, struct m_inode *inode) {
+  memset(inode, 0, sizeof(*inode));
+  inode->i_dev = dev;
+  inode->i_num = nr;
+  read_inode(inode);
+}
+
+/*挂载点上所挂载的卷的根目录，调用者需持有itable_lock*/
+static struct m_inode *mounted_root(struct m_inode *inode) {
+  struct super_block *sb;
+  for (int dev = 0; dev < NR_SUPER; dev++)
+    if ((sb = get_super(dev)) && sb->s_imount == inode && sb->s_isup != inode)
+      return sb->s_isup;
+  return inode;
+}
+
+/*给出i节点号，返回inode节点，挂载点返回所挂载的卷的根目录*/
 struct m_inode *iget(int dev, int nr) {
   struct m_inode *inode;
-  /*首先查看inode是否已经在内存中*/
-  for (int i = 0; i < NR_INODE; ++i) {
-    inode = inode_tabel[i];
-    if (inode->i_num == nr) {
+  std::unique_lock<level_mutex> g(itable_lock);
+  /*首先查看inode是否已经在内存中，挂载点一直被超级块引用，总在内存中*/
+  for (;;) {
+    if ((inode = find_inode(dev, nr))) {
+      // 正在读入、写回或释放，完成后重新查找
+      if (inode->i_lock) {
+        itable_wait.wait(g);
+        continue;
+      }
+      if (inode->i_mount) inode = mounted_root(inode);
       inode->i_count++;
       return inode;
     }
+    if (!(inode = get_empty_inode(g))) return NULL;
+    // 申请时可能放开过itable_lock，其他线程已经读入该inode时重新查找
+    if (!find_inode(dev, nr)) break;
+    inode->i_count = 0;
   }
-  inode = get_empty_inode();
   inode->i_dev = dev;
   inode->i_num = nr;
-  //从磁盘中读取
+  inode->i_lock = 1;
+  hash_inode(inode);
+  //从磁盘中读取时不持有itable_lock，其他线程找到该inode时等待读完
+  g.unlock();
   read_inode(inode);
+  g.lock();
   inode->i_dirt = 0;
-  inode->i_count = 1;
   inode->i_update = 1;
+  inode->i_lock = 0;
+  itable_wait.notify_all();
   return inode;
 }
 
-//删除磁盘上的inode 节点
+/*增加一个已经持有的inode的引用*/
+struct m_inode *igrab(struct m_inode *inode) {
+  std::lock_guard<level_mutex> g(itable_lock);
+  inode->i_count++;
+  return inode;
+}
+
+/*
+inode的读写锁：查找目录、读文件时加读锁，修改目录、写文件时加写锁
+调用者必须持有该inode的引用，同时锁多个inode时先父目录后子目录
+*/
+void lock_inode(struct m_inode *inode) { inode_locks[inode->i_slot].lock(); }
+/*不等待的读锁，已被加写锁时返回0*/
+int trylock_inode_shared(struct m_inode *inode) {
+  return inode_locks[inode->i_slot].try_lock_shared();
+}
+void unlock_inode(struct m_inode *inode) {
+  inode_locks[inode->i_slot].unlock();
+}
+void lock_inode_shared(struct m_inode *inode) {
+  inode_locks[inode->i_slot].lock_shared();
+}
+void unlock_inode_shared(struct m_inode *inode) {
+  inode_locks[inode->i_slot].unlock_shared();
+}
+
+/*记下通过路径查找到inode时的父目录与文件名*/
+void inode_set_parent(struct m_inode *inode, unsigned int parent,
+                      const char *name, int namelen) {
+  std::lock_guard<level_mutex> g(itable_lock);
+  memcpy(inode->i_name, name, namelen);
+  inode->i_name[namelen] = 0;
+  inode->i_parent = parent;
+}
+
+/*返回记下的父目录inode号，0表示未知，buf不为NULL时同时取出文件名*/
+unsigned int inode_get_parent(struct m_inode *inode, char *buf, int size) {
+  std::lock_guard<level_mutex> g(itable_lock);
+  if (inode->i_parent && buf) {
+    strncpy(buf, inode->i_name, size);
+    buf[size - 1] = 0;
+  }
+  return inode->i_parent;
+}
+
+/*
+批量获取n个目录项所指inode的属性，填入ents的d_mode、d_size、d_mtime
+按inode号排序后依次读取，每个inode块只读一次，也不占用inode_table，
+已在inode_table中的inode以内存中的为准(修改可能还未写回)
+返回读取的inode块数
+*/
+int stat_inodes(int dev, struct dirent_plus *ents, int n) {
+  struct super_block *sb;
+  struct buffer_head *bh = NULL;
+  struct m_inode tmp, *inode;
+  std::vector<int> order(n);
+  int i, block, cur = -1, reads = 0, m = 0;
+
+  if (!(sb = get_super(dev))) return -1;
+  for (i = 0; i < n; i++) order[i] = i;
+  std::sort(order.begin(), order.end(),
+            [ents](int a, int b) { return ents[a].d_ino < ents[b].d_ino; });
+
+  /*先在itable_lock下取出已在inode_table中的inode，
+    其余的留在order前m项中，放开锁后再读磁盘*/
+  {
+    std::lock_guard<level_mutex> g(itable_lock);
+    for (i = 0; i < n; i++) {
+      struct dirent_plus *d = ents + order[i];
+      // 正在读入或写回的inode以磁盘上的为准
+      if (!(inode = find_inode(dev, d->d_ino)) || inode->i_lock) {
+        order[m++] = order[i];
+        continue;
+      }
+      d->d_mode = inode->i_mode;
+      d->d_size = inode->i_size;
+      d->d_mtime = inode->i_mtime;
+    }
+  }
+
+  for (i = 0; i < m; i++) {
+    struct dirent_plus *d = ents + order[i];
+    block = 2 + sb->s_imap_blocks + sb->s_zmap_blocks +
+            (d->d_ino - 1) / sb->s_inodes_per_block;
+    if (block != cur) {
+      brelse(bh);
+      if (!(bh = bread(dev, block))) {
+        cur = -1;
+        d->d_mode = d->d_size = d->d_mtime = 0;
+        continue;
+      }
+      cur = block;
+      reads++;
+    }
+    inode_from_disk(sb, &tmp, bh->b_data,
+                    (d->d_ino - 1) % sb->s_inodes_per_block);
+    d->d_mode = tmp.i_mode;
+    d->d_size = tmp.i_size;
+    d->d_mtime = tmp.i_mtime;
+  }
+  brelse(bh);
+  return reads;
+}
+
+/*
+标记挂载点，dir已经是挂载点、是某个卷的根目录或者还有其他人在使用时返回-EBUSY
+调用者持有的引用之外不能有其他引用，否则之前进入该目录的会话会留在被遮住的目录中
+*/
+int mount_inode(struct m_inode *dir, struct super_block *s) {
+  std::lock_guard<level_mutex> g(itable_lock);
+  if (dir->i_mount || dir->i_num == ROOT_INO || dir->i_count > 1)
+    return -EBUSY;
+  s->s_imount = dir;
+  dir->i_mount = 1;
+  return 0;
+}
+
+/*
+设备上是否有其他人在使用的inode：超级块对根目录的引用、fileSystem->root的引用、
+mounts不为0时超级块对挂载点的引用以及self的一个引用之外还有引用时返回1，
+调用者需持有itable_lock
+*/
+static int dev_busy(int dev, struct super_block *sb, int mounts,
+                    struct m_inode *self) {
+  struct m_inode *inode;
+
+  for (int i = 0; i < NR_INODE; i++) {
+    inode = inode_tabel[i];
+    if (inode->i_num && inode->i_dev == dev &&
+        inode->i_count > (inode == sb->s_isup) +
+                             (inode == fileSystem->root) +
+                             (mounts && inode->i_mount) + (inode == self))
+      return 1;
+  }
+  return 0;
+}
+
+/*
+检查卷是否只有调用者在使用：除self(可以为NULL)与超级块持有的引用外，
+设备上还有被引用的inode时返回1，例如其他会话的工作目录或打开的文件
+*/
+int inodes_busy(int dev, struct m_inode *self) {
+  struct super_block *sb = get_super(dev);
+  std::lock_guard<level_mutex> g(itable_lock);
+  return dev_busy(dev, sb, 1, self);
+}
+
+/*
+卸载前检查设备上的inode：除超级块引用的根目录外还有被引用的inode时返回-EBUSY，
+否则取消挂载点的标记，写回并清除该设备的全部inode，之后设备号可以给其他卷使用
+*/
+int umount_inodes(int dev) {
+  struct super_block *sb = get_super(dev);
+  struct m_inode *inode;
+  int i;
+  std::unique_lock<level_mutex> g(itable_lock);
+
+  //写回时放开itable_lock，直到某一遍检查时已没有要写回的inode
+  for (;;) {
+    if (dev_busy(dev, sb, 0, NULL)) return -EBUSY;
+    for (i = 0; i < NR_INODE; i++) {
+      inode = inode_tabel[i];
+      if (inode->i_num && inode->i_dev == dev &&
+          (inode->i_lock || inode->i_dirt))
+        break;
+    }
+    if (i == NR_INODE) break;
+    if (inode->i_lock) {
+      itable_wait.wait(g);
+      continue;
+    }
+    inode->i_lock = 1;
+    g.unlock();
+    write_inode(inode);
+    g.lock();
+    inode->i_lock = 0;
+    itable_wait.notify_all();
+  }
+  if (sb->s_imount) sb->s_imount->i_mount = 0;
+  for (i = 0; i < NR_INODE; i++) {
+    inode = inode_tabel[i];
+    if (inode->i_num && inode->i_dev == dev) clear_inode(inode);
+  }
+  sb->s_isup = NULL;
+  dcache_purge_dev(dev);
+  return 0;
+}
+
+//删除磁盘上的inode 节点，调用者需持有itable_lock
 void free_inode(struct m_inode *inode) {
   struct super_block *sb;
   struct buffer_head *bh;
@@ -138,47 +473,37 @@ void free_inode(struct m_inode *inode) {
   }
   if (!(sb = get_super(inode->i_dev)))
     printf("trying to free block on nonexistent device");
-  if (!(bh = sb->s_imap[inode->i_num >> 13])) {
+  if (!(bh = sb->s_imap[inode->i_num / BLOCK_BITS(sb)])) {
     printf("nonexistent imap in superblock");
     return;
   }
 
-  if (!get_bit(inode->i_num % BLOCK_BIT, bh->b_data))
+  if (free_inode_bit(sb, inode->i_num) < 0)
     printf("!!!BUG free_inode: bit already cleared.\n\r");
-  clear_bit(inode->i_num % BLOCK_BIT, bh->b_data);
-  bh->b_dirt = 1;
   //这里只清空了内存中数据，并不会实际清空磁盘上的数据
-  memset(inode, 0, sizeof(*inode));
+  clear_inode(inode);
 }
 
 /*创建一个新的inode节点，该inode节点对应磁盘上空闲的位置*/
 struct m_inode *new_inode(int dev) {
   struct m_inode *inode;
   struct super_block *sb;
-  struct buffer_head *bh;
-  int i, j;
+  int j;
 
   /*申请获取内存中inode的空间（inode_table)*/
-  if (!(inode = get_empty_inode())) return NULL;
+  {
+    std::unique_lock<level_mutex> g(itable_lock);
+    if (!(inode = get_empty_inode(g))) return NULL;
+  }
 
   if (!(sb = get_super(dev))) printf("new_inode with unknown device");
-  j = 8192;
-  for (i = 0; i < 8; i++)
-    if ((bh = sb->s_imap[i]))
-      if ((j = find_first_zero(bh->b_data)) < 8192) break;
-  if (!bh || j >= 8192 || j + i * 8192 > sb->s_ninodes) {
-    iput(inode);
+  //在当前线程的分配组中修改i节点位图
+  j = alloc_inode_bit(sb);
+  std::lock_guard<level_mutex> g(itable_lock);
+  if (!j) {
+    inode->i_count = 0;
     return NULL;
   }
-  //修改i节点位图
-  if (get_bit(j, bh->b_data)) {
-    //位图已经存在，说明代码出现bug
-    printf("！！！BUG new_inode: bit already set");
-    return 0;
-  }
-  set_bit(j, bh->b_data);
-  bh->b_dirt = 1;
-  brelse(bh);
   //初始化inode
   inode->i_count = 1;
   inode->i_nlinks = 1;
@@ -186,7 +511,8 @@ struct m_inode *new_inode(int dev) {
   // inode->i_uid = current->euid;
   // inode->i_gid = current->egid;
   inode->i_dirt = 1;
-  inode->i_num = j + i * 8192;
+  inode->i_num = j;
+  hash_inode(inode);
   // printf("get i num: %d\n", inode->i_num);
   inode->i_mtime = inode->i_atime = inode->i_ctime = CurrentTime();
   return inode;
@@ -200,130 +526,172 @@ struct m_inode *new_inode(int dev) {
   get_empty_inode函数*/
 void iput(struct m_inode *inode) {
   if (!inode) return;
+  std::unique_lock<level_mutex> g(itable_lock);
+  // realse_inode_table可能正在写回它
+  while (inode->i_lock) itable_wait.wait(g);
   if (!inode->i_count) printf("!!!BUG iput: trying to free free inode");
-  if (inode->i_count > 1) {
+  if (inode->i_count > 1 || (inode->i_nlinks && !inode->i_dirt)) {
     inode->i_count--;
     return;
   }
+  /*最后一个引用，截断或写回时不持有itable_lock，
+    保留这个引用使位置不被重新使用，其他线程iget该inode时等待完成*/
+  inode->i_lock = 1;
+  g.unlock();
   /*如果指向该inode的链接数为
    * 0，删除该文件，清空inode的所有数据区，并释放inode节点*/
-  if (!inode->i_nlinks) {
+  if (!inode->i_nlinks)
     truncate(inode);
+  else
+    write_inode(inode);
+  g.lock();
+  inode->i_lock = 0;
+  itable_wait.notify_all();
+  // 先从哈希表中去掉再释放i节点位图，新分配到该号的inode不会与它同时在表中
+  if (!inode->i_nlinks)
     free_inode(inode);
-    return;
+  else
+    inode->i_count--;
+}
+
+/*将逻辑块号分解为索引路径，offsets[0]为i_zone中的下标，
+  之后依次为各级索引块中的下标，返回索引的级数，超出范围返回-1
+  ZPB为一个索引块中的逻辑块号个数，为编译期常量*/
+template <int ZPB>
+static int block_to_path(int max_depth, int block, int offsets[4]) {
+  int depth, span;
+
+  if (block < 0) return -1;
+  if (block < NR_DIRECT) {
+    offsets[0] = block;
+    return 0;
   }
-  if (inode->i_dirt) {
-    write_inode(inode);
-    inode->i_dirt = 0;
+  block -= NR_DIRECT;
+  for (depth = 1, span = ZPB; depth <= max_depth; depth++, span *= ZPB) {
+    if (block < span) break;
+    block -= span;
+  }
+  if (depth > max_depth) return -1;
+  offsets[0] = NR_DIRECT - 1 + depth;
+  for (int i = depth; i > 0; i--) {
+    offsets[i] = block % ZPB;
+    block /= ZPB;
   }
-  inode->i_count--;
-  return;
+  return depth;
+}
+
+/*索引块中第i个逻辑块号，v1为16位，v2为32位*/
+unsigned int get_zone(struct super_block *sb, char *data, int i) {
+  if (sb->s_version == 1) return ((unsigned short *)data)[i];
+  return ((unsigned int *)data)[i];
+}
+void set_zone(struct super_block *sb, char *data, int i, unsigned int zone) {
+  if (sb->s_version == 1)
+    ((unsigned short *)data)[i] = zone;
+  else
+    ((unsigned int *)data)[i] = zone;
+}
+
+/*从逻辑块block开始，连续映射count个逻辑块，结果存入zones，
+  create不为0时，路径上不存在的块会被创建。
+  各级索引块在相邻逻辑块之间一直持有，整段范围只遍历一次索引块，
+  不必像逐块调用那样每块都重新bread/brelse一遍。
+  返回映射的块数，count不大于0时返回0，第一个块就超出范围时返回-1
+  BS为块大小，zone_t为索引块中逻辑块号的类型*/
+template <int BS, typename zone_t>
+static int map_blocks_t(struct m_inode *inode, int block, int count,
+                        unsigned int *zones, int create) {
+  const int max_depth = sizeof(zone_t) == 2 ? 2 : 3;
+  struct buffer_head *path_bh[4] = {NULL, NULL, NULL, NULL};
+  int offsets[4], depth = 0, i, nr, next, done;
+
+  if (count <= 0) return 0;
+  for (done = 0; done < count; done++, block++) {
+    depth = block_to_path<BS / sizeof(zone_t)>(max_depth, block, offsets);
+    if (depth < 0) break;
+    if (!(nr = inode->i_zone[offsets[0]]) && create)
+      if ((nr = inode->i_zone[offsets[0]] =
+               new_block_near(inode->i_dev, inode->i_goal))) {
+        inode->i_goal = nr + 1;
+        inode->i_ctime = CurrentTime();
+        inode->i_dirt = 1;
+      }
+    for (i = 1; i <= depth && nr; i++) {
+      /*该级索引块与上一个逻辑块的不同时才重新读取*/
+      if (!path_bh[i] || path_bh[i]->b_blocknr != (unsigned int)nr) {
+        brelse(path_bh[i]);
+        if (!(path_bh[i] = bread(inode->i_dev, nr))) {
+          nr = 0;
+          break;
+        }
+      }
+      next = ((zone_t *)path_bh[i]->b_data)[offsets[i]];
+      //判断具体block是否创建，没有创建则创建
+      if (!next && create)
+        if ((next = new_block_near(inode->i_dev, inode->i_goal))) {
+          inode->i_goal = next + 1;
+          ((zone_t *)path_bh[i]->b_data)[offsets[i]] = next;
+          path_bh[i]->b_dirt = 1;
+        }
+      nr = next;
+    }
+    if (!nr && create) break;
+    zones[done] = nr;
+  }
+  for (i = 1; i < 4; i++) brelse(path_bh[i]);
+  return (done || depth >= 0) ? done : -1;
+}
+template <int BS>
+static int map_blocks_bs(struct super_block *sb, struct m_inode *inode,
+                         int block, int count, unsigned int *zones,
+                         int create) {
+  if (sb->s_version == 1)
+    return map_blocks_t<BS, unsigned short>(inode, block, count, zones, create);
+  return map_blocks_t<BS, unsigned int>(inode, block, count, zones, create);
+}
+int map_blocks(struct m_inode *inode, int block, int count,
+               unsigned int *zones, int create) {
+  struct super_block *sb;
+
+  if (!(sb = get_super(inode->i_dev))) return 0;
+  return BLOCKSIZE_DISPATCH(sb->s_blocksize, -1, map_blocks_bs, sb, inode,
+                            block, count, zones, create);
+}
+static int get_block(struct m_inode *inode, int block, int create) {
+  unsigned int nr = 0;
+  int n;
+
+  if ((n = map_blocks(inode, block, 1, &nr, create)) < 0) return -1;
+  return n ? nr : 0;
 }
 
 /*逻辑数据块与物理数据块地址转换，给出逻辑数据块，返回物理数据块*/
 int bmap(struct m_inode *inode, int block) {
-  struct buffer_head *bh;
-  int i;
+  int nr;
 
   if (block < 0) {
     printf("试图读取不存在的数据块");
     return -1;
   }
-  if (block >= 7 + 512 + 512 * 512) {
+  if ((nr = get_block(inode, block, 0)) < 0) {
     printf("试图读取超过范围的数据块");
     return -1;
   }
-  /*直接索引*/
-  if (block < 7) {
-    return inode->i_zone[block];
-  }
-  /*一级索引查询*/
-  block -= 7;
-  if (block < 512) {
-    if (!inode->i_zone[7]) return 0;
-    bh = bread(inode->i_zone[7]);
-    i = ((unsigned short *)(bh->b_data))[block];
-    brelse(bh);
-    return i;
-  }
-  /*二级索引查询*/
-  block -= 512;
-  if (!inode->i_zone[8]) return 0;
-  bh = bread(inode->i_zone[8]);
-  // 找到对应的一级索引
-  i = ((unsigned short *)bh->b_data)[block / 512];
-  brelse(bh);
-  if (!i) return 0;
-  bh = bread(i);
-  // 找到最终物理块位置
-  i = ((unsigned short *)bh->b_data)[block % 512];
-  brelse(bh);
-  return i;
+  return nr;
 }
 
 /*读取数据块，给出一个i节点，以及数据块编号，读取出数据块,
         注意！！！ 如果该数据块不存在，则会创建它*/
 int create_block(struct m_inode *inode, int block) {
-  struct buffer_head *bh;
-  int i;
+  int nr;
 
-  if (block < 0) printf("_bmap: block<0");
-  if (block >= 7 + 512 + 512 * 512) printf("_bmap: block>big");
-  if (block < 7) {
-    if (!inode->i_zone[block])
-      if ((inode->i_zone[block] = new_block(inode->i_dev))) {
-        inode->i_ctime = CurrentTime();
-        inode->i_dirt = 1;
-      }
-    return inode->i_zone[block];
+  if (block < 0) {
+    printf("_bmap: block<0");
+    return 0;
   }
-  block -= 7;
-  if (block < 512) {
-    //首先判断一级目录是否创建
-    if (!inode->i_zone[7])
-      if ((inode->i_zone[7] = new_block(inode->i_dev))) {
-        inode->i_dirt = 1;
-        inode->i_ctime = CurrentTime();
-      }
-    //创建失败
-    if (!inode->i_zone[7]) return 0;
-    if (!(bh = bread(inode->i_zone[7]))) return 0;
-    i = ((unsigned short *)(bh->b_data))[block];
-    //判断具体block是否创建，没有创建则创建
-    if (!i)
-      if ((i = new_block(inode->i_dev))) {
-        ((unsigned short *)(bh->b_data))[block] = i;
-        bh->b_dirt = 1;
-      }
-    brelse(bh);
-    return i;
+  if ((nr = get_block(inode, block, 1)) < 0) {
+    printf("_bmap: block>big");
+    return 0;
   }
-  block -= 512;
-  //首先判断二级目录是否创建
-  if (!inode->i_zone[8])
-    if ((inode->i_zone[8] = new_block(inode->i_dev))) {
-      inode->i_dirt = 1;
-      inode->i_ctime = CurrentTime();
-    }
-  //创建失败
-  if (!inode->i_zone[8]) return 0;
-
-  if (!(bh = bread(inode->i_zone[8]))) return 0;
-  i = ((unsigned short *)bh->b_data)[block >> 9];
-  if (!i)
-    if ((i = new_block(inode->i_dev))) {
-      ((unsigned short *)(bh->b_data))[block >> 9] = i;
-      bh->b_dirt = 1;
-    }
-  brelse(bh);
-  if (!i) return 0;
-  if (!(bh = bread(i))) return 0;
-  i = ((unsigned short *)bh->b_data)[block & 511];
-  if (!i)
-    if ((i = new_block(inode->i_dev))) {
-      ((unsigned short *)(bh->b_data))[block & 511] = i;
-      bh->b_dirt = 1;
-    }
-  brelse(bh);
-  return i;
+  return nr;
 }
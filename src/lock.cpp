@@ -0,0 +1,36 @@
+/*
+加锁顺序的检查，只在定义了LOCK_DEBUG时编译，见lock.h
+每个线程记录自己持有的各级锁的个数，加锁时如果已经持有更内层的锁，说明顺序错误
+*/
+#include <cstdio>
+#include <cstdlib>
+
+#include "lock.h"
+
+#ifdef LOCK_DEBUG
+#define NR_LEVELS (LOCK_DISK + 1)
+
+static const char *level_names[NR_LEVELS] = {
+    "mount", "inode",  "inode_table", "imap",
+    "zmap",  "dcache", "buffer",      "snapshot", "disk"};
+static thread_local int held[NR_LEVELS];
+
+void lock_check_acquire(int level) {
+  for (int i = level; i < NR_LEVELS; i++) {
+    // 只有inode的读写锁可以同时持有多个(先父目录后子目录)
+    if (!held[i] || (i == level && level == LOCK_INODE)) continue;
+    fprintf(stderr, "lock order violation: taking %s while holding %s\n",
+            level_names[level], level_names[i]);
+    abort();
+  }
+  held[level]++;
+}
+
+void lock_check_release(int level) {
+  if (held[level]-- <= 0) {
+    fprintf(stderr, "lock order violation: releasing unheld %s\n",
+            level_names[level]);
+    abort();
+  }
+}
+#endif
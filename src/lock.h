@@ -0,0 +1,88 @@
+#pragma once
+/*
+多线程访问文件系统时使用的锁，所有锁都有一个级别，加锁顺序必须由外到内：
+  LOCK_MOUNT   挂载与卸载
+  LOCK_INODE   每个inode的读写锁，同时持有多个时必须先父目录后子目录
+  LOCK_ITABLE  inode_table，iget/iput以及inode中记录的父目录与文件名
+  LOCK_IMAP    i节点位图
+  LOCK_ZMAP    逻辑块位图
+  LOCK_DCACHE  目录项缓存
+  LOCK_BUFFER  缓冲区，按块号分为NR_BUF_SHARDS片，每片一个锁，不会同时持有两片
+               (只在读入、换出、删除block时加锁，命中缓冲区不加锁，见disk.cpp)
+  LOCK_SNAP    卷的快照，保存将被覆盖的块与读取快照时持有，见snapshot.cpp
+  LOCK_DISK    磁盘映像文件，每个文件一个，不会同时持有两个
+持有某一级的锁时只能再获取更内层的锁，因此不会出现死锁
+编译时定义LOCK_DEBUG(make LOCK_DEBUG=1)，每次加锁都会检查是否符合该顺序
+*/
+#include <mutex>
+#include <shared_mutex>
+
+enum lock_level {
+  LOCK_MOUNT,
+  LOCK_INODE,
+  LOCK_ITABLE,
+  LOCK_IMAP,
+  LOCK_ZMAP,
+  LOCK_DCACHE,
+  LOCK_BUFFER,
+  LOCK_SNAP,
+  LOCK_DISK,
+};
+
+#ifdef LOCK_DEBUG
+void lock_check_acquire(int level);
+void lock_check_release(int level);
+#else
+static inline void lock_check_acquire(int) {}
+static inline void lock_check_release(int) {}
+#endif
+
+/*带级别的互斥锁，可以直接用于std::lock_guard*/
+class level_mutex {
+ public:
+  explicit level_mutex(int level) : level_(level) {}
+  void lock() {
+    lock_check_acquire(level_);
+    m_.lock();
+  }
+  void unlock() {
+    m_.unlock();
+    lock_check_release(level_);
+  }
+
+ private:
+  std::mutex m_;
+  int level_;
+};
+
+/*带级别的读写锁*/
+class level_rwlock {
+ public:
+  explicit level_rwlock(int level = LOCK_INODE) : level_(level) {}
+  void lock() {
+    lock_check_acquire(level_);
+    m_.lock();
+  }
+  void unlock() {
+    m_.unlock();
+    lock_check_release(level_);
+  }
+  void lock_shared() {
+    lock_check_acquire(level_);
+    m_.lock_shared();
+  }
+  void unlock_shared() {
+    m_.unlock_shared();
+    lock_check_release(level_);
+  }
+  bool try_lock_shared() {
+    lock_check_acquire(level_);
+    if (m_.try_lock_shared()) return true;
+    lock_check_release(level_);
+    return false;
+  }
+
+ private:
+  std::shared_mutex m_;
+  int level_;
+};
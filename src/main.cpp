@@ -19,18 +19,19 @@ int main() {
 void init() {
   init_inode_table();
   mount_root();
+  current = session_create();
   printfc(FG_YELLOW, string("系统时间为: ") + longtoTime(CurrentTime()));
 }
 
 void fresh_cmd() {
   printfc(FG_GREEN, "[Team1:CabbageDog] ");
-  printfc(FG_BLUE, fileSystem->name);
+  printfc(FG_BLUE, current->name);
   printfc(FG_WHITE, "> ");
 }
 
 void cmd() {
   fresh_cmd();
-  string input, command, path, newPath;
+  string input, command, path, newPath, extra, stripes;
   int i;
   while (getline(cin, input)) {
     istringstream is(input);
@@ -41,21 +42,22 @@ void cmd() {
         return;
       }
     }
-    if (i != 1 & i != 2 & i != 3) {
+    istringstream temp(input);
+    temp >> command >> path >> newPath >> extra >> stripes;
+    // 只有init与cp命令可以带三个参数，init可以带四个
+    if (i != 1 & i != 2 & i != 3 &
+        !(i == 4 && (command == "init" || command == "cp")) &
+        !(i == 5 && command == "init")) {
       perrorc("your input is Illegal");
       fresh_cmd();
       continue;
     }
-    istringstream temp(input);
-    temp >> command >> path >> newPath;
 
     if (command.compare("ls") == 0) {
-      const char* pa = path.c_str();
-      int code = cmd_ls(pa);
+      int code = cmd_ls(path);
       myhint(code);
     } else if (command.compare("cd") == 0) {
-      const char* pa = path.c_str();
-      int code = cmd_cd(pa);
+      int code = cmd_cd(path);
       myhint(code);
     } else if (command.compare("mkdir") == 0) {
       const char* pa = path.c_str();
@@ -66,8 +68,7 @@ void cmd() {
       int code = cmd_touch(pa, S_IFREG);
       myhint(code);
     } else if (command.compare("cat") == 0) {
-      const char* pa = path.c_str();
-      int code = cmd_cat(pa);
+      int code = cmd_cat(path);
       myhint(code);
     } else if (command.compare("rmdir") == 0) {
       const char* pa = path.c_str();
@@ -78,28 +79,95 @@ void cmd() {
       int code = cmd_rm(pa);
       myhint(code);
     } else if (command.compare("stat") == 0) {
-      const char* pa = path.c_str();
-      int code = cmd_stat(pa);
+      int code = cmd_stat(path);
       myhint(code);
     } else if (command.compare("pwd") == 0) {
       int code = cmd_pwd();
       myhint(code);
     } else if (command.compare("vi") == 0) {
-      const char* pa = path.c_str();
-      int code = cmd_vi(pa);
+      int code = cmd_vi(path);
       myhint(code);
     } else if (command.compare("dd") == 0) {
       string str = path + " " + newPath;
       const char* pa = str.c_str();
       int code = cmd_dd(pa);
       myhint(code);
+    } else if (command.compare("sync") == 0) {
+      int code = cmd_sync();
+      myhint(code);
+    } else if (command.compare("cache") == 0) {
+      int code = cmd_cache();
+      myhint(code);
+    } else if (command.compare("compact") == 0) {
+      int code = cmd_compact(path);
+      myhint(code);
+    } else if (command.compare("fsck") == 0) {
+      // fsck [-y]
+      int code = cmd_fsck(path);
+      myhint(code);
+    } else if (command.compare("mount") == 0) {
+      // mount [映像文件 目录]
+      int code = cmd_mount(path, newPath);
+      myhint(code);
+    } else if (command.compare("umount") == 0) {
+      // umount 目录
+      int code = cmd_umount(path);
+      myhint(code);
+    } else if (command.compare("snapshot") == 0) {
+      // snapshot [-d]
+      int code = cmd_snapshot(path);
+      myhint(code);
+    } else if (command.compare("cp") == 0) {
+      // cp [-r] 源 目标
+      int code = cmd_cp(path, newPath, extra);
+      myhint(code);
+    } else if (command.compare("aiobench") == 0) {
+      // aiobench [读取次数]
+      int code = cmd_aiobench(path);
+      myhint(code);
+    } else if (command.compare("stress") == 0) {
+      // stress [线程数] [每个线程的操作数]
+      int code = cmd_stress(path, newPath);
+      myhint(code);
+    } else if (command.compare("allocbench") == 0) {
+      // allocbench [查找次数]
+      int code = cmd_allocbench(path);
+      myhint(code);
+    } else if (command.compare("createbench") == 0) {
+      // createbench [文件数]
+      int code = cmd_createbench(path);
+      myhint(code);
+    } else if (command.compare("lookupbench") == 0) {
+      // lookupbench [最大项数]
+      int code = cmd_lookupbench(path);
+      myhint(code);
+    } else if (command.compare("seqbench") == 0) {
+      // seqbench [文件大小(MB)]
+      int code = cmd_seqbench(path);
+      myhint(code);
+    } else if (command.compare("writebench") == 0) {
+      // writebench [文件大小(MB)]
+      int code = cmd_writebench(path);
+      myhint(code);
     } else if (command.compare("init") == 0) {
-      initialize_block(ROOT_DEV);
+      // init [v1|v2] [nzones] [blocksize] [stripes]，默认格式化为1K块的v2磁盘
+      // stripes大于1时根设备为条带卷，映像文件为hdc-0.11.img与hdc-0.11.img.1等
+      int version = (path == "v1") ? 1 : 2;
+      unsigned long nzones, blocksize, k;
+      if (parse_uint(newPath, 0, &nzones) < 0 ||
+          parse_uint(extra, BLOCK_SIZE, &blocksize) < 0 ||
+          parse_uint(stripes, 1, &k) < 0 || nzones > 0xFFFFFFFFul ||
+          blocksize > MAX_BLOCK_SIZE || k > MAX_STRIPES)
+        myhint(-EINVAL);
+      else
+        initialize_block(ROOT_DEV, version, nzones, blocksize, k);
     } else {
       perrorc("your input is Illegal");
     }
     path = "";
     newPath = "";
+    extra = "";
+    stripes = "";
     fresh_cmd();
   }
 }
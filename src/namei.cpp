@@ -3,132 +3,303 @@
 
 #include "fs.h"
 
+#define MIN(a, b) (((a) < (b)) ? (a) : (b))
+
+/*
+目录迭代器：find_entry、empty_dir、get_name等都要从头到尾遍历目录，
+统一由这里按块读取。逻辑块号用map_blocks每次映射一批，索引块不必每块都重新读取
+用法：
+  dir_iter_init(&it, dir, 0);
+  while ((bh = dir_iter_block(&it))) ... 当前块为it.de[0..it.n)
+或者
+  while ((de = dir_iter_next(&it))) ... 依次得到每个有效目录项
+遍历完时当前块已经释放，中途退出时需要调用dir_iter_end，或者接管it.bh
+*/
+void dir_iter_init(struct dir_iter *it, struct m_inode *dir, int pos) {
+  it->dir = dir;
+  it->epb = DIR_ENTRIES_PER_BLOCK(get_super(dir->i_dev));
+  it->entries = dir->i_size / sizeof(struct dir_entry);
+  it->pos = pos;
+  it->base = it->nzones = 0;
+  it->bh = NULL;
+  it->de = NULL;
+  it->index = it->n = it->k = 0;
+}
+
+/*释放当前块，读取下一个目录块，目录遍历完时返回NULL*/
+struct buffer_head *dir_iter_block(struct dir_iter *it) {
+  int block, last;
+
+  brelse(it->bh);
+  it->bh = NULL;
+  while (it->pos < it->entries) {
+    block = it->pos / it->epb;
+    if (block < it->base || block >= it->base + it->nzones) {
+      last = (it->entries - 1) / it->epb;
+      it->base = block;
+      it->nzones = map_blocks(it->dir, block,
+                              MIN(last - block + 1, DIR_ITER_BATCH), it->zones, 0);
+      if (it->nzones <= 0) {
+        it->nzones = 0;
+        it->pos = it->entries;
+        break;
+      }
+    }
+    it->index = block * it->epb;
+    it->k = it->pos - it->index;
+    it->n = MIN(it->epb, it->entries - it->index);
+    it->pos = it->index + it->epb;
+    /*如果目录块不存在或读取失败，则跳过该块*/
+    if (!it->zones[block - it->base] ||
+        !(it->bh = bread(it->dir->i_dev, it->zones[block - it->base])))
+      continue;
+    it->de = (struct dir_entry *)it->bh->b_data;
+    return it->bh;
+  }
+  return NULL;
+}
+
+/*返回下一个有效的目录项(inode号不为0)，目录遍历完时返回NULL*/
+struct dir_entry *dir_iter_next(struct dir_iter *it) {
+  do {
+    while (it->bh && it->k < it->n)
+      if (it->de[it->k++].inode) return it->de + it->k - 1;
+  } while (dir_iter_block(it));
+  return NULL;
+}
+
+/*下一次遍历开始的位置，可以用它重新dir_iter_init接着遍历*/
+int dir_iter_pos(struct dir_iter *it) {
+  return it->bh ? it->index + it->k : MIN(it->pos, it->entries);
+}
+
+void dir_iter_end(struct dir_iter *it) {
+  brelse(it->bh);
+  it->bh = NULL;
+}
+
 /*在给出的目录内根据文件名查询具体的某一项，返回查询到的inode 的数据块 */
 struct buffer_head *find_entry(struct m_inode **dir, const char *name,
                                int namelen, struct dir_entry **res_dir) {
-  int entries;
-  int block, i;
+  int n;
   struct buffer_head *bh;
-  struct dir_entry *de;
-  struct super_block *sb;
-  char *name_tmp = (char *)malloc(namelen + 1);
-  if (!name_tmp) {
-    // 内存分配失败处理
-    perror("Memory allocation failed");
-    return NULL;
-  }
-  // dir只能在直接的块（非索引）中存文件吗？能否支持更大的文件个数
-  entries = (*dir)->i_size /
-            (sizeof(struct dir_entry));  // 目录下的文件总数？目录项总数
+  struct dir_iter it;
   *res_dir = NULL;
   if (!namelen) return NULL;
   /* check for '..', as we might have to do some "magic" for it */
-  if (namelen == 2 && name[0] == '.' && name[1] == '.') {
-    /* '..' in a pseudo-root results in a faked '.' (just change namelen) */
-    if ((*dir) == fileSystem->root)
-      namelen = 1;
-    else if ((*dir)->i_num == ROOT_INO) {  // mount？本程序没用到
-      /* '..' over a mount-point results in 'dir' being exchanged for the
-         mounted directory-inode. NOTE! We set mounted, so that we can iput the
-         new dir */
-      sb = get_super((*dir)->i_dev);
-      if (sb->s_imount) {
-        iput(*dir);
-        (*dir) = sb->s_imount;
-        (*dir)->i_count++;
-      }
+  /* '..' in a pseudo-root results in a faked '.' (just change namelen) */
+  if (namelen == 2 && name[0] == '.' && name[1] == '.' &&
+      (*dir) == fileSystem->root)
+    namelen = 1;
+  // '..'越过挂载点由walk_path在加锁之前换成挂载点，这里只查找调用者加锁的目录
+  // 建有哈希索引的目录只需查找一个叶子块
+  if ((*dir)->i_flags & I_INDEX)
+    return dx_find_entry(*dir, name, namelen, res_dir);
+  // 每个目录块整块与补齐为定长的文件名比较
+  dir_iter_init(&it, *dir, 0);
+  while ((bh = dir_iter_block(&it)))
+    if ((n = dir_find_name(bh->b_data, it.n, name, namelen)) >= 0) {
+      // 找到的块交给调用者释放
+      *res_dir = it.de + n;
+      return bh;
     }
+  return NULL;
+}
+
+/*
+目录的空闲项提示：删除目录项时记录下它所在的数据块，增加目录项时直接到这些块中查找，
+i_packed为1时说明目录中其他位置都没有空闲项，新的目录项直接加在最后，
+这样在目录中创建文件不必每次都从头扫描。提示只保存在内存中，inode重新读入后需要扫描一次
+*/
+void dir_add_hole(struct m_inode *dir, struct buffer_head *bh) {
+  int i;
+
+  dir->i_ndead++;
+  if ((dir->i_flags & I_INDEX) || !dir->i_packed) return;
+  for (i = 0; i < dir->i_nholes; i++)
+    if (dir->i_holes[i] == bh->b_blocknr) return;
+  // 记录不下时放弃提示，下次增加目录项时重新扫描
+  if (dir->i_nholes == DIR_HOLES)
+    dir->i_packed = 0;
+  else
+    dir->i_holes[dir->i_nholes++] = bh->b_blocknr;
+}
+
+/*扫描整个目录，记录含有空闲项的数据块*/
+static void dir_scan_holes(struct m_inode *dir) {
+  struct dir_iter it;
+  struct buffer_head *bh;
+  int k;
+
+  dir->i_nholes = 0;
+  dir->i_packed = 1;
+  dir_iter_init(&it, dir, 0);
+  while ((bh = dir_iter_block(&it))) {
+    for (k = 0; k < it.n; k++)
+      if (!it.de[k].inode) break;
+    if (k == it.n) continue;
+    if (dir->i_nholes == DIR_HOLES) {
+      dir->i_packed = 0;
+      dir_iter_end(&it);
+      break;
+    }
+    dir->i_holes[dir->i_nholes++] = bh->b_blocknr;
   }
-  block = (*dir)->i_zone[0];
-  if (block <= 0) return NULL;
-  bh = bread(block);
-  i = 0;
-  de = (struct dir_entry *)bh->b_data;
-  strncpy(name_tmp, name, namelen);
-  name_tmp[namelen] = 0;
-  while (i < entries) {
-    // 暴力查找文件，能否更快？
-    /*一个目录块读取完毕，未找到目标，则换下一个目录寻找*/
-    if ((char *)de >= BLOCK_SIZE + bh->b_data) {
-      brelse(bh);
-      block = bmap(*dir, i / DIR_ENTRIES_PER_BLOCK);
-      bh = bread(block);
-      if (bh == NULL || block <= 0) {
-        /*如果下一个目录项读取失败，则跳过该目录*/
-        i += DIR_ENTRIES_PER_BLOCK;
-        continue;
-      }
-      de = (struct dir_entry *)bh->b_data;
+}
+
+/*从记录的数据块中取一个空闲项，没有时返回NULL*/
+static struct buffer_head *dir_find_hole(struct m_inode *dir,
+                                         struct dir_entry **res_dir) {
+  struct super_block *sb = get_super(dir->i_dev);
+  int block, limit, k, more;
+  struct buffer_head *bh;
+  struct dir_entry *de;
+
+  while (dir->i_nholes) {
+    block = dir->i_holes[dir->i_nholes - 1];
+    // 最后一个数据块中i_size之后的位置不是空闲项
+    limit = DIR_ENTRIES_PER_BLOCK(sb);
+    if (block == bmap(dir, (dir->i_size - 1) / sb->s_blocksize))
+      limit = (dir->i_size - 1) % sb->s_blocksize / sizeof(struct dir_entry) + 1;
+    if (!(bh = bread(dir->i_dev, block))) {
+      dir->i_nholes--;
+      continue;
     }
-    if (de->inode != 0 && !strcmp(name_tmp, de->name)) {
-      *res_dir = de;
+    de = (struct dir_entry *)bh->b_data;
+    *res_dir = NULL;
+    more = 0;
+    for (k = 0; k < limit; k++)
+      if (!de[k].inode) {
+        if (*res_dir) {
+          more = 1;
+          break;
+        }
+        *res_dir = de + k;
+      }
+    // 该块中的空闲项用完后从记录中去掉
+    if (!more) dir->i_nholes--;
+    if (*res_dir) {
+      if (dir->i_ndead) dir->i_ndead--;
       return bh;
     }
-    de++;
-    i++;
+    brelse(bh);
   }
-  brelse(bh);
   return NULL;
 }
 
+/*
+目录压缩：删除文件只是将目录项的inode号清0，目录不会变小，之后每次扫描都要读过这些空项。
+这里把有效的目录项依次前移，释放末尾不再需要的数据块并减小i_size。
+目录项的位置改变了，但dcache等只记录inode号，查找结果不受影响。
+建有哈希索引的目录按哈希值分块存放，由dx_compact重新分块并重建索引。
+返回去掉的目录项数
+*/
+int dir_compact(struct m_inode *dir) {
+  struct dir_iter it;
+  struct buffer_head *wbh = NULL;
+  struct dir_entry *de;
+  int entries, w = 0, wblock = -1, block;
+
+  if (!S_ISDIR(dir->i_mode)) return -ENOTDIR;
+  if (dir->i_flags & I_INDEX) return dx_compact(dir);
+  entries = dir->i_size / sizeof(struct dir_entry);
+  dir_iter_init(&it, dir, 0);
+  while ((de = dir_iter_next(&it))) {
+    /*长文件名的各项不能跨块，本块剩余的项不够时移到下一块的开头*/
+    if (DE_IS_LONG(de) && w % it.epb + dir_entry_slots(de) > it.epb)
+      w += it.epb - w % it.epb;
+    if (it.index + it.k - 1 != w) {
+      /*写入位置不会超过读取位置，所在的块已经读过*/
+      if (wblock != w / it.epb) {
+        brelse(wbh);
+        if ((block = bmap(dir, w / it.epb)) <= 0 ||
+            !(wbh = bread(dir->i_dev, block))) {
+          /*已经移动的目录项仍然有效，只是不再缩小目录*/
+          dir_iter_end(&it);
+          dir->i_packed = 0;
+          return -EIO;
+        }
+        wblock = w / it.epb;
+      }
+      ((struct dir_entry *)wbh->b_data)[w % it.epb] = *de;
+      memset(de, 0, sizeof(*de));
+      wbh->b_dirt = it.bh->b_dirt = 1;
+    }
+    w++;
+  }
+  brelse(wbh);
+  dir->i_nholes = 0;
+  dir->i_packed = 1;
+  dir->i_ndead = 0;
+  if (w == entries) return 0;
+  dir->i_size = w * sizeof(struct dir_entry);
+  truncate_blocks(dir, (w + it.epb - 1) / it.epb);
+  dir->i_mtime = dir->i_ctime = CurrentTime();
+  dir->i_dirt = 1;
+  return entries - w;
+}
+
+/*删除目录项之后调用，空项超过一半且至少有一块时压缩目录*/
+void dir_maybe_compact(struct m_inode *dir) {
+  struct super_block *sb = get_super(dir->i_dev);
+  unsigned int entries = dir->i_size / sizeof(struct dir_entry);
+
+  if (dir->i_ndead >= DIR_ENTRIES_PER_BLOCK(sb) && dir->i_ndead * 2 >= entries)
+    dir_compact(dir);
+}
+
 /*在给出的dir中增加一个目录项，需给出名字和长度
 返回包含了子目录的数据块
 res_dir
 返回创建的子目录项，注意，add_entry只设定了新创建目录的名字，未设置i节点编号*/
 struct buffer_head *add_entry(struct m_inode *dir, const char *name,
                               int namelen, struct dir_entry **res_dir) {
-  int block, i;
-  struct buffer_head *bh;
+  int block, i, slots, epb;
+  struct buffer_head *bh = NULL;
   struct dir_entry *de;
+  struct super_block *sb = get_super(dir->i_dev);
 
   *res_dir = NULL;
 #ifdef NO_TRUNCATE
-  if (namelen > NAME_LEN) return NULL;
+  if (namelen > LONG_NAME_LEN) return NULL;
 #else
-  if (namelen > NAME_LEN) namelen = NAME_LEN;
+  if (namelen > LONG_NAME_LEN) namelen = LONG_NAME_LEN;
 #endif
-  if (!namelen) return NULL;
-  if (!(block = dir->i_zone[0])) return NULL;
-  if (!(bh = bread(block))) return NULL;
-  i = 0;
-  de = (struct dir_entry *)bh->b_data;
-  while (1) {
-    /*遍历完了一个数据块*/
-    if ((char *)de >= BLOCK_SIZE + bh->b_data) {
-      brelse(bh);
-      bh = NULL;
-      block = create_block(dir, i / DIR_ENTRIES_PER_BLOCK);
-      if (!block) return NULL;
-      if (!(bh = bread(block))) {
-        i += DIR_ENTRIES_PER_BLOCK;
-        continue;
-      }
-      de = (struct dir_entry *)bh->b_data;
-    }
-
-    /*遍历了所有子目录，未找到空闲项，则在最后增加一项*/
-    if (i * sizeof(struct dir_entry) >= dir->i_size) {
-      de->inode = 0;
-      dir->i_size = (i + 1) * sizeof(struct dir_entry);
-      dir->i_dirt = 1;
-      dir->i_ctime = CurrentTime();
-    }
-    /*找到一个空闲的目录项*/
-    if (!de->inode) {
-      dir->i_mtime = CurrentTime();
-      strncpy(de->name, name, NAME_LEN);
-      de->name[NAME_LEN - 1] = 0;
-      for (i = namelen + 1; i < NAME_LEN; i++) de->name[i] = 0;
-      bh->b_dirt = 1;
-      dir->i_dirt = 1;
-      *res_dir = de;
-      return bh;
-    }
-    de++;
-    i++;
+  if (!namelen || !dir_name_valid(name, namelen)) return NULL;
+  // 缓存中可能记录着该文件名不存在
+  dcache_invalidate(dir, name, namelen);
+  if (dir->i_flags & I_INDEX) return dx_add_entry(dir, name, namelen, res_dir);
+  if (!dir->i_zone[0]) return NULL;
+  epb = DIR_ENTRIES_PER_BLOCK(sb);
+  slots = dir_name_slots(namelen);
+  /*先使用记录下来的空闲项，不知道目录中哪里有空闲项时扫描一遍
+  空闲项提示只记录单个的空闲项，长文件名直接加在最后*/
+  while (slots == 1 && !(bh = dir_find_hole(dir, &de))) {
+    if (dir->i_packed) break;
+    dir_scan_holes(dir);
   }
-  brelse(bh);
-  return NULL;
+  /*目录中没有空闲项，则在最后增加一项*/
+  if (!bh) {
+    i = dir->i_size / sizeof(struct dir_entry);
+    /*第0块放不下时，v2格式的目录转换为哈希索引目录*/
+    if (i <= epb && i + slots > epb && !dx_make_index(dir))
+      return dx_add_entry(dir, name, namelen, res_dir);
+    /*长文件名的各项必须在同一块中，本块剩余的项不够时从下一块开始*/
+    if (i % epb + slots > epb) i += epb - i % epb;
+    if (!(block = create_block(dir, i / epb))) return NULL;
+    if (!(bh = bread(dir->i_dev, block))) return NULL;
+    de = (struct dir_entry *)bh->b_data + i % epb;
+    memset(de, 0, slots * sizeof(struct dir_entry));
+    dir->i_size = (i + slots) * sizeof(struct dir_entry);
+    dir->i_ctime = CurrentTime();
+  }
+  /*找到空闲的目录项*/
+  dir->i_mtime = CurrentTime();
+  dir_set_name(de, name, namelen);
+  bh->b_dirt = 1;
+  dir->i_dirt = 1;
+  *res_dir = de;
+  return bh;
 }
 
 /*给出一个路径，返回路径指向的inode节点
@@ -138,39 +309,82 @@ struct buffer_head *add_entry(struct m_inode *dir, const char *name,
                 /user/linux/a.out 返回指向a.out的inode节点
 */
 struct m_inode *get_inode(const char *pathname) {
-  char c;
-  const char *thisname;
-  struct m_inode *inode;
+  return walk_path(pathname, strlen(pathname));
+}
+
+/*挂载的卷的根目录返回其挂载点，否则返回NULL*/
+static struct m_inode *mount_point(struct m_inode *inode) {
+  struct super_block *sb;
+  if (inode->i_num != ROOT_INO || inode == fileSystem->root ||
+      !(sb = get_super(inode->i_dev)))
+    return NULL;
+  return sb->s_imount;
+}
+
+/*
+与get_inode相同，但路径由起始地址和长度给出，不要求以0结尾，
+每一层的文件名直接在原路径上比较，查找过程中不申请内存
+*/
+struct m_inode *walk_path(const char *pathname, int len) {
+  const char *thisname, *end = pathname + len;
+  struct m_inode *inode, *dir;
   struct buffer_head *bh;
-  int namelen, inr, idev;
+  int namelen, inr, idev, pino;
   struct dir_entry *de;
-  if ((c = pathname[0]) == '/') {
+  if (pathname < end && pathname[0] == '/') {
     inode = fileSystem->root;
-    pathname++; 
-  } else if (c)
-    inode = fileSystem->current;
+    pathname++;
+  } else if (pathname < end)
+    inode = current->pwd;
   else
-    return NULL; 
-  inode->i_count++;
+    return NULL;
+  igrab(inode);
   while (1) {
     thisname = pathname;
     namelen = 0;
-    while (pathname[namelen] != '/' && pathname[namelen] != '\0') {
+    while (pathname + namelen < end && pathname[namelen] != '/') {
       namelen++;
     }
     pathname += namelen;
     if (namelen <= 0) return inode;
-    // 一层一层进入目录
-    if (!(bh = find_entry(&inode, thisname, namelen, &de))) {
+    // 已挂载的卷的根目录下的'..'在挂载点所在的目录中查找，
+    // 卷被引用时不能卸载，挂载点不会变化
+    if (namelen == 2 && thisname[0] == '.' && thisname[1] == '.' &&
+        (dir = mount_point(inode))) {
+      igrab(dir);
+      iput(inode);
+      inode = dir;
+    }
+    // 一层一层进入目录，先查目录项缓存，未命中再加读锁查找目录块
+    if ((inr = dcache_lookup(inode, thisname, namelen)) < 0) {
+      dir = inode;
+      lock_inode_shared(dir);
+      if (!(bh = find_entry(&inode, thisname, namelen, &de))) {
+        dcache_add(inode, thisname, namelen, 0);
+        unlock_inode_shared(dir);
+        iput(inode);
+        return NULL;
+      }
+      inr = de->inode;
+      brelse(bh);
+      dcache_add(inode, thisname, namelen, inr);
+      unlock_inode_shared(dir);
+    } else if (!inr) {
       iput(inode);
       return NULL;
     }
-    inr = de->inode;
     idev = inode->i_dev;
-    brelse(bh);
+    pino = inode->i_num;
     iput(inode);
     if (!(inode = iget(idev, inr))) return NULL;
-    if (pathname[0] == '\0') {
+    // 记下父目录与文件名，之后pwd等求路径时不必再查找父目录
+    // 进入了挂载的卷时父目录在另一个设备上，不记录
+    if (inode->i_dev == idev &&
+        !(thisname[0] == '.' &&
+          (namelen == 1 || (namelen == 2 && thisname[1] == '.'))))
+      if (namelen <= LONG_NAME_LEN)
+        inode_set_parent(inode, pino, thisname, namelen);
+    if (pathname == end) {
       return inode;
     }
     pathname += 1;
@@ -190,50 +404,29 @@ struct m_inode *get_inode(const char *pathname) {
 // 给路径名 找目录
 struct m_inode *dir_namei(const char *pathname, int *namelen,
                           const char **name) {
-  char c;
-  const char *basename;
-  struct m_inode *dir;
-  int len = strlen(pathname);
-  char *_pathname = new char[len + 1];
-  strcpy(_pathname, pathname);
-  basename = pathname;
+  const char *basename, *p;
+
   // 找到父目录的路径和文件名
-  while (true) {
-    c = pathname[0];
-    pathname++;
-    if (c == '\0') break;
-    if (c == '/') basename = pathname;
-  }
-  *namelen = pathname - basename - 1;
+  basename = pathname;
+  for (p = pathname; *p; p++)
+    if (*p == '/') basename = p + 1;
+  *namelen = p - basename;
   *name = basename;
-  // char* pathdir='\0';
-  len = strlen(_pathname) - *namelen;
-  /*如果父目录字符长度为0，即返回当前工作目录，否则进行查询*/
-  if (len == 0) {
-    fileSystem->current->i_count++;
-    delete[] _pathname;
-    return fileSystem->current;
-  }
-  _pathname[len] = 0;
-  // strncat(pathdir, _pathname, len);
-  // _pathname[len] = 0;
-  if (!(dir = get_inode(_pathname))) {
-    delete[] _pathname;
-    return NULL;
+  /*如果父目录字符长度为0，即返回当前工作目录，否则在原路径上查询父目录部分*/
+  if (basename == pathname) {
+    return igrab(current->pwd);
   }
-  delete[] _pathname;
-  return dir;
+  return walk_path(pathname, basename - pathname);
 }
 
 /*给出一个目录节点，判断该目录是否为空*/
 int empty_dir(struct m_inode *inode) {
-  int nr, block;
-  int len;
   struct buffer_head *bh;
   struct dir_entry *de;
+  struct dir_iter it;
 
-  len = inode->i_size / sizeof(struct dir_entry);
-  if (len < 2 || !inode->i_zone[0] || !(bh = bread(inode->i_zone[0]))) {
+  if (inode->i_size / sizeof(struct dir_entry) < 2 || !inode->i_zone[0] ||
+      !(bh = bread(inode->i_dev, inode->i_zone[0]))) {
     printf("warning - bad directory on dev %04x\n", inode->i_dev);
     return 0;
   }
@@ -241,85 +434,66 @@ int empty_dir(struct m_inode *inode) {
   if (de[0].inode != inode->i_num || !de[1].inode || strcmp(".", de[0].name) ||
       strcmp("..", de[1].name)) {
     printf("warning - bad directory on dev %04x\n", inode->i_dev);
+    brelse(bh);
     return 0;
   }
-  nr = 2;
-  de += 2;
-  while (nr < len) {
-    if ((void *)de >= (void *)(bh->b_data + BLOCK_SIZE)) {
-      brelse(bh);
-      block = bmap(inode, nr / DIR_ENTRIES_PER_BLOCK);
-      if (!block) {
-        nr += DIR_ENTRIES_PER_BLOCK;
-        continue;
-      }
-      if (!(bh = bread(block))) return 0;
-      de = (struct dir_entry *)bh->b_data;
-    }
-    /*找到一个子节点即返回*/
-    if (de->inode) {
-      brelse(bh);
-      return 0;
-    }
-    de++;
-    nr++;
-  }
   brelse(bh);
+  /*除 . 和 .. 以外找到一个有效的目录项即不为空*/
+  dir_iter_init(&it, inode, 2);
+  if (dir_iter_next(&it)) {
+    dir_iter_end(&it);
+    return 0;
+  }
   return 1;
 }
 
-/*给出inode 返回该inode的文件名*/
+/*给出inode 返回该inode的文件名，优先使用路径查找时记下的文件名*/
 int get_name(struct m_inode *inode, char *buf, int size) {
-  int entries;
-  int block, i;
-  struct buffer_head *bh;
   struct dir_entry *de;
-  if (inode->i_num == fileSystem->root->i_num) {
+  struct dir_iter it;
+  struct m_inode *mnt;
+  char name[LONG_NAME_LEN + 1];
+  int len;
+  if (inode == fileSystem->root) {
     buf[0] = '/';
     return 1;
   }
+  // 卷的根目录以挂载点的名字出现在路径中
+  if ((mnt = mount_point(inode))) return get_name(mnt, buf, size);
+  if (inode_get_parent(inode, buf, size)) return 1;
   /*获取父节点*/
 
   struct m_inode *dir = get_father(inode);
+  if (!dir) return -1;
 
   /*从父节点查询*/
-  entries = dir->i_size / (sizeof(struct dir_entry));
-  block = dir->i_zone[0];
-  if (block <= 0) return -1;
-  bh = bread(block);
-  i = 0;
-  de = (struct dir_entry *)bh->b_data;
-  while (i < entries) {
-    /*一个目录块读取完毕，未找到目标，则换下一个目录寻找*/
-    if ((char *)de >= BLOCK_SIZE + bh->b_data) {
-      brelse(bh);
-      block = bmap(dir, i / DIR_ENTRIES_PER_BLOCK);
-      bh = bread(block);
-      if (bh == NULL || block <= 0) {
-        /*如果下一个目录项读取失败，则跳过该目录*/
-        i += DIR_ENTRIES_PER_BLOCK;
-        continue;
-      }
-      de = (struct dir_entry *)bh->b_data;
-    }
-
-    if (de->inode == inode->i_num) {
-      strncpy(buf, de->name, size);
+  lock_inode_shared(dir);
+  dir_iter_init(&it, dir, 0);
+  while ((de = dir_iter_next(&it)))
+    if (de->inode == inode->i_num && !DE_IS_CONT(de) &&
+        strcmp(de->name, ".") && strcmp(de->name, "..")) {
+      len = dir_entry_name(de, name);
+      dir_iter_end(&it);
+      unlock_inode_shared(dir);
+      inode_set_parent(inode, dir->i_num, name, len);
+      strncpy(buf, name, size);
+      buf[size - 1] = 0;
       iput(dir);
-      brelse(bh);
       return 1;
     }
-    de++;
-    i++;
-  }
-  brelse(bh);
+  unlock_inode_shared(dir);
+  iput(dir);
   return -1;
 }
-/*给出一个inode ，返回该inode的父节点*/
+/*给出一个inode ，返回该inode的父节点，卷的根目录返回挂载点的父目录*/
 struct m_inode *get_father(struct m_inode *inode) {
+  struct m_inode *mnt = mount_point(inode);
+  if (mnt) return get_father(mnt);
+  unsigned int parent = inode_get_parent(inode, NULL, 0);
+  if (parent) return iget(inode->i_dev, parent);
   int block = inode->i_zone[0];
   if (block <= 0) return NULL;
-  buffer_head *bh = bread(block);
+  buffer_head *bh = bread(inode->i_dev, block);
   struct dir_entry *de = (struct dir_entry *)bh->b_data;
   // 第一个目录项为. 第二个为..
   de++;
@@ -0,0 +1,28 @@
+/*
+会话：每个客户端一个，记录工作目录与打开的文件，所有会话共享fileSystem中的根目录
+使用文件系统的线程先把current指向自己的会话，之后的路径查找、文件描述符都在该会话中进行，
+不同会话之间没有共享的状态，可以同时使用
+*/
+#include "fs.h"
+
+thread_local struct session* current;
+
+/*创建一个新的会话，工作目录为根目录(磁盘还未格式化时为NULL)*/
+struct session* session_create() {
+  struct session* s = new session();
+  s->pwd = fileSystem->root ? igrab(fileSystem->root) : NULL;
+  s->name = "/";
+  return s;
+}
+
+/*关闭会话中所有打开的文件，释放工作目录*/
+void session_destroy(struct session* s) {
+  for (auto f : s->filp)
+    if (f) {
+      iput(f->f_inode);
+      delete f;
+    }
+  iput(s->pwd);
+  if (current == s) current = NULL;
+  delete s;
+}
@@ -0,0 +1,280 @@
+/*
+卷的快照：保留创建时刻卷在磁盘上的内容，可以作为只读的卷挂载，供备份等读取，
+同时原来的卷照常读写
+快照按块写时复制(copy-on-write)：
+  创建时先把内存中的修改全部写回，记下此时的逻辑块位图，
+  之后原卷第一次覆盖快照中的块(超级块、位图、inode表与当时在使用的逻辑块)之前，
+  先把磁盘上的原内容保存到快照文件中
+  读取快照时已保存的块从快照文件读，其余的直接读原卷
+  创建快照之后才分配的逻辑块不属于快照，写入时不必复制
+快照文件为映像文件名加".snap"，
+依次存放快照头、创建时的逻辑块位图、保存的块(块号与内容)
+打开卷时如果有快照文件则继续使用，挂载该文件即挂载快照：
+  mount hdc-0.11.img.snap 目录
+每个卷最多一个快照
+*/
+#include <cstdio>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "epoch.h"
+#include "fs.h"
+#include "lock.h"
+using namespace std;
+
+#define SNAP_MAGIC "SNAPSHT"
+
+struct snap_header {
+  char magic[8];
+  int blocksize;
+  int firstdatazone;  // 之前的块(超级块、位图、inode表)都属于快照
+  int nzones;
+  int map_bytes;  // 之后为创建时的逻辑块位图，格式与zmap相同
+};
+
+struct snapshot {
+  level_mutex lock{LOCK_SNAP};  // 保护快照文件的读写，以及块的保存
+  fstream file;
+  string path;
+  struct snap_header h;
+  vector<char> zmap;
+  // 块保存在快照文件中的第几项，没有保存时为-1，只会由-1变为保存的位置
+  unique_ptr<atomic<int>[]> slot;
+  int records;
+  atomic<int> mounted{0};  // 1为已挂载，-1为正在删除
+};
+/*以原卷的设备号为下标*/
+static atomic<snapshot*> snaps[NR_SUPER];
+/*创建与删除快照时持有*/
+static level_mutex snap_lock(LOCK_MOUNT);
+
+static inline streamoff record_offset(snapshot* s, int k) {
+  return sizeof(s->h) + s->h.map_bytes +
+         (streamoff)k * (sizeof(int) + s->h.blocksize);
+}
+
+/*block是否属于快照*/
+static inline int frozen(snapshot* s, int block) {
+  if (block < 0 || block >= s->h.nzones) return 0;
+  if (block < s->h.firstdatazone) return 1;
+  return get_bit(block - (s->h.firstdatazone - 1), s->zmap.data());
+}
+
+static snapshot* new_snapshot(const string& path, const snap_header& h) {
+  auto s = new snapshot;
+  s->path = path;
+  s->h = h;
+  s->zmap.resize(h.map_bytes);
+  s->slot.reset(new atomic<int>[h.nzones]);
+  for (int i = 0; i < h.nzones; i++) s->slot[i].store(-1);
+  s->records = 0;
+  return s;
+}
+
+/*摘下设备的快照，等没有线程在使用后释放*/
+static void drop(int dev) {
+  snapshot* s = snaps[dev].exchange(NULL);
+  unsigned long stamp = epoch_stamp();
+
+  if (!s) return;
+  while (!epoch_reclaimable(stamp)) this_thread::yield();
+  delete s;
+}
+
+/*
+ * @brief 为设备dev上的卷创建快照
+ * 创建时正在进行的修改可能只有一部分包含在快照中，
+ * 最好在没有其他会话修改该卷时创建
+ * @return 成功返回0，已经有快照返回-EEXIST
+ */
+int snapshot_create(int dev) {
+  struct super_block* sb;
+  struct snap_header h = {SNAP_MAGIC, 0, 0, 0, 0};
+  snapshot* s;
+  string path;
+  int i;
+
+  lock_guard<level_mutex> g(snap_lock);
+  if (!(sb = get_super(dev))) return -EINVAL;
+  if (sb->s_rd_only) return -EROFS;
+  if (snaps[dev].load()) return -EEXIST;
+  // 快照为写回之后磁盘上的内容
+  realse_inode_table();
+  sync_blocks();
+  h.blocksize = sb->s_blocksize;
+  h.firstdatazone = sb->s_firstdatazone;
+  h.nzones = sb->s_nzones;
+  h.map_bytes = sb->s_zmap_blocks * sb->s_blocksize;
+  path = dev_path(dev) + ".snap";
+  s = new_snapshot(path, h);
+  for (i = 0; i < sb->s_zmap_blocks; i++)
+    disk_read(dev, 2 + sb->s_imap_blocks + i, &s->zmap[i * h.blocksize]);
+  {
+    ofstream f(path, ios::binary | ios::trunc);
+    f.write((char*)&h, sizeof(h));
+    f.write(s->zmap.data(), h.map_bytes);
+    if (!f) {
+      delete s;
+      return -EIO;
+    }
+  }
+  s->file.open(path, ios::binary | ios::in | ios::out);
+  snaps[dev].store(s, memory_order_release);
+  return 0;
+}
+
+/*
+ * @brief 删除设备dev上的卷的快照
+ * @return 成功返回0，没有快照返回-ENOENT，快照已挂载返回-EBUSY
+ */
+int snapshot_delete(int dev) {
+  snapshot* s;
+  int zero = 0;
+  string path;
+
+  lock_guard<level_mutex> g(snap_lock);
+  if (!(s = snaps[dev].load())) return -ENOENT;
+  if (!s->mounted.compare_exchange_strong(zero, -1)) return -EBUSY;
+  path = s->path;
+  drop(dev);
+  remove(path.c_str());
+  return 0;
+}
+
+/*打开设备时调用，映像文件path有快照文件时读入*/
+void snap_load(int dev, const string& path) {
+  struct snap_header h;
+  snapshot* s;
+  streamoff size;
+  int k, n, block;
+
+  ifstream f(path + ".snap", ios::binary);
+  if (!f.read((char*)&h, sizeof(h)) ||
+      memcmp(h.magic, SNAP_MAGIC, sizeof(h.magic)) || h.nzones <= 0 ||
+      h.blocksize > MAX_BLOCK_SIZE || h.map_bytes < 0)
+    return;
+  s = new_snapshot(path + ".snap", h);
+  if (!f.read(s->zmap.data(), h.map_bytes)) {
+    delete s;
+    return;
+  }
+  // 最后一项可能没有写完整，不计入
+  f.seekg(0, ios::end);
+  size = f.tellg();
+  n = (size - record_offset(s, 0)) / (sizeof(int) + h.blocksize);
+  for (k = 0; k < n; k++) {
+    f.seekg(record_offset(s, k));
+    if (!f.read((char*)&block, sizeof(block))) break;
+    if (block >= 0 && block < h.nzones) s->slot[block].store(k);
+  }
+  s->records = k;
+  f.close();
+  s->file.open(s->path, ios::binary | ios::in | ios::out);
+  snaps[dev].store(s, memory_order_release);
+}
+
+/*关闭设备时调用，快照文件保留，下次打开时继续使用*/
+void snap_close(int dev) { drop(dev); }
+
+/*
+ * @brief 挂载快照文件path时调用
+ * @return path是已打开的某个设备的快照文件时返回该设备号，否则返回-1
+ */
+int snap_attach(const char* path) {
+  snapshot* s;
+  int zero = 0;
+
+  epoch_guard g;
+  for (int dev = 0; dev < NR_SUPER; dev++) {
+    if (!(s = snaps[dev].load()) || s->path != path) continue;
+    // 同时只能挂载一次，块大小必须与原卷一致
+    if (s->h.blocksize != get_blocksize(dev) ||
+        !s->mounted.compare_exchange_strong(zero, 1))
+      return -1;
+    return dev;
+  }
+  return -1;
+}
+void snap_detach(int dev) {
+  epoch_guard g;
+  snapshot* s = snaps[dev].load();
+  if (s) s->mounted.store(0);
+}
+/*设备dev上的卷的快照是否已挂载*/
+int snap_mounted(int dev) {
+  epoch_guard g;
+  snapshot* s = snaps[dev].load();
+  return s && s->mounted.load() > 0;
+}
+
+/*
+把block在磁盘上的原内容保存到快照文件中，调用者需持有快照的锁
+写入快照文件失败时返回-EIO，该块仍算作没有保存
+*/
+static int preserve(snapshot* s, int dev, int block) {
+  vector<char> data(s->h.blocksize);
+
+  disk_read(dev, block, data.data());
+  s->file.clear();
+  s->file.seekp(record_offset(s, s->records));
+  s->file.write((char*)&block, sizeof(block));
+  s->file.write(data.data(), s->h.blocksize);
+  // 原卷上的块覆盖之前，保存的内容必须已经写入快照文件
+  s->file.flush();
+  if (!s->file) return -EIO;
+  s->slot[block].store(s->records++, memory_order_release);
+  return 0;
+}
+
+/*
+ * @brief 原卷写block之前调用(见bwrite)，block属于快照且还未保存时先保存
+ * @return 成功返回0，保存失败返回-EIO，这时不能覆盖原卷上的block
+ */
+int snap_before_write(int dev, int block) {
+  snapshot* s;
+
+  if (!snaps[dev].load(memory_order_relaxed)) return 0;
+  epoch_guard g;
+  if (!(s = snaps[dev].load(memory_order_acquire)) || !frozen(s, block) ||
+      s->slot[block].load(memory_order_acquire) >= 0)
+    return 0;
+  lock_guard<level_mutex> l(s->lock);
+  if (s->slot[block].load(memory_order_relaxed) < 0)
+    return preserve(s, dev, block);
+  return 0;
+}
+
+/*
+读取设备dev上的卷的快照中的block，已保存的从快照文件读，否则直接读原卷，
+持有快照的锁，读取期间原卷不会覆盖该块，快照已不存在时读出的全为0
+*/
+void snap_read(int dev, int block, char* data) {
+  snapshot* s;
+  int k;
+
+  epoch_guard g;
+  if (!(s = snaps[dev].load(memory_order_acquire))) {
+    memset(data, 0, get_blocksize(dev));
+    return;
+  }
+  lock_guard<level_mutex> l(s->lock);
+  if (block < 0 || block >= s->h.nzones || (k = s->slot[block].load()) < 0) {
+    disk_read(dev, block, data);
+    return;
+  }
+  s->file.clear();
+  s->file.seekg(record_offset(s, k) + (streamoff)sizeof(int));
+  s->file.read(data, s->h.blocksize);
+}
+
+/*快照已保存的块数，没有快照时返回-1*/
+int snap_saved(int dev) {
+  snapshot* s;
+  epoch_guard g;
+  if (!(s = snaps[dev].load(memory_order_acquire))) return -1;
+  lock_guard<level_mutex> l(s->lock);
+  return s->records;
+}
@@ -1,19 +1,71 @@
 #include <iostream>
 #include <algorithm>
 #include "fs.h"
+#include "lock.h"
 #include <cassert>
 using namespace std;
 
+/*
+每个设备一个超级块，设备号即下标，0为根设备
+读取sb不加锁：卷在超级块读入之后才会被挂载，
+卸载时先确认没有人在使用该卷再释放超级块
+*/
 static super_block* sb[NR_SUPER];
+/*挂载与卸载互相排斥*/
+static level_mutex mount_lock(LOCK_MOUNT);
+
 struct super_block* get_super(int dev) {
-  return sb[0];
+  if (dev < 0 || dev >= NR_SUPER) return NULL;
+  return sb[dev];
+}
+
+/*根据磁盘上超级块的格式，填充内存中超级块，size为读取时假定的块大小*/
+static int fill_super(struct super_block* s, char* data, int size) {
+  auto d1 = (struct d_super_block*)data;
+  auto d2 = (struct d_super_block2*)data;
+
+  if (d1->s_magic == SUPER_MAGIC) {
+    s->s_ninodes = d1->s_ninodes;
+    s->s_nzones = d1->s_nzones;
+    s->s_imap_blocks = d1->s_imap_blocks;
+    s->s_zmap_blocks = d1->s_zmap_blocks;
+    s->s_firstdatazone = d1->s_firstdatazone;
+    s->s_log_zone_size = d1->s_log_zone_size;
+    s->s_max_size = d1->s_max_size;
+    s->s_magic = d1->s_magic;
+    s->s_version = 1;
+    s->s_inodes_per_block = INODES_PER_BLOCK(size);
+    s->s_zones_per_block = size / sizeof(unsigned short);
+  } else if (d2->s_magic == SUPER_MAGIC_V2) {
+    s->s_ninodes = d2->s_ninodes;
+    s->s_nzones = d2->s_nzones;
+    s->s_imap_blocks = d2->s_imap_blocks;
+    s->s_zmap_blocks = d2->s_zmap_blocks;
+    s->s_firstdatazone = d2->s_firstdatazone;
+    s->s_log_zone_size = d2->s_log_zone_size;
+    s->s_max_size = d2->s_max_size;
+    s->s_magic = d2->s_magic;
+    s->s_version = 2;
+    s->s_inodes_per_block = INODES_PER_BLOCK_V2(size);
+    s->s_zones_per_block = size / sizeof(unsigned int);
+  } else {
+    return 0;
+  }
+  /*超级块记录的块大小必须与读取时假定的一致*/
+  if (s->s_log_zone_size > 3 || (BLOCK_SIZE << s->s_log_zone_size) != size)
+    return 0;
+  s->s_blocksize = size;
+  if (s->s_imap_blocks > I_MAP_SLOTS || s->s_zmap_blocks > Z_MAP_SLOTS)
+    return 0;
+  return 1;
 }
 
 /*读入超级块信息*/
 static struct super_block* read_super(int dev) {
+  static const int blocksizes[] = {1024, 4096, 8192};
   auto s = new super_block;
   buffer_head* bh;
-  int i, block;
+  int i = 0, k, block;
 
   s->s_dev = dev;
   s->s_isup = NULL;
@@ -21,33 +73,51 @@ static struct super_block* read_super(int dev) {
   s->s_time = 0;
   s->s_rd_only = 0;
   s->s_dirt = 0;
-  bh = bread(1);
-  *((struct d_super_block*)s) = *((struct d_super_block*)bh->b_data);
-
-  brelse(bh);
+  /*超级块总在第1块，依次假定1K/4K/8K的块大小去读取，直到格式吻合*/
+  for (k = 0; k < 3; k++) {
+    set_blocksize(dev, blocksizes[k]);
+    if (!(bh = bread(dev, 1))) continue;
+    i = fill_super(s, bh->b_data, blocksizes[k]);
+    brelse(bh);
+    if (i) break;
+  }
 
-  if (s->s_magic != SUPER_MAGIC) {
+  // 每种块大小都读不出或格式不符
+  if (k == 3) {
     s->s_dev = 0;
     // free_super(s);
+    delete s;
     return NULL;
   }
   for (i = 0; i < I_MAP_SLOTS; i++) s->s_imap[i] = NULL;
   for (i = 0; i < Z_MAP_SLOTS; i++) s->s_zmap[i] = NULL;
   block = 2;
   for (i = 0; i < s->s_imap_blocks; i++) {
-    s->s_imap[i] = bread(block);
+    s->s_imap[i] = bread(dev, block);
     block++;
   }
   for (i = 0; i < s->s_zmap_blocks; i++) {
-    s->s_zmap[i] = bread(block);
+    s->s_zmap[i] = bread(dev, block);
     block++;
   }
   s->s_imap[0]->b_data[0] |= 1;
   s->s_zmap[0]->b_data[0] |= 1;
-  sb[0] = s;
+  init_alloc_groups(s);
+  sb[dev] = s;
   return s;
 }
 
+/*释放超级块，之后由dev_close写回并去掉该设备在缓冲区中的block*/
+static void put_super(struct super_block* s) {
+  int i;
+
+  sb[s->s_dev] = NULL;
+  for (i = 0; i < s->s_imap_blocks; i++) brelse(s->s_imap[i]);
+  for (i = 0; i < s->s_zmap_blocks; i++) brelse(s->s_zmap[i]);
+  free_alloc_groups(s);
+  delete s;
+}
+
 void mount_root(void) {
   int i, free;
   struct super_block* p;
@@ -61,60 +131,167 @@ void mount_root(void) {
     return;
   }
   p->s_isup = p->s_imount = mi;
-  fileSystem->root = fileSystem->current = mi;
-  mi->i_count += 2;
-  fileSystem->name = "/";
+  fileSystem->root = mi;
+  mi->i_count += 1;
   free = 0;
-  // bug?
-  i = p->s_nzones + 1;
-  //统计位图信息，给出磁盘上空闲的i节点和逻辑块
-  while (--i >= 0)
-    if (!get_bit(i % BLOCK_BIT, p->s_zmap[i / BLOCK_BIT]->b_data)) free++;
+  //统计位图信息，给出磁盘上空闲的i节点和逻辑块，第0位保留不用
+  for (i = p->s_nzones - p->s_firstdatazone; i > 0; --i)
+    if (!get_bit(i % BLOCK_BITS(p), p->s_zmap[i / BLOCK_BITS(p)]->b_data))
+      free++;
   printf("%d/%d free blocks\n\r", free, p->s_nzones);
   free = 0;
-  i = p->s_ninodes + 1;
-  while (--i >= 0)
-    if (!get_bit(i % BLOCK_BIT, p->s_imap[i / BLOCK_BIT]->b_data)) free++;
+  for (i = p->s_ninodes; i > 0; --i)
+    if (!get_bit(i % BLOCK_BITS(p), p->s_imap[i / BLOCK_BITS(p)]->b_data))
+      free++;
   printf("%d/%d free inodes\n\r", free, p->s_ninodes);
-  printf("system load!\n");
+  printf("v%d filesystem (%dK blocks) load!\n", p->s_version,
+         p->s_blocksize / 1024);
+  if ((i = dev_stripes(ROOT_DEV)) > 1)
+    printf("striped over %d image files\n", i);
+}
+
+/*
+ * @brief 把映像文件image中的卷挂载到目录dir上，之后经过dir进入该卷的根目录
+ * @param dir 挂载点，调用者持有的引用在挂载成功后归超级块所有，卸载时释放
+ * @return 成功返回分配的设备号，失败返回错误码
+ */
+int mount_image(const char* image, struct m_inode* dir) {
+  struct super_block* s;
+  struct m_inode* root;
+  int dev, err;
+
+  if (!S_ISDIR(dir->i_mode)) return -ENOTDIR;
+  lock_guard<level_mutex> g(mount_lock);
+  for (dev = ROOT_DEV + 1; dev < NR_SUPER && sb[dev]; dev++)
+    ;
+  if (dev == NR_SUPER) return -EBUSY;
+  if ((err = dev_open(dev, image)) < 0) return err;
+  if (!(s = read_super(dev))) {
+    dev_close(dev);
+    return -EINVAL;
+  }
+  // 快照只读
+  s->s_rd_only = dev_origin(dev) >= 0;
+  if (!(root = iget(dev, ROOT_INO))) {
+    put_super(s);
+    dev_close(dev);
+    return -ENOMEM;
+  }
+  s->s_isup = root;
+  // 标记挂载点，此时才能经过路径访问到该卷
+  if ((err = mount_inode(dir, s)) < 0) {
+    umount_inodes(dev);
+    put_super(s);
+    dev_close(dev);
+    return err;
+  }
+  return dev;
 }
-void initialize_block(int dev) {
+
+/*
+ * @brief 卸载设备dev上的卷
+ * @return 成功返回0，卷中还有文件被打开或作为工作目录时返回-EBUSY
+ */
+int umount_dev(int dev) {
+  struct super_block* s;
+  struct m_inode* mnt;
+  int err;
+
+  lock_guard<level_mutex> g(mount_lock);
+  if (dev == ROOT_DEV || !(s = get_super(dev)) || !s->s_imount)
+    return -EINVAL;
+  mnt = s->s_imount;
+  // 卷的快照还挂载着时不能卸载
+  if (snap_mounted(dev)) return -EBUSY;
+  // 检查并取消挂载点的标记，之后不会再有人访问到该卷
+  if ((err = umount_inodes(dev)) < 0) return err;
+  iput(mnt);
+  put_super(s);
+  dev_close(dev);
+  return 0;
+}
+
+/*inode所在的卷是否只读(快照)*/
+int is_rdonly(struct m_inode* inode) {
+  struct super_block* s = get_super(inode->i_dev);
+  return s && s->s_rd_only;
+}
+
+/*格式化磁盘，version为磁盘格式(1或2)，nzones为0时使用默认大小，
+  blocksize为1024/4096/8192之一，stripes为组成条带卷的映像文件数*/
+void initialize_block(int dev, int version, unsigned int nzones,
+                      int blocksize, int stripes) {
+  unsigned int ninodes, imap_blocks, zmap_blocks, itable_blocks, ipb, zpb;
+  unsigned int bits, log_size;
+  unsigned long long max_size;
+
+  if (version != 1) version = 2;
+  if (blocksize != 4096 && blocksize != 8192) blocksize = BLOCK_SIZE;
+  if (stripes < 1 || stripes > MAX_STRIPES) stripes = 1;
+  for (log_size = 0; (BLOCK_SIZE << log_size) != blocksize; log_size++)
+    ;
+  bits = blocksize * 8;
+  if (!nzones) nzones = (version == 1) ? 62000 : 262144;
+  if (version == 1 && nzones > 65535) nzones = 65535;
+  if (nzones > Z_MAP_SLOTS * bits) nzones = Z_MAP_SLOTS * bits;
+  ninodes = std::min(nzones / 3, (unsigned int)MAX_DIR_INODE);
+  ipb = (version == 1) ? INODES_PER_BLOCK(blocksize)
+                       : INODES_PER_BLOCK_V2(blocksize);
+  zpb = blocksize / ((version == 1) ? sizeof(unsigned short)
+                                    : sizeof(unsigned int));
+  imap_blocks = (ninodes + bits) / bits;
+  zmap_blocks = (nzones + bits - 1) / bits;
+  itable_blocks = (ninodes + ipb - 1) / ipb;
+  assert(imap_blocks <= I_MAP_SLOTS && zmap_blocks <= Z_MAP_SLOTS);
+  max_size = NR_DIRECT + zpb + zpb * zpb;
+  if (version == 2) max_size += 1ull * zpb * zpb * zpb;
+  max_size = std::min(max_size * blocksize, 0xFFFFFFFFull);
+
   realse_inode_table();
   realse_all_blocks();
-  auto ds = new d_super_block;
-  memset(ds, 0, sizeof(d_super_block));
-  ds->s_imap_blocks = 3; // <= I_MAP_SLOTS;
-  ds->s_zmap_blocks = 8; // <= Z_MAP_SLOTS;
-  ds->s_magic = SUPER_MAGIC;
-  ds->s_firstdatazone = 659;
-  ds->s_nzones = 62000;
-  ds->s_ninodes = 20666;
-  // ds->s_nzones = (1<<16) - ds->s_firstdatazone;
-  // ds->s_ninodes = (ds->s_firstdatazone - 2 - ds->s_imap_blocks - ds->s_zmap_blocks) * INODES_PER_BLOCK;
-  ds->s_max_size = 268966912;
-  // ds->s_max_size = std::min(0ull + ds->s_nzones * BLOCK_SIZE, 0ull + BLOCK_SIZE * (7 + 512 + 512 * 512));
-  ds->s_log_zone_size = 0;
-  assert(ds->s_imap_blocks * 8 * BLOCK_SIZE >= ds->s_ninodes);
-  assert(ds->s_zmap_blocks * 8 * BLOCK_SIZE >= ds->s_nzones);
-  // 可能是要先创建inode再设置super
-  // ds->s_firstdatazone = 2 + ds->s_imap_blocks + ds->s_zmap_blocks + ds->s_ninodes;
-  // 写map
-  int block = 2, i;
+  set_blocksize(dev, blocksize);
+  /*重新建立(清空)映像文件，避免以其他块大小格式化时残留的超级块被误识别*/
+  dev_create(dev, stripes);
   auto buffer = new buffer_block;
   memset(buffer, 0, sizeof(buffer_block));
-  for (i = 0; i < ds->s_imap_blocks; i++) {
-    if (i == 0) buffer[0] = 2;
-    bwrite(block, buffer);
+  if (version == 1) {
+    auto ds = (struct d_super_block*)buffer;
+    ds->s_ninodes = ninodes;
+    ds->s_nzones = nzones;
+    ds->s_imap_blocks = imap_blocks;
+    ds->s_zmap_blocks = zmap_blocks;
+    ds->s_firstdatazone = 2 + imap_blocks + zmap_blocks + itable_blocks;
+    ds->s_log_zone_size = log_size;
+    ds->s_max_size = max_size;
+    ds->s_magic = SUPER_MAGIC;
+  } else {
+    auto ds = (struct d_super_block2*)buffer;
+    ds->s_ninodes = ninodes;
+    ds->s_nzones = nzones;
+    ds->s_imap_blocks = imap_blocks;
+    ds->s_zmap_blocks = zmap_blocks;
+    ds->s_firstdatazone = 2 + imap_blocks + zmap_blocks + itable_blocks;
+    ds->s_log_zone_size = log_size;
+    ds->s_max_size = max_size;
+    ds->s_magic = SUPER_MAGIC_V2;
+  }
+  bwrite(dev, 1, buffer);
+  // 写map，第0位保留，根目录的inode与数据块由下面的new_inode、new_block分配
+  unsigned int block = 2, i;
+  memset(buffer, 0, sizeof(buffer_block));
+  for (i = 0; i < imap_blocks; i++) {
+    if (i == 0) buffer[0] = 1;
+    bwrite(dev, block, buffer);
     if (i == 0) buffer[0] = 0;
     block++;
   }
-  for (i = 0; i < ds->s_zmap_blocks; i++) {
-    if (i == 0) buffer[0] = 2;
-    bwrite(block, buffer);
+  for (i = 0; i < zmap_blocks; i++) {
+    if (i == 0) buffer[0] = 1;
+    bwrite(dev, block, buffer);
     if (i == 0) buffer[0] = 0;
     block++;
   }
-  bwrite(1, (char*)ds);
+  delete[] buffer;
   read_super(dev);
   auto inode = new_inode(dev);
 
@@ -125,7 +302,7 @@ void initialize_block(int dev) {
   inode->i_mtime = inode->i_atime = CurrentTime();
   inode->i_zone[0] = new_block(inode->i_dev);
   // printf("inode data block: %d\n", inode->i_zone[0]);
-  buffer_head* data = bread(inode->i_zone[0]);
+  buffer_head* data = bread(dev, inode->i_zone[0]);
   auto de = (struct dir_entry*)data->b_data;
   /*加入. 和 .. 两个子目录*/
   de->inode = inode->i_num;
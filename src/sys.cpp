@@ -1,13 +1,30 @@
+#include <chrono>
 #include <cmath>
 #include <cstdio>
 #include <iostream>
+#include <numeric>
 #include <string>
+#include <thread>
+#include <vector>
 
 #include "fs.h"
+#include "sys.h"
 // #include<Windows.h>
 #include "printfc.h"
 using namespace std;
 
+#define MIN(a, b) (((a) < (b)) ? (a) : (b))
+/*ls每次从目录中读取的最大项数*/
+#define LS_BATCH 16384
+/*stress中每个线程使用的文件个数与每次读写的字节数*/
+#define STRESS_FILES 32
+#define STRESS_IO 512
+/*stress中只读测试的文件块数，要能全部放在缓冲区中*/
+#define STRESS_READ_BLOCKS 256
+/*stress中每个线程并行写入的文件大小*/
+#define STRESS_DD_CHUNK 16384
+#define STRESS_DD_CHUNKS 64
+
 static string GetFileSize(long size) {
   float num = 1024.00;  // byte
   if (size < num) return to_string(size) + "B";
@@ -39,23 +56,25 @@ static string GetFileMode(long mode) {
  * @param mode 文件类型
  * @return 文件描述符
  */
-int sys_open(string filename, int flag, int mode) {
+int sys_open(const string& filename, int flag, int mode) {
   struct m_inode* inode;
-  struct file* f;
-  int i, fd;
+  int i;
 
-  for (fd = 0; fd < NR_OPEN; fd++) {
-    if (!fileSystem->filp[fd]) break;
-  }
+  if ((i = open_file(filename.c_str(), flag, mode, inode)) < 0) return i;
+  return fd_install(inode, flag, mode);
+}
 
-  // 如果已打开文件个数超过上限，则出错
-  if (fd >= NR_OPEN) return -EINVAL;
-  f = fileSystem->filp[fd] = new file;
-  if ((i = open_file(filename.c_str(), flag, mode, inode)) < 0) {
-    fileSystem->filp[fd] = NULL;
-    delete f;
-    return i;
+/*把打开的文件放入当前会话的文件描述符表，返回文件描述符*/
+int fd_install(struct m_inode* inode, int flag, int mode) {
+  struct file* f;
+  int fd;
+
+  // 取最小的空闲描述符，没有时文件描述符表增长一项
+  for (fd = 0; fd < (int)current->filp.size(); fd++) {
+    if (!current->filp[fd]) break;
   }
+  if (fd == (int)current->filp.size()) current->filp.push_back(NULL);
+  f = current->filp[fd] = new file;
   f->f_mode = mode;
   f->f_flags = flag;
   f->f_count = 1;
@@ -64,21 +83,53 @@ int sys_open(string filename, int flag, int mode) {
   return (fd);
 }
 
+/*当前会话中fd对应的打开文件，fd无效时返回NULL*/
+struct file* get_file(unsigned int fd) {
+  return fd < current->filp.size() ? current->filp[fd] : NULL;
+}
+
 /*
  * @brief 通过文件描述符关闭文件
  */
 int sys_close(unsigned int fd) {
   struct file* filp;
 
-  if (fd >= NR_OPEN) return -EINVAL;
-  if (!(filp = fileSystem->filp[fd])) return -EINVAL;
+  if (!(filp = get_file(fd))) return -EINVAL;
   if (--filp->f_count) return (0);
   iput(filp->f_inode);
   delete filp;
-  fileSystem->filp[fd] = NULL;
+  current->filp[fd] = NULL;
   return (0);
 }
 
+/*
+ * @brief 修改文件描述符的读写位置
+ * @param origin 0为从文件开头，1为从当前位置，2为从文件末尾
+ * @return 新的读写位置
+ */
+int sys_lseek(unsigned int fd, off_t offset, int origin) {
+  struct file* file;
+  off_t pos;
+
+  if (!(file = get_file(fd))) return -EINVAL;
+  switch (origin) {
+    case 0:
+      pos = offset;
+      break;
+    case 1:
+      pos = file->f_pos + offset;
+      break;
+    case 2:
+      pos = file->f_inode->i_size + offset;
+      break;
+    default:
+      return -EINVAL;
+  }
+  if (pos < 0) return -EINVAL;
+  file->f_pos = pos;
+  return pos;
+}
+
 /*
  * @brief 通过文件描述符读取指定长度到buf中
  */
@@ -87,7 +138,7 @@ int sys_read(unsigned int fd, char* buf, int count) {
   struct m_inode* inode;  // i节点结构体指针，用于表示文件的元数据信息
 
   // 检查文件描述符的有效性，读取长度是否合法，以及文件结构体是否存在
-  if (fd >= NR_OPEN || count < 0 || !(file = fileSystem->filp[fd]))
+  if (count < 0 || !(file = get_file(fd)))
     return -EINVAL;
 
   // 如果读取长度为0，直接返回0表示已经读取完文件
@@ -106,8 +157,11 @@ int sys_read(unsigned int fd, char* buf, int count) {
     // 如果调整后的读取长度小于等于0，表示已经读取完文件，直接返回0
     if (count <= 0) return 0;
 
-    // 调用文件读取函数，实际读取文件内容到缓冲区
-    return file_read(inode, file, buf, count);
+    // 调用文件读取函数，实际读取文件内容到缓冲区，读取期间持有读锁
+    lock_inode_shared(inode);
+    count = file_read(inode, file, buf, count);
+    unlock_inode_shared(inode);
+    return count;
   }
 
   // 如果文件类型不是目录或普通文件，输出错误信息并返回错误码
@@ -123,118 +177,134 @@ int sys_write(unsigned int fd, char* buf, int count) {
   struct file* file;
   struct m_inode* inode;
 
-  if (fd >= NR_OPEN || count < 0 || !(file = fileSystem->filp[fd]))
+  if (count < 0 || !(file = get_file(fd)))
     return -EINVAL;
   if (!count) return 0;
   inode = file->f_inode;
   /*只允许写普通文件*/
-  if (S_ISREG(inode->i_mode)) return file_write(inode, file, buf, count);
+  if (S_ISREG(inode->i_mode)) {
+    lock_inode(inode);
+    count = file_write(inode, file, buf, count);
+    unlock_inode(inode);
+    return count;
+  }
   printf("(Write)inode->i_mode=%06o\n\r", inode->i_mode);
   return -EINVAL;
 }
 
 /*
  * @brief 获取给定i节点所对应文件的工作目录路径
+ * 沿着路径查找时记下的父目录回溯到根，只有未记下时才需要查找父目录
  * @param[in] inode 指向文件i节点的指针
  * @param[out] out 存储工作目录路径的字符串
  * @return 0 表示成功，-1 表示失败
  */
 int sys_get_work_dir(struct m_inode* inode, string& out) {
-  int inum = inode->i_num;
-
   // 如果给定i节点是根目录的i节点，设置输出路径为"/"表示根目录，并返回成功
-  if (inum == fileSystem->root->i_num) {
+  if (inode == fileSystem->root) {
     out = "/";
     return 0;
   }
 
   // 初始化输出字符串为空
   out = "";
-  char name[20];
+  char name[LONG_NAME_LEN + 1];
   struct m_inode* fa;
-  inode->i_count++;  // 之后会iput一次
+  igrab(inode);  // 之后会iput一次
 
   // 循环直到回溯到根目录的i节点
-  while (inode->i_num != fileSystem->root->i_num) {
-    // 获取当前i节点的文件名
-    if (!get_name(inode, name, 20)) {
+  while (inode != fileSystem->root) {
+    // 获取当前i节点的文件名与父目录i节点
+    if (get_name(inode, name, sizeof(name)) < 0 || !(fa = get_father(inode))) {
+      iput(inode);
       return -1;
     }
 
-    // 将文件名转为字符串，并在前面添加"/"
-    string s(&name[0], &name[strlen(name)]);
-    s.insert(0, "/");
-    
-    // 将当前文件名添加到输出路径的前面
-    out.insert(0, s);
-
-    // 获取当前i节点的父目录i节点
-    if (!(fa = get_father(inode))) {
-      return -1;
-    };
-
-    // 将当前i节点引用计数加1，因为后面会调用iput释放引用
-    inode->i_count++;
+    // 将文件名添加到输出路径的前面
+    out.insert(0, "/" + string(name));
 
     // 释放当前i节点的引用，切换到父目录i节点
     iput(inode);
     inode = fa;
   }
+  iput(inode);
 
   return 0;
 }
 
+/*按路径的字面含义修改工作目录路径，cwd为绝对路径，处理其中的 . 和 ..*/
+static void join_work_dir(string& cwd, const string& path) {
+  size_t start = 0, end;
+  if (!path.empty() && path[0] == '/') cwd = "/";
+  while (start <= path.size()) {
+    end = path.find('/', start);
+    if (end == string::npos) end = path.size();
+    string part = path.substr(start, end - start);
+    start = end + 1;
+    if (part.empty() || part == ".") continue;
+    if (part == "..") {
+      // 根目录的上一层仍然是根目录
+      size_t p = cwd.rfind('/');
+      cwd.erase(p ? p : 1);
+    } else {
+      if (cwd != "/") cwd += "/";
+      cwd += part.substr(0, LONG_NAME_LEN);
+    }
+  }
+}
+
+/*
+ * @brief 从目录的第*pos项开始读取最多count个目录项及其属性(不含 . 和 ..)
+ * 这一批目录项所指的inode按编号排序后批量读取，每个inode块只读取一次
+ * @param[in] dir 目录的i节点
+ * @param[in,out] pos 目录项的位置，从0开始，返回时指向下一次读取的位置
+ * @param[out] out 存放结果的数组
+ * @param[in] count out的容量
+ * @return 读取到的目录项个数，0表示目录已经读完，负数表示错误码
+ */
+int sys_getdents_plus(struct m_inode* dir, int* pos, struct dirent_plus* out,
+                      int count) {
+  struct dir_entry* de;
+  struct dir_iter it;
+  int n = 0;
+
+  if (!S_ISDIR(dir->i_mode)) return -ENOTDIR;
+  lock_inode_shared(dir);
+  dir_iter_init(&it, dir, *pos);
+  while (n < count && (de = dir_iter_next(&it))) {
+    if (DE_IS_CONT(de) || !strcmp(de->name, ".") || !strcmp(de->name, ".."))
+      continue;
+    out[n].d_ino = de->inode;
+    dir_entry_name(de, out[n].d_name);
+    n++;
+  }
+  *pos = dir_iter_pos(&it);
+  dir_iter_end(&it);
+  unlock_inode_shared(dir);
+  if (n) stat_inodes(dir->i_dev, out, n);
+  return n;
+}
 
 // ls命令 显示当前目录下所有文件
-int cmd_ls(string s) {
+int cmd_ls(const string& s) {
   bool flag = false;  // 标记是否已输出表头信息
-  int entries;  // 目录中的目录项总数
-  int block, i;  // 当前目录项所在块号和计数器
-  string out = "";
-  struct buffer_head* bh;  // 缓冲区头指针，用于读取文件块数据
-  struct dir_entry* de;  // 目录项结构体指针，表示目录中的一个文件或子目录
-  struct m_inode* dir =
-      ((s == "" || s == "-l") ? fileSystem->current : get_inode(s.c_str()));  // 获取当前目录的i节点
+  // 给出路径时由get_inode取得目录，用完后要iput；否则使用当前目录
+  bool lookup = !(s == "" || s == "-l");
+  int pos = 0, n, k, count = 0, batch;
+  struct m_inode* dir = lookup ? get_inode(s.c_str()) : current->pwd;
 
   // 如果目录不存在，返回目录不存在的错误码
   if (!dir) {
     return -ENOENT;
   }
 
-  // 计算目录中的目录项总数
-  entries = dir->i_size / (sizeof(struct dir_entry));
-
-  // 获取目录的第一个数据块
-  block = dir->i_zone[0];
-  if (block <= 0) {
-    return -EPERM;
-  }
-
-  int count = 0;
-  // 读取目录项所在块的数据
-  bh = bread(block);
-  i = 0;
-  de = (struct dir_entry*)bh->b_data;
-
-  // 遍历目录中的所有目录项
-  while (i < entries) {
-    // 如果一个目录块读取完毕，则切换到下一个目录块
-    if ((char*)de >= BLOCK_SIZE + bh->b_data) {
-      brelse(bh);
-      block = bmap(dir, i / DIR_ENTRIES_PER_BLOCK);
-      bh = bread(block);
-      
-      // 如果下一个目录项读取失败，则跳过该目录
-      if (bh == NULL || block <= 0) {
-        i += DIR_ENTRIES_PER_BLOCK;
-        continue;
-      } else
-        de = (struct dir_entry*)bh->b_data;
-    }
-    
-    // 如果当前目录项不是".."、"."且对应的i节点存在
-    if (strcmp(de->name, "..") && strcmp(de->name, ".") && de->inode != 0) {
-      m_inode* inode = iget(0, de->inode);
+  // 按批读取目录项及其属性，不必为每一项调用iget
+  // 一批越大，同一inode块被重复读取的次数越少，一般的目录一批就能读完
+  batch = MIN(dir->i_size / sizeof(struct dir_entry) + 1, LS_BATCH);
+  vector<struct dirent_plus> ents(batch);
+  while ((n = sys_getdents_plus(dir, &pos, ents.data(), batch)) > 0) {
+    for (k = 0; k < n; k++) {
+      struct dirent_plus* de = &ents[k];
 
       // 如果需要显示详细信息（-l选项）
       if (s == "-l") {
@@ -246,32 +316,28 @@ int cmd_ls(string s) {
         }
 
         // 输出详细信息，包括文件模式、文件大小、文件名和最后修改时间
-        printf("%10s %13s ", GetFileMode(inode->i_mode).c_str(),
-               GetFileSize(inode->i_size).c_str());
-        if (S_ISDIR(inode->i_mode)) {
-          printfc(FG_BLACK, BG_GREEN, "%14s", de->name);
+        printf("%10s %13s ", GetFileMode(de->d_mode).c_str(),
+               GetFileSize(de->d_size).c_str());
+        if (S_ISDIR(de->d_mode)) {
+          printfc(FG_BLACK, BG_GREEN, "%14s", de->d_name);
         } else {
-          printfc(FG_WHITE, "%14s", de->name);
+          printfc(FG_WHITE, "%14s", de->d_name);
         }
-        printf(" %35s", longtoTime(inode->i_mtime));
+        printf(" %35s", longtoTime(de->d_mtime));
       } else {
         // 如果不需要显示详细信息，只输出文件名或目录名
-        if (S_ISDIR(inode->i_mode))
-          pdirc(de->name);
+        if (S_ISDIR(de->d_mode))
+          pdirc(de->d_name);
         else
-          pfilec(de->name);
+          pfilec(de->d_name);
         printf("  ");
       }
 
       count++;
-      iput(inode);  // 释放i节点
     }
-    de++;
-    i++;
   }
-
-  // 释放缓冲区头
-  brelse(bh);
+  if (lookup) iput(dir);
+  if (n < 0) return n;
 
   // 如果目录为空，输出提示信息
   if (count <= 0) {
@@ -284,7 +350,7 @@ int cmd_ls(string s) {
 
 
 // stat命令，显示文件详细信息
-int cmd_stat(string path) {
+int cmd_stat(const string& path) {
   const char* basename;
   int namelen;
   struct m_inode *dir, *inode;
@@ -300,17 +366,21 @@ int cmd_stat(string path) {
     return -ENOENT;
   }
 
+  // 查找期间持有父目录的读锁
+  lock_inode_shared(dir);
   // 查找目录项并获取相应的目录块
   bh = find_entry(&dir, basename, namelen, &de);
 
   // 如果目录项查找失败，释放目录i节点并返回错误码
   if (!bh) {
+    unlock_inode_shared(dir);
     iput(dir);
     return -ENOENT;
   }
 
   // 获取文件对应的i节点
   if (!(inode = iget(dir->i_dev, de->inode))) {
+    unlock_inode_shared(dir);
     iput(dir);
     brelse(bh);
     return -EPERM;
@@ -323,30 +393,41 @@ int cmd_stat(string path) {
   cout << "mode: " << GetFileMode(inode->i_mode) << endl;
   cout << "nlinks: " << to_string(inode->i_nlinks) << endl;
   cout << "num: " << inode->i_num << endl;
-  cout << "firstzone: " << inode->i_zone[0] << endl;
+  if (inode->i_flags & I_INLINE)
+    cout << "firstzone: inline" << endl;
+  else
+    cout << "firstzone: " << inode->i_zone[0] << endl;
   cout << "size: " << GetFileSize(inode->i_size) << endl;
   // cout << "最后访问时间: " << longtoTime(inode->i_atime) << endl;
   cout << "最后修改时间: " << longtoTime(inode->i_mtime) << endl;
   // cout << "i节点自身最终被修改时间: " << longtoTime(inode->i_ctime) << endl;
 
+  iput(inode);
+  unlock_inode_shared(dir);
+  iput(dir);
+  brelse(bh);
   return 0;
 }
 
 
 // cd命令，移动工作目录
-int cmd_cd(string path) {
+int cmd_cd(const string& path) {
   struct m_inode* dir = NULL;
 
   // 获取目标目录的i节点
   if ((dir = get_inode(path.c_str()))) {
+    if (!S_ISDIR(dir->i_mode)) {
+      iput(dir);
+      return -ENOTDIR;
+    }
     // 释放当前工作目录的i节点
-    iput(fileSystem->current);
+    iput(current->pwd);
     
     // 将当前工作目录设置为目标目录
-    fileSystem->current = dir;
+    current->pwd = dir;
 
-    // 更新文件系统中的当前工作目录路径
-    sys_get_work_dir(dir, fileSystem->name);
+    // 更新会话的当前工作目录路径，路径中没有链接，按字面计算即可
+    join_work_dir(current->name, path);
   } else {
     return -ENOENT;  // 如果目标目录不存在，返回错误码
   }
@@ -354,23 +435,14 @@ int cmd_cd(string path) {
   return 0;  // 返回0表示cd命令执行成功
 }
 
-// pwd命令，输出当前路径名
+// pwd命令，输出当前路径名，cd时已经记下，不需要访问磁盘
 int cmd_pwd() {
-  struct m_inode* dir = NULL;  // 目录的i节点指针
-  string pwd = "";  // 存储当前路径名的字符串
-
-  // 调用sys_get_work_dir函数获取当前工作目录的路径
-  if (sys_get_work_dir(fileSystem->current, pwd)) {
-    // 如果成功获取路径，则以颜色输出当前路径名
-    ppathc(pwd);
-    return 0;  // 返回0表示pwd命令执行成功
-  }
-
-  return -EPERM;  // 返回错误码表示获取路径失败
+  ppathc(current->name);
+  return 0;  // 返回0表示pwd命令执行成功
 }
 
 /*cat命令，输出指定文件的所有内容*/
-int cmd_cat(string path) {
+int cmd_cat(const string& path) {
   int fd, size, i;
   struct m_inode* inode;
 
@@ -432,7 +504,7 @@ int cmd_cat(string path) {
 
 
 // vi指令，可以在文件末尾增添内容
-int cmd_vi(string path) {
+int cmd_vi(const string& path) {
   int fd, size, i;
   string in = "";
 
@@ -481,11 +553,23 @@ int cmd_mkdir(const char* pathname, int mode) {
     iput(dir);
     return -ENOENT;
   }
+  // 文件名中不能含有长文件名的标记字节
+  if (!dir_name_valid(basename, namelen)) {
+    iput(dir);
+    return -EINVAL;
+  }
+  if (is_rdonly(dir)) {
+    iput(dir);
+    return -EROFS;
+  }
 
+  // 修改目录期间持有父目录的写锁
+  lock_inode(dir);
   // 判断要创建的目录是否已经存在
   bh = find_entry(&dir, basename, namelen, &de);
   if (bh) {
     brelse(bh);
+    unlock_inode(dir);
     iput(dir);
     return -EEXIST;
   }
@@ -495,6 +579,7 @@ int cmd_mkdir(const char* pathname, int mode) {
 
   // 如果分配i节点失败，释放父目录i节点并返回错误码
   if (!inode) {
+    unlock_inode(dir);
     iput(dir);
     return -ENOSPC;
   }
@@ -506,6 +591,7 @@ int cmd_mkdir(const char* pathname, int mode) {
 
   // 为新目录创建第一个数据块，包含两个子目录项 . 和 ..
   if (!(inode->i_zone[0] = new_block(inode->i_dev))) {
+    unlock_inode(dir);
     iput(dir);
     inode->i_nlinks--;
     iput(inode);
@@ -515,7 +601,8 @@ int cmd_mkdir(const char* pathname, int mode) {
   inode->i_dirt = 1;
 
   // 读取新目录的数据块，准备插入两个子目录项
-  if (!(dir_block = bread(inode->i_zone[0]))) {
+  if (!(dir_block = bread(inode->i_dev, inode->i_zone[0]))) {
+    unlock_inode(dir);
     iput(dir);
     free_block(inode->i_dev, inode->i_zone[0]);
     inode->i_nlinks--;
@@ -546,6 +633,7 @@ int cmd_mkdir(const char* pathname, int mode) {
 
   // 如果插入子目录项失败，释放所有资源
   if (!bh) {
+    unlock_inode(dir);
     iput(dir);
     free_block(inode->i_dev, inode->i_zone[0]);
     inode->i_nlinks = 0;
@@ -554,10 +642,11 @@ int cmd_mkdir(const char* pathname, int mode) {
   }
 
   // 插入子目录项成功，设定初始值，释放资源
-  de->inode = inode->i_num;
+  dir_set_inode(de, inode->i_num);
   bh->b_dirt = 1;
   dir->i_nlinks++;
   dir->i_dirt = 1;
+  unlock_inode(dir);
   iput(dir);
   iput(inode);
   brelse(bh);
@@ -581,13 +670,25 @@ int cmd_touch(const char* filename, int mode) {
     iput(dir);
     return -ENOENT;
   }
+  // 文件名中不能含有长文件名的标记字节
+  if (!dir_name_valid(basename, namelen)) {
+    iput(dir);
+    return -EINVAL;
+  }
+  if (is_rdonly(dir)) {
+    iput(dir);
+    return -EROFS;
+  }
 
+  // 修改目录期间持有父目录的写锁
+  lock_inode(dir);
   // 判断要创建的文件是否已经存在
   bh = find_entry(&dir, basename, namelen, &de);
 
   // 如果找到了文件，说明文件已存在，不能重复创建，释放资源并返回错误码
   if (bh) {
     brelse(bh);
+    unlock_inode(dir);
     iput(dir);
     return -EEXIST;
   }
@@ -597,6 +698,7 @@ int cmd_touch(const char* filename, int mode) {
 
   // 如果分配i节点失败，释放父目录i节点并返回错误码
   if (!inode) {
+    unlock_inode(dir);
     iput(dir);
     return -ENOSPC;
   }
@@ -605,12 +707,14 @@ int cmd_touch(const char* filename, int mode) {
   inode->i_mode = mode;
   inode->i_mtime = inode->i_atime = CurrentTime();
   inode->i_dirt = 1;
+  inline_init(inode);
 
   // 将新文件插入到父目录中
   bh = add_entry(dir, basename, namelen, &de);
 
   // 如果插入文件项失败，释放所有资源
   if (!bh) {
+    unlock_inode(dir);
     iput(dir);
     inode->i_nlinks = 0;
     iput(inode);
@@ -618,8 +722,9 @@ int cmd_touch(const char* filename, int mode) {
   }
 
   // 插入文件项成功，设定初始值，释放资源
-  de->inode = inode->i_num;
+  dir_set_inode(de, inode->i_num);
   bh->b_dirt = 1;
+  unlock_inode(dir);
   iput(dir);
   iput(inode);
   brelse(bh);
@@ -645,18 +750,26 @@ int cmd_rmdir(const char* name) {
     iput(dir);
     return -ENOENT;
   }
+  if (is_rdonly(dir)) {
+    iput(dir);
+    return -EROFS;
+  }
 
+  // 修改目录期间持有父目录的写锁
+  lock_inode(dir);
   // 查找要删除的目录项
   bh = find_entry(&dir, basename, namelen, &de);
 
   // 如果没有找到目录项，释放资源并返回错误码
   if (!bh) {
+    unlock_inode(dir);
     iput(dir);
     return -ENOENT;
   }
 
   // 获取要删除的目录的i节点
   if (!(inode = iget(dir->i_dev, de->inode))) {
+    unlock_inode(dir);
     iput(dir);
     brelse(bh);
     return -EPERM;
@@ -664,6 +777,7 @@ int cmd_rmdir(const char* name) {
 
   // 如果有其他进程正在使用该目录，释放资源并返回错误码
   if (inode->i_count > 1) {
+    unlock_inode(dir);
     iput(dir);
     iput(inode);
     brelse(bh);
@@ -673,6 +787,7 @@ int cmd_rmdir(const char* name) {
   // 不允许删除当前目录"."
   if (inode == dir) {
     iput(inode);
+    unlock_inode(dir);
     iput(dir);
     brelse(bh);
     return -EPERM;
@@ -681,23 +796,31 @@ int cmd_rmdir(const char* name) {
   // 如果要删除的不是目录，而是其他类型的文件，释放资源并返回错误码
   if (!S_ISDIR(inode->i_mode)) {
     iput(inode);
+    unlock_inode(dir);
     iput(dir);
     brelse(bh);
     return -ENOTDIR;
   }
 
-  // 如果目录不为空，释放资源并返回错误码
+  // 如果目录不为空，释放资源并返回错误码，检查期间持有该目录的写锁
+  lock_inode(inode);
   if (!empty_dir(inode)) {
+    unlock_inode(inode);
     iput(inode);
+    unlock_inode(dir);
     iput(dir);
     brelse(bh);
     return -ENOTEMPTY;
   }
 
   // 删除目录索引
-  de->inode = 0;
+  dir_set_inode(de, 0);
   bh->b_dirt = 1;
+  dir_add_hole(dir, bh);
   brelse(bh);
+  dcache_invalidate(dir, basename, namelen);
+  dcache_purge_dir(inode);
+  dir_maybe_compact(dir);
 
   // 删除目录
   inode->i_nlinks = 0;
@@ -707,6 +830,8 @@ int cmd_rmdir(const char* name) {
   dir->i_nlinks--;
   dir->i_ctime = dir->i_mtime = CurrentTime();
   dir->i_dirt = 1;
+  unlock_inode(inode);
+  unlock_inode(dir);
   iput(dir);
   iput(inode);
 
@@ -715,8 +840,8 @@ int cmd_rmdir(const char* name) {
   return 0;  // 返回0表示rmdir命令执行成功
 }
 
-// rm命令，删除操作，删除普通文件
-int cmd_rm(const char* name) {
+/*删除普通文件，不输出提示，成功返回0*/
+int sys_unlink(const char* name) {
   const char* basename;
   int namelen;
   struct m_inode *dir, *inode;
@@ -731,18 +856,26 @@ int cmd_rm(const char* name) {
     iput(dir);
     return -ENOENT;
   }
+  if (is_rdonly(dir)) {
+    iput(dir);
+    return -EROFS;
+  }
 
+  // 修改目录期间持有父目录的写锁
+  lock_inode(dir);
   // 查找要删除的文件项
   bh = find_entry(&dir, basename, namelen, &de);
 
   // 如果没有找到文件项，释放资源并返回错误码
   if (!bh) {
+    unlock_inode(dir);
     iput(dir);
     return -ENOENT;
   }
 
   // 获取要删除的文件的i节点
   if (!(inode = iget(dir->i_dev, de->inode))) {
+    unlock_inode(dir);
     iput(dir);
     brelse(bh);
     return -ENOENT;
@@ -751,6 +884,7 @@ int cmd_rm(const char* name) {
   // 如果要删除的是目录，释放资源并返回错误码
   if (S_ISDIR(inode->i_mode)) {
     iput(inode);
+    unlock_inode(dir);
     iput(dir);
     brelse(bh);
     return -EISDIR;
@@ -764,41 +898,481 @@ int cmd_rm(const char* name) {
   }
 
   // 删除文件索引
-  de->inode = 0;
+  dir_set_inode(de, 0);
   bh->b_dirt = 1;
+  dir_add_hole(dir, bh);
   brelse(bh);
+  dcache_invalidate(dir, basename, namelen);
+  dir_maybe_compact(dir);
 
   // 更新文件信息，减少引用数，修改修改时间，并释放资源
   inode->i_nlinks--;
   inode->i_dirt = 1;
   inode->i_ctime = CurrentTime();
   iput(inode);
+  unlock_inode(dir);
   iput(dir);
+  return 0;
+}
 
-  psucc("文件删除成功");
+// rm命令，删除操作，删除普通文件
+int cmd_rm(const char* name) {
+  int code = sys_unlink(name);
 
-  return 0;  // 返回0表示rm命令执行成功
+  if (code == 0) psucc("文件删除成功");
+  return code;  // 返回0表示rm命令执行成功
 }
 
 
-/* 保持目前的所有修改信息 */
+/* 保持目前的所有修改信息，关闭当前会话打开的文件 */
 int cmd_sync() {
-  file* f;
-  for (int fd = 0; fd < NR_OPEN; ++fd) {
-    if ((f = fileSystem->filp[fd])) {
-      iput(f->f_inode);
-      delete f;
-    }
-  }
+  if (current)
+    for (auto& f : current->filp)
+      if (f) {
+        iput(f->f_inode);
+        delete f;
+        f = NULL;
+      }
   realse_inode_table();
-  realse_all_blocks();
+  // 缓冲区为延迟写，这里把修改过的block全部写回，缓冲区本身保留
+  sync_blocks();
   psucc("保存成功");
   return 0;
 }
 
+// cache命令，显示缓冲区与目录项缓存的命中情况
+int cmd_cache() {
+  struct buffer_stats st;
+  get_buffer_stats(&st);
+  printf("hits: %lu\n", st.hits);
+  printf("disk reads: %lu\n", st.reads);
+  printf("disk writes: %lu\n", st.writes);
+  printf("overwrites without read: %lu\n", st.overwrites);
+  struct dcache_stats ds;
+  get_dcache_stats(&ds);
+  printf("dcache entries: %lu\n", ds.entries);
+  printf("dcache hits: %lu\n", ds.hits);
+  printf("dcache negative hits: %lu\n", ds.negative_hits);
+  printf("dcache misses: %lu\n", ds.misses);
+  return 0;
+}
+
+// compact命令，压缩目录，去掉被删除文件留下的空目录项
+int cmd_compact(const string& path) {
+  // 给出路径时由get_inode取得目录，即使它就是当前目录也要iput
+  bool lookup = path != "";
+  struct m_inode* dir = lookup ? get_inode(path.c_str()) : current->pwd;
+  int n;
+
+  if (!dir) return -ENOENT;
+  if (is_rdonly(dir)) {
+    if (lookup) iput(dir);
+    return -EROFS;
+  }
+  lock_inode(dir);
+  n = dir_compact(dir);
+  unlock_inode(dir);
+  if (lookup) iput(dir);
+  if (n < 0) return n;
+  psucc("目录压缩完成，去掉了" + to_string(n) + "个空目录项");
+  return 0;
+}
+
+/*
+fsck命令，fsck [-y]，检查当前目录所在的卷的一致性，-y时修复发现的问题
+修复会重写位图，期间的分配会被覆盖，所以只在没有其他会话使用该卷时进行
+*/
+int cmd_fsck(const string& opt) {
+  struct fsck_stats st;
+  int threads = thread::hardware_concurrency(), n;
+
+  if (opt != "" && opt != "-y") return -EINVAL;
+  if (opt == "-y" && is_rdonly(current->pwd)) return -EROFS;
+  if (opt == "-y" && inodes_busy(current->pwd->i_dev, current->pwd))
+    return -EBUSY;
+  auto start = chrono::steady_clock::now();
+  n = fsck(current->pwd->i_dev, opt == "-y", threads ? threads : 4, &st);
+  double sec =
+      chrono::duration<double>(chrono::steady_clock::now() - start).count();
+  if (n < 0) return n;
+  printf("inodes: %lu, dirs: %lu, zones: %lu, time: %.3fs\n", st.inodes,
+         st.dirs, st.zones, sec);
+  if (!n)
+    psucc("没有发现问题");
+  else if (opt == "-y")
+    psucc("发现" + to_string(n) + "处问题，已修复" + to_string(st.fixed) + "处");
+  else
+    perrorc("发现" + to_string(n) + "处问题，使用fsck -y修复");
+  return 0;
+}
+
+/*
+mount命令，mount 映像文件 目录，把映像文件中的卷挂载到目录上
+不带参数时列出已挂载的卷
+*/
+int cmd_mount(const string& image, const string& path) {
+  struct super_block* s;
+  struct m_inode* dir;
+  string where;
+  int dev, n;
+
+  if (image == "" && path == "") {
+    for (dev = 0; dev < NR_SUPER; dev++) {
+      if (!(s = get_super(dev))) continue;
+      if (dev == ROOT_DEV)
+        where = "/";
+      else if (!s->s_isup || sys_get_work_dir(s->s_isup, where) < 0)
+        continue;
+      printf("%d: %s on %s (v%d, %dK blocks%s)\n", dev, dev_path(dev).c_str(),
+             where.c_str(), s->s_version, s->s_blocksize / 1024,
+             s->s_rd_only ? ", read-only" : "");
+      if ((n = snap_saved(dev)) >= 0)
+        printf("   snapshot %s.snap, %d blocks preserved\n",
+               dev_path(dev).c_str(), n);
+    }
+    return 0;
+  }
+  if (image == "" || path == "") return -EINVAL;
+  if (!(dir = get_inode(path.c_str()))) return -ENOENT;
+  // 挂载成功后dir的引用归超级块所有
+  if ((dev = mount_image(image.c_str(), dir)) < 0) {
+    iput(dir);
+    return dev;
+  }
+  psucc("挂载成功，设备号为" + to_string(dev));
+  return 0;
+}
+
+/*umount命令，umount 目录，卸载挂载在该目录上的卷*/
+int cmd_umount(const string& path) {
+  struct m_inode* inode;
+  int dev, root;
+
+  if (path == "") return -EINVAL;
+  if (!(inode = get_inode(path.c_str()))) return -ENOENT;
+  // 经过挂载点的路径得到的是卷的根目录
+  dev = inode->i_dev;
+  root = inode->i_num == ROOT_INO && inode != fileSystem->root;
+  iput(inode);
+  if (!root) return -EINVAL;
+  if ((dev = umount_dev(dev)) < 0) return dev;
+  psucc("卸载成功");
+  return 0;
+}
+
+/*
+snapshot命令，snapshot [-d]，为当前目录所在的卷创建快照，-d时删除该快照
+快照文件为映像文件名加.snap，mount该文件即可只读地访问快照，见snapshot.cpp
+*/
+int cmd_snapshot(const string& opt) {
+  int dev = current->pwd->i_dev, err;
+
+  if (opt == "-d") {
+    if ((err = snapshot_delete(dev)) < 0) return err;
+    psucc("快照已删除");
+    return 0;
+  }
+  if (opt != "") return -EINVAL;
+  if ((err = snapshot_create(dev)) < 0) return err;
+  psucc("快照已创建：" + dev_path(dev) + ".snap");
+  return 0;
+}
+
+/*dir是否就是inode或在inode之下*/
+static int in_subtree(struct m_inode* dir, struct m_inode* inode) {
+  struct m_inode *p = igrab(dir), *f;
+
+  while (p != inode && p != fileSystem->root && (f = get_father(p))) {
+    iput(p);
+    p = f;
+  }
+  iput(p);
+  return p == inode;
+}
+
+/*
+cp命令，cp [-r] 源 目标，复制文件或目录树(目录需要-r)，可以复制到其他卷中
+目标是已存在的目录时复制到其中，否则复制为该文件名，多个线程同时复制
+*/
+int cmd_cp(const string& a, const string& b, const string& c) {
+  int recursive = (a == "-r"), namelen, err, threads;
+  const string &from = recursive ? b : a, &to = recursive ? c : b;
+  const char* basename;
+  struct m_inode *src, *dir;
+  struct copy_stats st;
+  string name;
+
+  if (from == "" || to == "") return -EINVAL;
+  if (!(src = get_inode(from.c_str()))) return -ENOENT;
+  if (S_ISDIR(src->i_mode) && !recursive) {
+    iput(src);
+    return -EISDIR;
+  }
+  if ((dir = get_inode(to.c_str())) && S_ISDIR(dir->i_mode)) {
+    // 复制到目录中，使用源路径的最后一个文件名
+    name = from.substr(0, from.find_last_not_of('/') + 1);
+    name = name.substr(name.find_last_of('/') + 1);
+  } else if (dir) {
+    iput(dir);
+    iput(src);
+    return -EEXIST;
+  } else if ((dir = dir_namei(to.c_str(), &namelen, &basename))) {
+    name = string(basename, namelen);
+  }
+  if (!dir || name == "" || name == "." || name == "..") {
+    iput(dir);
+    iput(src);
+    return dir ? -EINVAL : -ENOENT;
+  }
+  if (is_rdonly(dir)) {
+    iput(dir);
+    iput(src);
+    return -EROFS;
+  }
+  // 不能把目录复制到它自己之下
+  if (S_ISDIR(src->i_mode) && in_subtree(dir, src)) {
+    iput(dir);
+    iput(src);
+    return -EINVAL;
+  }
+
+  threads = thread::hardware_concurrency();
+  auto start = chrono::steady_clock::now();
+  err = copy_tree(src, dir, name.c_str(), threads ? threads : 4, &st);
+  double sec =
+      chrono::duration<double>(chrono::steady_clock::now() - start).count();
+  iput(dir);
+  iput(src);
+  printf("files: %lu, dirs: %lu, %.1fMB, time: %.3fs, %.0f files/s\n",
+         st.files, st.dirs, st.bytes / 1048576.0, sec,
+         (st.files + st.dirs) / sec);
+  return err;
+}
+
+/*stress的一个线程：在自己的会话中打开一组文件反复读写，并查找公共目录*/
+static void stress_worker(int t, int ops) {
+  string dir = "/stress/t" + to_string(t);
+  char buf[STRESS_IO + 1];
+  struct dirent_plus ents[STRESS_FILES + 1];
+  struct m_inode* inode;
+  int i, pos, fd, fds[STRESS_FILES];
+
+  // 每个线程一个会话，在自己的工作目录下用相对路径打开文件
+  current = session_create();
+  cmd_cd(dir);
+  for (i = 0; i < STRESS_FILES; i++)
+    fds[i] = sys_open("f" + to_string(i), O_RDWR, S_IFREG);
+  memset(buf, 'a' + t % 26, STRESS_IO);
+  for (i = 0; i < ops; i++) {
+    if ((fd = fds[i % STRESS_FILES]) < 0) continue;
+    sys_lseek(fd, 0, 0);
+    sys_write(fd, buf, STRESS_IO);
+    sys_lseek(fd, 0, 0);
+    sys_read(fd, buf, STRESS_IO);
+    // 所有线程共同查找的公共目录
+    if ((inode = get_inode("/stress"))) iput(inode);
+    if (i % STRESS_FILES == STRESS_FILES - 1 && (inode = get_inode("."))) {
+      pos = 0;
+      while (sys_getdents_plus(inode, &pos, ents, STRESS_FILES + 1) > 0)
+        ;
+      iput(inode);
+    }
+  }
+  session_destroy(current);
+}
+
+/*stress的只读线程：反复读取已经在缓冲区中的block*/
+static void stress_reader(int t, int ops, const unsigned int* zones, int n,
+                          unsigned long* sum) {
+  struct buffer_head* bh;
+  unsigned long s = 0;
+  for (int i = 0; i < ops; i++)
+    if ((bh = bread(ROOT_DEV, zones[(i * 7 + t) % n]))) {
+      s += (unsigned char)bh->b_data[i % 64];
+      brelse(bh);
+    }
+  *sum = s;
+}
+
+/*准备只读测试的文件，返回其数据块号的个数*/
+static int stress_read_file(unsigned int* zones) {
+  struct m_inode* inode;
+  struct file f;
+  int n;
+
+  if (open_file("/stress/read", O_RDWR, S_IFREG, inode) < 0) return 0;
+  lock_inode(inode);
+  if (inode->i_size == 0) {
+    int bs = get_super(inode->i_dev)->s_blocksize;
+    vector<char> buf(bs * STRESS_READ_BLOCKS, 'r');
+    f.f_flags = O_RDWR;
+    f.f_pos = 0;
+    file_write(inode, &f, buf.data(), buf.size());
+  }
+  n = map_blocks(inode, 0, STRESS_READ_BLOCKS, zones, 0);
+  unlock_inode(inode);
+  iput(inode);
+  return n;
+}
+
+/*文件的数据块由几段连续的块组成*/
+static int file_extents(struct m_inode* inode) {
+  unsigned int zones[64], last = 0;
+  int bs = get_super(inode->i_dev)->s_blocksize;
+  int block = 0, n, k, extents = 0;
+
+  while ((n = map_blocks(inode, block, 64, zones, 0)) > 0) {
+    for (k = 0; k < n && block * bs < (int)inode->i_size; k++, block++) {
+      if (zones[k] && zones[k] != last + 1) extents++;
+      last = zones[k];
+    }
+    if (k < n) break;
+  }
+  return extents;
+}
+
+/*stress的并行写线程：在自己的目录下从头写一个文件，相当于同时运行多个dd*/
+static void stress_dd(int t, int* extents) {
+  vector<char> buf(STRESS_DD_CHUNK, 'A' + t % 26);
+  struct m_inode* inode;
+  int fd;
+
+  current = session_create();
+  cmd_cd("/stress/t" + to_string(t));
+  if ((fd = sys_open("dd", O_RDWR, S_IFREG)) >= 0) {
+    inode = current->filp[fd]->f_inode;
+    lock_inode(inode);
+    truncate(inode);
+    unlock_inode(inode);
+    for (int i = 0; i < STRESS_DD_CHUNKS; i++)
+      sys_write(fd, buf.data(), STRESS_DD_CHUNK);
+    *extents = file_extents(inode);
+    sys_close(fd);
+  }
+  session_destroy(current);
+}
+
+/*
+stress的边写边sync线程：以STRESS_IO字节为单位把文件写两遍，第二遍覆盖第一遍，
+同时有线程反复sync，写完后读回检查，写回期间的修改丢失时读到的是第一遍的内容，
+返回内容不对的字节数
+*/
+static void stress_sync_writer(int t, atomic<int>* writing, int* bad) {
+  const int size = STRESS_DD_CHUNK * STRESS_DD_CHUNKS;
+  char buf[STRESS_IO + 1];
+  struct m_inode* inode;
+  int fd, pass, pos, k;
+
+  current = session_create();
+  cmd_cd("/stress/t" + to_string(t));
+  if ((fd = sys_open("sync", O_RDWR, S_IFREG)) >= 0) {
+    // 再次运行时先释放上次写的块，释放时sync可能正持有它们
+    inode = current->filp[fd]->f_inode;
+    lock_inode(inode);
+    truncate(inode);
+    unlock_inode(inode);
+    for (pass = 0; pass < 2; pass++) {
+      sys_lseek(fd, 0, 0);
+      memset(buf, 'a' + (t + pass) % 26, STRESS_IO);
+      for (pos = 0; pos < size; pos += STRESS_IO) sys_write(fd, buf, STRESS_IO);
+    }
+    writing->fetch_sub(1);
+    // 文件比缓冲区大，前面的block已经被换出，要从磁盘读回
+    sys_lseek(fd, 0, 0);
+    for (pos = 0; pos < size; pos += STRESS_IO) {
+      sys_read(fd, buf, STRESS_IO);
+      for (k = 0; k < STRESS_IO; k++) *bad += buf[k] != 'a' + (t + 1) % 26;
+    }
+    sys_close(fd);
+  } else {
+    writing->fetch_sub(1);
+  }
+  session_destroy(current);
+}
+/*stress的写回线程：写线程都写完之前反复sync*/
+static void stress_syncer(atomic<int>* writing, int* syncs, int* blocks) {
+  while (writing->load() > 0) {
+    *blocks += sync_blocks();
+    (*syncs)++;
+  }
+}
+
+/*
+stress命令，多线程压力测试，输出每秒操作数：
+先是每个线程各自一个会话，在/stress/t<i>下读写文件，
+然后所有线程只读同一个文件已经在缓冲区中的block，测试bread的无锁路径，
+之后每个线程同时写一个文件，输出写入速度与文件平均由几段连续的块组成，
+最后一边反复sync一边写，检查写回期间的修改没有丢失
+*/
+int cmd_stress(const string& threads, const string& ops) {
+  vector<thread> workers;
+  unsigned int zones[STRESS_READ_BLOCKS];
+  unsigned long tn, tm;
+  int n, m, i, code, nzones;
+
+  // 读缓冲区的一轮共n*m*100次，要在int的范围内
+  if (parse_uint(threads, 1, &tn) < 0 || parse_uint(ops, 10000, &tm) < 0 ||
+      !tn || !tm || tn > 1024 || tm > 1000000 || tn * tm > 10000000)
+    return -EINVAL;
+  n = tn;
+  m = tm;
+  if ((code = cmd_mkdir("/stress", S_IFDIR)) < 0 && code != -EEXIST)
+    return code;
+  for (i = 0; i < n; i++) {
+    string dir = "/stress/t" + to_string(i);
+    if ((code = cmd_mkdir(dir.c_str(), S_IFDIR)) < 0 && code != -EEXIST)
+      return code;
+  }
+  auto start = chrono::steady_clock::now();
+  for (i = 0; i < n; i++) workers.emplace_back(stress_worker, i, m);
+  for (auto& w : workers) w.join();
+  double sec =
+      chrono::duration<double>(chrono::steady_clock::now() - start).count();
+  printf("threads: %d, ops: %d, time: %.3fs, %.0f ops/s\n", n, n * m, sec,
+         n * m / sec);
+
+  if ((nzones = stress_read_file(zones)) <= 0) return -ENOSPC;
+  vector<unsigned long> sums(n);
+  m *= 100;  // 一次bread远比上面的一次操作快
+  workers.clear();
+  start = chrono::steady_clock::now();
+  for (i = 0; i < n; i++)
+    workers.emplace_back(stress_reader, i, m, zones, nzones, &sums[i]);
+  for (auto& w : workers) w.join();
+  sec = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+  printf("cached reads: %d, time: %.3fs, %.0f reads/s\n", n * m, sec,
+         n * m / sec);
+
+  vector<int> extents(n);
+  workers.clear();
+  start = chrono::steady_clock::now();
+  for (i = 0; i < n; i++) workers.emplace_back(stress_dd, i, &extents[i]);
+  for (auto& w : workers) w.join();
+  sec = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+  double mb = (double)n * STRESS_DD_CHUNK * STRESS_DD_CHUNKS / (1 << 20);
+  printf("dd: %.0fMB, time: %.3fs, %.1fMB/s, extents per file: %.1f\n", mb,
+         sec, mb / sec, accumulate(extents.begin(), extents.end(), 0.0) / n);
+
+  vector<int> bad(n);
+  atomic<int> writing(n);
+  int syncs = 0, synced = 0;
+  workers.clear();
+  start = chrono::steady_clock::now();
+  for (i = 0; i < n; i++)
+    workers.emplace_back(stress_sync_writer, i, &writing, &bad[i]);
+  thread syncer(stress_syncer, &writing, &syncs, &synced);
+  for (auto& w : workers) w.join();
+  syncer.join();
+  sec = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+  printf("sync during writes: %d syncs, %d blocks written, time: %.3fs, "
+         "lost bytes: %d\n",
+         syncs, synced, sec, accumulate(bad.begin(), bad.end(), 0));
+  return 0;
+}
+
 // exit命令，退出文件系统，将所有信息写回磁盘
 int cmd_exit() {
-  iput(fileSystem->current);
+  session_destroy(current);
   iput(fileSystem->root);
   cmd_sync();
   printfc(FG_YELLOW, string("系统时间为: ") + longtoTime(CurrentTime()));
@@ -860,6 +1434,23 @@ int cmd_dd(const char* name) {
   return 0;
 }
 
+/*
+ * @brief 解析命令中的非负整数参数，s为空时取默认值def
+ * @return 成功返回0，不是非负整数时返回-EINVAL
+ */
+int parse_uint(const string& s, unsigned long def, unsigned long* out) {
+  char* end;
+
+  if (s == "") {
+    *out = def;
+    return 0;
+  }
+  if (!isdigit((unsigned char)s[0])) return -EINVAL;
+  errno = 0;
+  *out = strtoul(s.c_str(), &end, 10);
+  return (*end || errno) ? -EINVAL : 0;
+}
+
 void myhint(int errorCode) {
   if (errorCode == 0) {
     // cout << "操作成功" << endl;
@@ -881,6 +1472,14 @@ void myhint(int errorCode) {
     perrorc("无法申请到资源，空间不足");
   } else if (errorCode == -EISDIR) {
     perrorc("路径指向为目录文件");
+  } else if (errorCode == -EIO) {
+    perrorc("磁盘读写错误");
+  } else if (errorCode == -EBUSY) {
+    perrorc("目录或卷正在被使用");
+  } else if (errorCode == -EXDEV) {
+    perrorc("两个卷的块大小或格式不同");
+  } else if (errorCode == -EROFS) {
+    perrorc("卷为只读的快照");
   } else {
     perrorc("未知错误");
   }
@@ -1,25 +1,55 @@
 #pragma once
+#include<functional>
 #include<iostream>
 #include<string>
-int sys_open(std::string filename, int flag, int mode);
+int sys_open(const std::string& filename, int flag, int mode);
 int sys_close(unsigned int fd);
 int sys_read(unsigned int fd, char * buf, int count);
 int sys_write(unsigned int fd, char * buf, int count);
 int sys_lseek(unsigned int fd, off_t offset, int origin);
 int sys_get_work_dir(struct m_inode* inode, std::string & out);
+int sys_unlink(const char * name);
+int sys_getdents_plus(struct m_inode* dir, int* pos, struct dirent_plus* out, int count);
+struct file* get_file(unsigned int fd);
+int fd_install(struct m_inode* inode, int flag, int mode);
 
-int cmd_ls(std::string s);
-int cmd_stat(std::string path);
-int cmd_cd(std::string s);
+/*异步接口，见aio.cpp，请求完成前buf要一直有效，
+  提交请求的线程退出时会等它的请求完成，不再执行回调*/
+typedef std::function<void(int)> aio_callback;
+int aio_open(const std::string& filename, int flag, int mode, aio_callback cb);
+int aio_read(unsigned int fd, char * buf, int count, off_t pos, aio_callback cb);
+int aio_write(unsigned int fd, char * buf, int count, off_t pos, aio_callback cb);
+int aio_close(unsigned int fd, aio_callback cb);
+int aio_poll(int min);
+int aio_inflight();
+
+int cmd_ls(const std::string& s);
+int cmd_stat(const std::string& path);
+int cmd_cd(const std::string& s);
 int cmd_pwd();
-int cmd_cat(std::string s);
-int cmd_vi(std::string path);
+int cmd_cat(const std::string& s);
+int cmd_vi(const std::string& path);
 int cmd_mkdir(const char * pathname, int mode);
 int cmd_touch(const char * filename, int mode);
 int cmd_rmdir(const char * name);
 int cmd_rm(const char * name);
 int cmd_sync();
+int cmd_cache();
+int cmd_compact(const std::string& path);
+int cmd_fsck(const std::string& opt);
+int cmd_mount(const std::string& image, const std::string& path);
+int cmd_umount(const std::string& path);
+int cmd_snapshot(const std::string& opt);
+int cmd_cp(const std::string& a, const std::string& b, const std::string& c);
+int cmd_aiobench(const std::string& reads);
+int cmd_stress(const std::string& threads, const std::string& ops);
 int cmd_exit();
 int cmd_dd(const char* name);
+int cmd_allocbench(const std::string& lookups);
+int cmd_createbench(const std::string& files);
+int cmd_lookupbench(const std::string& entries);
+int cmd_seqbench(const std::string& mb);
+int cmd_writebench(const std::string& mb);
 
-void myhint(int code);
\ No newline at end of file
+void myhint(int code);
+int parse_uint(const std::string& s, unsigned long def, unsigned long* out);
\ No newline at end of file
@@ -6,48 +6,95 @@
 
 #include "fs.h"
 
-static void free_ind(int dev, int block) {
+/*释放一个depth级的索引块，以及它所指向的全部数据块*/
+static void free_ind(struct super_block *sb, int dev, int block, int depth) {
   struct buffer_head *bh;
-  unsigned short *p;
+  unsigned int nr;
   int i;
 
   if (!block) return;
-  if ((bh = bread(block))) {
-    p = (unsigned short *)bh->b_data;
-    for (i = 0; i < 512; i++, p++)
-      if (*p) free_block(dev, *p);
+  if ((bh = bread(dev, block))) {
+    for (i = 0; i < sb->s_zones_per_block; i++)
+      if ((nr = get_zone(sb, bh->b_data, i))) {
+        if (depth > 1)
+          free_ind(sb, dev, nr, depth - 1);
+        else
+          free_block(dev, nr);
+      }
     brelse(bh);
   }
   free_block(dev, block);
 }
 
-static void free_dind(int dev, int block) {
+/*释放depth级索引块所管理的第start个逻辑块及之后的数据块，start为0时索引块本身也被释放*/
+static void free_ind_from(struct super_block *sb, int dev, int block, int depth,
+                          int start) {
   struct buffer_head *bh;
-  unsigned short *p;
-  int i;
+  unsigned int nr;
+  int i, span, s;
 
-  if (!block) return;
-  if ((bh = bread(block))) {
-    p = (unsigned short *)bh->b_data;
-    for (i = 0; i < 512; i++, p++)
-      if (*p) free_ind(dev, *p);
-    brelse(bh);
+  if (!start) {
+    free_ind(sb, dev, block, depth);
+    return;
   }
-  free_block(dev, block);
+  if (!block || !(bh = bread(dev, block))) return;
+  for (span = 1, i = 1; i < depth; i++) span *= sb->s_zones_per_block;
+  for (i = start / span; i < sb->s_zones_per_block; i++) {
+    if (!(nr = get_zone(sb, bh->b_data, i))) continue;
+    s = (i == start / span) ? start % span : 0;
+    if (depth > 1)
+      free_ind_from(sb, dev, nr, depth - 1, s);
+    else
+      free_block(dev, nr);
+    if (!s) {
+      set_zone(sb, bh->b_data, i, 0);
+      bh->b_dirt = 1;
+    }
+  }
+  brelse(bh);
 }
-/*文件截断函数，清空文件的数据块（实际上是删除指向数据块的索引），同时将数据块从磁盘删除*/
-void truncate(struct m_inode *inode) {
+
+/*释放文件第from个逻辑块及之后的所有数据块，i_size由调用者设置*/
+void truncate_blocks(struct m_inode *inode, int from) {
+  struct super_block *sb;
+  long long base, span;
   int i;
-  /*只清空普通文件和目录文件*/
-  if (!(S_ISREG(inode->i_mode) || S_ISDIR(inode->i_mode))) return;
-  for (i = 0; i < 7; i++)
+
+  if (!(sb = get_super(inode->i_dev))) return;
+  for (i = from; i < NR_DIRECT; i++)
     if (inode->i_zone[i]) {
       free_block(inode->i_dev, inode->i_zone[i]);
       inode->i_zone[i] = 0;
     }
-  free_ind(inode->i_dev, inode->i_zone[7]);
-  free_dind(inode->i_dev, inode->i_zone[8]);
-  inode->i_zone[7] = inode->i_zone[8] = 0;
+  /*i_zone[7]为一级索引，i_zone[8]为二级索引，v2格式的i_zone[9]为三级索引*/
+  base = NR_DIRECT;
+  span = sb->s_zones_per_block;
+  for (i = NR_DIRECT; i < NR_ZONES_V2; i++, base += span,
+      span *= sb->s_zones_per_block) {
+    if (from >= base + span) continue;
+    free_ind_from(sb, inode->i_dev, inode->i_zone[i], i - NR_DIRECT + 1,
+                  from > base ? from - base : 0);
+    if (from <= base) inode->i_zone[i] = 0;
+  }
+  inode->i_dirt = 1;
+}
+
+/*文件截断函数，清空文件的数据块（实际上是删除指向数据块的索引），同时将数据块从磁盘删除*/
+void truncate(struct m_inode *inode) {
+  struct super_block *sb;
+  /*只清空普通文件和目录文件*/
+  if (!(S_ISREG(inode->i_mode) || S_ISDIR(inode->i_mode))) return;
+  if (!(sb = get_super(inode->i_dev))) return;
+  /*内联存放的文件没有数据块，i_zone中是文件内容*/
+  if (inode->i_flags & I_INLINE) {
+    memset(inode->i_zone, 0, sizeof(inode->i_zone));
+    inode->i_size = 0;
+    inode->i_dirt = 1;
+    inode->i_mtime = inode->i_ctime = CurrentTime();
+    return;
+  }
+  truncate_blocks(inode, 0);
+  inode->i_goal = 0;
   inode->i_size = 0;
   inode->i_dirt = 1;
   inode->i_mtime = inode->i_ctime = CurrentTime();